@@ -53,10 +53,22 @@ public class GameDirectorPlugin : ModuleRules
             // Delay-load so Windows resolves llama.dll from our staged location at runtime
             PublicDelayLoadDLLs.Add("llama.dll");
 
+            // ggml threadpool API (ggml_threadpool_new etc.) is exported by the ggml libs, not by llama
+            foreach (string GgmlName in new string[] { "ggml-base", "ggml-cpu" })
+            {
+                string GgmlLib = Path.Combine(WinLibDir, GgmlName + ".lib");
+                if (File.Exists(GgmlLib))
+                {
+                    PublicAdditionalLibraries.Add(GgmlLib);
+                    PublicDelayLoadDLLs.Add(GgmlName + ".dll");
+                }
+            }
+
             // Stage llama.dll + any dependent DLLs you ship with the plugin
             string[] DllsToStage = new string[]
             {
                 "llama.dll",
+                "ggml-base.dll", "ggml-cpu.dll",
                 // Add the exact ones you actually ship (match your build!):
                 // "ggml.dll", "ggml-cuda.dll", "ggml-dml.dll",
                 // "cudart64_12.dll", "cublas64_12.dll", "cublasLt64_12.dll", "nvJitLink_120_0.dll",
@@ -0,0 +1,180 @@
+#include "DirectorDecisionCache.h"
+#include "HAL/FileManager.h"
+#include "Misc/Paths.h"
+#include "Misc/ScopeLock.h"
+#include "Hash/CityHash.h"
+#include "Serialization/Archive.h"
+
+static constexpr uint32 kCacheMagic = 0x43444447; // "GDDC"
+static constexpr uint32 kCacheVersion = 1;
+
+FDirectorDecisionCache::FDirectorDecisionCache(int32 InMaxEntries)
+    : Entries(FMath::Max(1, InMaxEntries))
+    , MaxEntries(FMath::Max(1, InMaxEntries))
+{
+}
+
+uint64 FDirectorDecisionCache::MakeKey(uint64 ModelKey, const FString& Prompt, const FString& Intent, const FString& AssistantPrefix, int32 MaxNew, int32 TopK, float TopP, float Temp)
+{
+    FTCHARToUTF8 PromptUtf8(*Prompt);
+    FTCHARToUTF8 IntentUtf8(*Intent);
+    FTCHARToUTF8 PrefixUtf8(*AssistantPrefix);
+
+    uint64 Key = CityHash64WithSeed(PromptUtf8.Get(), PromptUtf8.Length(), ModelKey);
+    Key = CityHash64WithSeed(IntentUtf8.Get(), IntentUtf8.Length(), Key);
+    Key = CityHash64WithSeed(PrefixUtf8.Get(), PrefixUtf8.Length(), Key);
+
+    struct { int32 MaxNew; int32 TopK; float TopP; float Temp; } Sampling = { MaxNew, TopK, TopP, Temp };
+    return CityHash64WithSeed(reinterpret_cast<const char*>(&Sampling), sizeof(Sampling), Key);
+}
+
+bool FDirectorDecisionCache::Find(uint64 Key, FString& OutJson)
+{
+    FScopeLock Lock(&Mutex);
+    const FEntry* Entry = Entries.FindAndTouch(Key);
+    if (!Entry)
+    {
+        ++Misses;
+        return false;
+    }
+    if (Entry->ExpiresUnix <= FDateTime::UtcNow().ToUnixTimestamp())
+    {
+        Entries.Remove(Key);
+        bDirty = true;
+        ++Misses;
+        return false;
+    }
+    OutJson = Entry->Json;
+    ++Hits;
+    return true;
+}
+
+void FDirectorDecisionCache::Add(uint64 Key, const FString& Json, double TtlSeconds)
+{
+    if (TtlSeconds <= 0.0 || Json.IsEmpty()) return;
+
+    FEntry Entry;
+    Entry.Json = Json;
+    Entry.ExpiresUnix = FDateTime::UtcNow().ToUnixTimestamp() + (int64)TtlSeconds;
+
+    FScopeLock Lock(&Mutex);
+    Entries.Add(Key, MoveTemp(Entry));
+    bDirty = true;
+}
+
+void FDirectorDecisionCache::SetMaxEntries(int32 InMaxEntries)
+{
+    InMaxEntries = FMath::Max(1, InMaxEntries);
+
+    FScopeLock Lock(&Mutex);
+    if (InMaxEntries == MaxEntries) return;
+
+    // Iteration runs most recent first; re-add the survivors oldest first to keep their order
+    TArray<TPair<uint64, FEntry>> Keep;
+    for (TLruCache<uint64, FEntry>::TConstIterator It(Entries); It && Keep.Num() < InMaxEntries; ++It)
+    {
+        Keep.Emplace(It.Key(), It.Value());
+    }
+    Entries.Empty(InMaxEntries);
+    for (int32 i = Keep.Num() - 1; i >= 0; --i)
+    {
+        Entries.Add(Keep[i].Key, MoveTemp(Keep[i].Value));
+    }
+    MaxEntries = InMaxEntries;
+    bDirty = true;
+}
+
+void FDirectorDecisionCache::Empty()
+{
+    FScopeLock Lock(&Mutex);
+    Entries.Empty(MaxEntries);
+    bDirty = true;
+}
+
+FString FDirectorDecisionCache::DefaultPath()
+{
+    return FPaths::ProjectSavedDir() / TEXT("GameDirector") / TEXT("DecisionCache.bin");
+}
+
+// Layout: magic, version, count, then per entry (oldest first) key, expiry, UTF-8 length, UTF-8 bytes
+bool FDirectorDecisionCache::Load(const FString& Path)
+{
+    TUniquePtr<FArchive> Ar(IFileManager::Get().CreateFileReader(*Path));
+    if (!Ar) return false;
+
+    uint32 Magic = 0, Version = 0;
+    int32 Count = 0;
+    *Ar << Magic << Version << Count;
+    if (Magic != kCacheMagic || Version != kCacheVersion || Count < 0)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Decision cache %s has an unknown format, ignoring it"), *Path);
+        return false;
+    }
+
+    const int64 Now = FDateTime::UtcNow().ToUnixTimestamp();
+    int32 NumLoaded = 0;
+
+    FScopeLock Lock(&Mutex);
+    Entries.Empty(MaxEntries);
+    TArray<ANSICHAR> Utf8;
+    for (int32 i = 0; i < Count && !Ar->IsError(); ++i)
+    {
+        uint64 Key = 0;
+        int64 ExpiresUnix = 0;
+        int32 Len = 0;
+        *Ar << Key << ExpiresUnix << Len;
+        if (Len < 0 || Len > 1024 * 1024) break;
+
+        Utf8.SetNumUninitialized(Len);
+        Ar->Serialize(Utf8.GetData(), Len);
+        if (Ar->IsError() || ExpiresUnix <= Now) continue;
+
+        FEntry Entry;
+        FUTF8ToTCHAR Conv(Utf8.GetData(), Len);
+        Entry.Json = FString(Conv.Length(), Conv.Get());
+        Entry.ExpiresUnix = ExpiresUnix;
+        Entries.Add(Key, MoveTemp(Entry));
+        ++NumLoaded;
+    }
+    bDirty = false;
+
+    UE_LOG(LogTemp, Display, TEXT("Decision cache: loaded %d of %d entries from %s"), NumLoaded, Count, *Path);
+    return true;
+}
+
+bool FDirectorDecisionCache::Save(const FString& Path)
+{
+    // Copy out under the lock, write without it
+    TArray<TPair<uint64, FEntry>> Snapshot;
+    {
+        FScopeLock Lock(&Mutex);
+        Snapshot.Reserve(Entries.Num());
+        for (TLruCache<uint64, FEntry>::TConstIterator It(Entries); It; ++It)
+        {
+            Snapshot.Emplace(It.Key(), It.Value());
+        }
+        bDirty = false;
+    }
+
+    // Write to a temp file and swap it in, so a crash mid-save never leaves a truncated cache behind
+    const FString TempPath = Path + TEXT(".tmp");
+    {
+        TUniquePtr<FArchive> Ar(IFileManager::Get().CreateFileWriter(*TempPath));
+        if (!Ar) return false;
+
+        uint32 Magic = kCacheMagic, Version = kCacheVersion;
+        int32 Count = Snapshot.Num();
+        *Ar << Magic << Version << Count;
+        for (int32 i = Snapshot.Num() - 1; i >= 0; --i)
+        {
+            uint64 Key = Snapshot[i].Key;
+            int64 ExpiresUnix = Snapshot[i].Value.ExpiresUnix;
+            FTCHARToUTF8 Utf8(*Snapshot[i].Value.Json);
+            int32 Len = Utf8.Length();
+            *Ar << Key << ExpiresUnix << Len;
+            Ar->Serialize(const_cast<ANSICHAR*>(Utf8.Get()), Len);
+        }
+        if (!Ar->Close()) return false;
+    }
+    return IFileManager::Get().Move(*Path, *TempPath, /*Replace*/ true);
+}
@@ -0,0 +1,193 @@
+#include "DirectorModelSelect.h"
+#include "HAL/FileManager.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMemory.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "Serialization/JsonWriter.h"
+
+static TAutoConsoleVariable<FString> CVarModelQuant(
+    TEXT("GameDirector.ModelQuant"),
+    TEXT(""),
+    TEXT("Quantization of the director model to load (F16, Q8_0, Q5_K_M, Q4_K_M). Empty = the best one that fits in free RAM."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarModelRamReserveMB(
+    TEXT("GameDirector.ModelRamReserveMB"),
+    2048,
+    TEXT("Free RAM (MB) left for the game and the KV cache when choosing which model quantization fits."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarModelMinValidity(
+    TEXT("GameDirector.ModelMinValidity"),
+    0.9f,
+    TEXT("Variants whose quantize report shows a lower share of valid director JSON are skipped. 0 = ignore the report."),
+    ECVF_Default);
+
+const TArray<FString>& FDirectorModelSelector::QuantNames()
+{
+    static const TArray<FString> Names = { TEXT("F16"), TEXT("Q8_0"), TEXT("Q5_K_M"), TEXT("Q4_K_M") };
+    return Names;
+}
+
+FString FDirectorModelSelector::VariantPath(const FString& SourcePath, const FString& Quant)
+{
+    if (Quant == TEXT("F16")) return SourcePath;
+
+    // gptoss20b.f16pure.gguf -> gptoss20b.Q4_K_M.gguf: the precision tag of the source goes
+    FString Stem = FPaths::GetBaseFilename(SourcePath);
+    FString Left, Tag;
+    if (Stem.Split(TEXT("."), &Left, &Tag, ESearchCase::IgnoreCase, ESearchDir::FromEnd)
+        && (Tag.StartsWith(TEXT("f16"), ESearchCase::IgnoreCase) || Tag.StartsWith(TEXT("bf16"), ESearchCase::IgnoreCase)
+            || Tag.StartsWith(TEXT("f32"), ESearchCase::IgnoreCase)))
+    {
+        Stem = Left;
+    }
+    return FPaths::GetPath(SourcePath) / FString::Printf(TEXT("%s.%s.gguf"), *Stem, *Quant);
+}
+
+FString FDirectorModelSelector::ReportPath(const FString& SourcePath)
+{
+    return FPaths::ChangeExtension(VariantPath(SourcePath, TEXT("report")), TEXT("json"));
+}
+
+TArray<FDirectorModelVariant> FDirectorModelSelector::FindVariants(const FString& SourcePath)
+{
+    TArray<FDirectorModelVariant> Reported;
+    LoadReport(SourcePath, Reported);
+
+    TArray<FDirectorModelVariant> Found;
+    for (const FString& Quant : QuantNames())
+    {
+        const FString Path = VariantPath(SourcePath, Quant);
+        const int64 Size = IFileManager::Get().FileSize(*Path);
+        if (Size <= 0) continue;
+
+        FDirectorModelVariant Variant;
+        if (const FDirectorModelVariant* R = Reported.FindByPredicate([&Quant](const FDirectorModelVariant& V) { return V.Quant == Quant; }))
+        {
+            Variant = *R;
+        }
+        Variant.Quant = Quant;
+        Variant.Path = Path;
+        Variant.SizeBytes = Size;
+        Found.Add(MoveTemp(Variant));
+    }
+    return Found;
+}
+
+FString FDirectorModelSelector::Select(const FString& SourcePath)
+{
+    const TArray<FDirectorModelVariant> Variants = FindVariants(SourcePath);
+    if (Variants.Num() == 0) return SourcePath;
+
+    // 1) Forced quantization
+    const FString Forced = CVarModelQuant.GetValueOnAnyThread().TrimStartAndEnd();
+    if (!Forced.IsEmpty())
+    {
+        for (const FDirectorModelVariant& V : Variants)
+        {
+            if (V.Quant.Equals(Forced, ESearchCase::IgnoreCase)) return V.Path;
+        }
+        UE_LOG(LogTemp, Warning, TEXT("Model select: no %s variant of %s, choosing automatically"), *Forced, *SourcePath);
+    }
+
+    // 2) Highest precision that fits in free RAM; weights are mmapped but have to stay resident to decode at speed
+    const int64 FreeBytes = (int64)FPlatformMemory::GetStats().AvailablePhysical;
+    const int64 Budget = FreeBytes - (int64)CVarModelRamReserveMB.GetValueOnAnyThread() * 1024 * 1024;
+    const float MinValidity = CVarModelMinValidity.GetValueOnAnyThread();
+    const FDirectorModelVariant* SmallestValid = nullptr;
+    for (const FDirectorModelVariant& V : Variants)
+    {
+        if (MinValidity > 0.f && V.Validity >= 0.f && V.Validity < MinValidity)
+        {
+            UE_LOG(LogTemp, Display, TEXT("Model select: skipping %s, %.0f%% valid in the quantize report"), *V.Quant, V.Validity * 100.f);
+            continue;
+        }
+        if (V.SizeBytes <= Budget)
+        {
+            UE_LOG(LogTemp, Display, TEXT("Model select: %s (%.1f GB, %.1f GB free)"), *V.Quant, V.SizeBytes / 1e9, FreeBytes / 1e9);
+            return V.Path;
+        }
+        SmallestValid = &V;
+    }
+
+    // 3) Nothing fits: the smallest one pages the least, among those the report did not reject if there are any
+    const FDirectorModelVariant& Smallest = SmallestValid ? *SmallestValid : Variants.Last();
+    UE_LOG(LogTemp, Warning, TEXT("Model select: no variant fits in %.1f GB free RAM, loading %s (%.1f GB)"),
+        FreeBytes / 1e9, *Smallest.Quant, Smallest.SizeBytes / 1e9);
+    return Smallest.Path;
+}
+
+bool FDirectorModelSelector::SaveReport(const FString& SourcePath, const TArray<FDirectorModelVariant>& Variants)
+{
+    // merge, so measuring one variant again keeps the others
+    TArray<FDirectorModelVariant> Merged;
+    LoadReport(SourcePath, Merged);
+    for (const FDirectorModelVariant& V : Variants)
+    {
+        Merged.RemoveAll([&V](const FDirectorModelVariant& Old) { return Old.Quant == V.Quant; });
+        Merged.Add(V);
+    }
+
+    TArray<TSharedPtr<FJsonValue>> Items;
+    for (const FDirectorModelVariant& V : Merged)
+    {
+        TSharedRef<FJsonObject> Obj = MakeShared<FJsonObject>();
+        Obj->SetStringField(TEXT("quant"), V.Quant);
+        Obj->SetStringField(TEXT("file"), FPaths::GetCleanFilename(V.Path));
+        Obj->SetNumberField(TEXT("sizeBytes"), (double)V.SizeBytes);
+        Obj->SetNumberField(TEXT("validity"), V.Validity);
+        Obj->SetNumberField(TEXT("meanMs"), V.MeanMs);
+        Obj->SetNumberField(TEXT("p95Ms"), V.P95Ms);
+        Items.Add(MakeShared<FJsonValueObject>(Obj));
+    }
+    TSharedRef<FJsonObject> Root = MakeShared<FJsonObject>();
+    Root->SetStringField(TEXT("source"), FPaths::GetCleanFilename(SourcePath));
+    Root->SetArrayField(TEXT("variants"), Items);
+
+    FString Text;
+    TSharedRef<TJsonWriter<>> Writer = TJsonWriterFactory<>::Create(&Text);
+    if (!FJsonSerializer::Serialize(Root, Writer)) return false;
+    return FFileHelper::SaveStringToFile(Text, *ReportPath(SourcePath), FFileHelper::EEncodingOptions::ForceUTF8WithoutBOM);
+}
+
+bool FDirectorModelSelector::LoadReport(const FString& SourcePath, TArray<FDirectorModelVariant>& OutVariants)
+{
+    OutVariants.Reset();
+    FString Text;
+    if (!FFileHelper::LoadFileToString(Text, *ReportPath(SourcePath))) return false;
+
+    TSharedPtr<FJsonObject> Root;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(Text);
+    const TArray<TSharedPtr<FJsonValue>>* Items = nullptr;
+    if (!FJsonSerializer::Deserialize(Reader, Root) || !Root.IsValid() || !Root->TryGetArrayField(TEXT("variants"), Items)) return false;
+
+    for (const TSharedPtr<FJsonValue>& Item : *Items)
+    {
+        const TSharedPtr<FJsonObject>* Obj = nullptr;
+        if (!Item.IsValid() || !Item->TryGetObject(Obj)) continue;
+
+        FDirectorModelVariant V;
+        double Size = 0.0, Validity = -1.0, MeanMs = 0.0, P95Ms = 0.0;
+        FString File;
+        (*Obj)->TryGetStringField(TEXT("quant"), V.Quant);
+        (*Obj)->TryGetStringField(TEXT("file"), File);
+        (*Obj)->TryGetNumberField(TEXT("sizeBytes"), Size);
+        (*Obj)->TryGetNumberField(TEXT("validity"), Validity);
+        (*Obj)->TryGetNumberField(TEXT("meanMs"), MeanMs);
+        (*Obj)->TryGetNumberField(TEXT("p95Ms"), P95Ms);
+        if (V.Quant.IsEmpty()) continue;
+
+        V.Path = FPaths::GetPath(SourcePath) / File;
+        V.SizeBytes = (int64)Size;
+        V.Validity = (float)Validity;
+        V.MeanMs = (float)MeanMs;
+        V.P95Ms = (float)P95Ms;
+        OutVariants.Add(MoveTemp(V));
+    }
+    return true;
+}
@@ -0,0 +1,256 @@
+#include "DirectorSampler.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformTime.h"
+#include "Math/VectorRegister.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+
+void FDirectorSampler::Configure(int32 InTopK, float InTopP, float InTemp)
+{
+    // Same rule the runners used before: greedy only when both temperature and top-k ask for it
+    if (InTemp <= 0.0f && InTopK <= 1)
+    {
+        Mode = EMode::Greedy;
+        K = 1;
+        return;
+    }
+
+    K = (InTopK > 0) ? FMath::Min(InTopK, MaxTopK) : MaxTopK;
+    InvTemp = (InTemp > 0.0f) ? 1.0f / InTemp : 1.0f;
+    TopP = InTopP;
+    Mode = (InTopP > 0.0f && InTopP < 1.0f) ? EMode::TopKTopP : EMode::TopK;
+}
+
+int32 FDirectorSampler::Greedy(const float* Logits, int32 NumVocab)
+{
+    if (NumVocab <= 0) return -1;
+
+    // 1) Vector max
+    float Max = -INFINITY;
+    int32 i = 0;
+    if (NumVocab >= 4)
+    {
+        VectorRegister4Float VMax = VectorLoad(Logits);
+        for (i = 4; i + 4 <= NumVocab; i += 4)
+        {
+            VMax = VectorMax(VMax, VectorLoad(Logits + i));
+        }
+        alignas(16) float Lanes[4];
+        VectorStoreAligned(VMax, Lanes);
+        Max = FMath::Max(FMath::Max(Lanes[0], Lanes[1]), FMath::Max(Lanes[2], Lanes[3]));
+    }
+    for (; i < NumVocab; ++i) Max = FMath::Max(Max, Logits[i]);
+    if (Max == -INFINITY) return -1;
+
+    // 2) First index holding it
+    for (int32 j = 0; j < NumVocab; ++j)
+    {
+        if (Logits[j] == Max) return j;
+    }
+    return -1;
+}
+
+int32 FDirectorSampler::SelectTopK(const float* Logits, int32 NumVocab)
+{
+    const int32 Want = FMath::Min(K, NumVocab);
+    // min-heap order on logit: the root is the smallest candidate kept so far
+    auto Cmp = [](const FCandidate& A, const FCandidate& B) { return A.Logit > B.Logit; };
+
+    int32 Count = 0;
+    float Threshold = -INFINITY; // a logit must beat this to enter; rises once the heap is full
+
+    auto Offer = [&](int32 Id)
+        {
+            const float L = Logits[Id];
+            if (!(L > Threshold)) return;
+            if (Count < Want)
+            {
+                Top[Count++] = { L, Id };
+                std::push_heap(Top, Top + Count, Cmp);
+                if (Count == Want) Threshold = Top[0].Logit;
+            }
+            else
+            {
+                std::pop_heap(Top, Top + Count, Cmp);
+                Top[Count - 1] = { L, Id };
+                std::push_heap(Top, Top + Count, Cmp);
+                Threshold = Top[0].Logit;
+            }
+        };
+
+    // 16 logits per iteration; a block with nothing above the threshold (almost all of them once the heap
+    // has filled) costs four loads and four compares
+    int32 i = 0;
+    VectorRegister4Float VThreshold = VectorSetFloat1(Threshold);
+    for (; i + 16 <= NumVocab; i += 16)
+    {
+        const VectorRegister4Float Any = VectorBitwiseOr(
+            VectorBitwiseOr(VectorCompareGT(VectorLoad(Logits + i), VThreshold), VectorCompareGT(VectorLoad(Logits + i + 4), VThreshold)),
+            VectorBitwiseOr(VectorCompareGT(VectorLoad(Logits + i + 8), VThreshold), VectorCompareGT(VectorLoad(Logits + i + 12), VThreshold)));
+        if (VectorMaskBits(Any) == 0) continue;
+
+        for (int32 j = i; j < i + 16; ++j) Offer(j);
+        VThreshold = VectorSetFloat1(Threshold);
+    }
+    for (; i < NumVocab; ++i) Offer(i);
+
+    // descending by logit
+    std::sort_heap(Top, Top + Count, Cmp);
+    return Count;
+}
+
+int32 FDirectorSampler::Sample(const float* Logits, int32 NumVocab, std::mt19937& Rng)
+{
+    if (Mode == EMode::Greedy) return Greedy(Logits, NumVocab);
+
+    const int32 Count = SelectTopK(Logits, NumVocab);
+    if (Count == 0) return -1;
+
+    // Temperature + softmax over the K survivors only (Top[0] is the max)
+    const float MaxLogit = Top[0].Logit;
+    float Sum = 0.0f;
+    for (int32 j = 0; j < Count; ++j)
+    {
+        Probs[j] = std::exp((Top[j].Logit - MaxLogit) * InvTemp);
+        Sum += Probs[j];
+    }
+
+    // Top-p: shortest prefix whose mass reaches TopP
+    int32 Keep = Count;
+    float KeptMass = Sum;
+    if (Mode == EMode::TopKTopP)
+    {
+        const float Target = TopP * Sum;
+        float Cum = 0.0f;
+        for (int32 j = 0; j < Count; ++j)
+        {
+            Cum += Probs[j];
+            if (Cum >= Target) { Keep = j + 1; KeptMass = Cum; break; }
+        }
+    }
+
+    // Sample within the kept mass
+    std::uniform_real_distribution<float> Uni(0.0f, 1.0f);
+    const float R = Uni(Rng) * KeptMass;
+    float Acc = 0.0f;
+    for (int32 j = 0; j < Keep; ++j)
+    {
+        Acc += Probs[j];
+        if (R <= Acc) return Top[j].Id;
+    }
+    return Top[Keep - 1].Id;
+}
+
+// ---------- Microbenchmark ----------
+// The per-token sampler the runners used before FDirectorSampler, kept verbatim as the baseline
+static int LegacySampleTopKTopPTemp(const float* logits, int n_vocab, int top_k, float top_p, float temp,
+    std::mt19937& rng, std::vector<float>& work_logits, std::vector<int>& idx)
+{
+    std::uniform_real_distribution<float> uni(0.0f, 1.0f);
+    std::memcpy(work_logits.data(), logits, sizeof(float) * (size_t)n_vocab);
+    if (temp > 0.0f) {
+        const float invT = 1.0f / temp;
+        for (int i = 0; i < n_vocab; ++i) work_logits[i] *= invT;
+    }
+    int K = (top_k > 0) ? std::min(top_k, n_vocab) : n_vocab;
+    std::nth_element(idx.begin(), idx.begin() + K, idx.end(),
+        [&](int a, int b) { return work_logits[a] > work_logits[b]; });
+    idx.resize((size_t)K);
+    float maxl = -FLT_MAX;
+    for (int id : idx) maxl = std::max(maxl, work_logits[id]);
+    float sum = 0.0f;
+    for (int id : idx) { work_logits[id] = std::exp(work_logits[id] - maxl); sum += work_logits[id]; }
+    int choice = idx[0];
+    if (sum > 0.0f) {
+        for (int id : idx) work_logits[id] /= sum;
+        std::sort(idx.begin(), idx.end(), [&](int a, int b) { return work_logits[a] > work_logits[b]; });
+        if (top_p > 0.0f && top_p < 1.0f) {
+            float cum = 0.0f;
+            size_t cut = idx.size();
+            for (size_t j = 0; j < idx.size(); ++j) {
+                cum += work_logits[idx[j]];
+                if (cum >= top_p) { cut = j + 1; break; }
+            }
+            if (cut < idx.size()) idx.resize(cut);
+        }
+        float r = uni(rng);
+        float acc = 0.0f;
+        choice = idx.back();
+        for (int id : idx) { acc += work_logits[id]; if (r <= acc) { choice = id; break; } }
+    }
+    idx.resize((size_t)n_vocab);
+    std::iota(idx.begin(), idx.end(), 0);
+    return choice;
+}
+
+// GameDirector.BenchSampler [NumVocab=201088] [Iters=200] [TopK=20] [TopP=0.8] [Temp=0.2]
+static void BenchSampler(const TArray<FString>& Args)
+{
+    const int32 NumVocab = Args.Num() > 0 ? FMath::Max(16, FCString::Atoi(*Args[0])) : 201088;
+    const int32 Iters = Args.Num() > 1 ? FMath::Max(1, FCString::Atoi(*Args[1])) : 200;
+    const int32 TopK = Args.Num() > 2 ? FCString::Atoi(*Args[2]) : 20;
+    const float TopP = Args.Num() > 3 ? FCString::Atof(*Args[3]) : 0.8f;
+    const float Temp = Args.Num() > 4 ? FCString::Atof(*Args[4]) : 0.2f;
+
+    // A few different logit rows so the baseline is not running on a warm, already-partitioned array
+    constexpr int32 NumRows = 8;
+    std::mt19937 Gen(1234);
+    std::normal_distribution<float> Normal(0.0f, 3.0f);
+    std::vector<float> Rows((size_t)NumVocab * NumRows);
+    for (float& L : Rows) L = Normal(Gen);
+
+    std::vector<float> WorkLogits((size_t)NumVocab);
+    std::vector<int>   Idx((size_t)NumVocab);
+    std::iota(Idx.begin(), Idx.end(), 0);
+
+    FDirectorSampler Sampler;
+    Sampler.Configure(TopK, TopP, Temp);
+
+    std::mt19937 RngA(42), RngB(42);
+    int64 Checksum = 0;
+
+    double T0 = FPlatformTime::Seconds();
+    for (int32 i = 0; i < Iters; ++i)
+    {
+        Checksum += LegacySampleTopKTopPTemp(&Rows[(size_t)(i % NumRows) * NumVocab], NumVocab, TopK, TopP, Temp, RngA, WorkLogits, Idx);
+    }
+    const double LegacyUs = (FPlatformTime::Seconds() - T0) * 1e6 / Iters;
+
+    T0 = FPlatformTime::Seconds();
+    for (int32 i = 0; i < Iters; ++i)
+    {
+        Checksum += Sampler.Sample(&Rows[(size_t)(i % NumRows) * NumVocab], NumVocab, RngB);
+    }
+    const double NewUs = (FPlatformTime::Seconds() - T0) * 1e6 / Iters;
+
+    T0 = FPlatformTime::Seconds();
+    for (int32 i = 0; i < Iters; ++i)
+    {
+        Checksum += FDirectorSampler::Greedy(&Rows[(size_t)(i % NumRows) * NumVocab], NumVocab);
+    }
+    const double GreedyUs = (FPlatformTime::Seconds() - T0) * 1e6 / Iters;
+
+    // The argmax must agree with a plain scalar scan on every row
+    int32 Mismatches = 0;
+    for (int32 r = 0; r < NumRows; ++r)
+    {
+        const float* Row = &Rows[(size_t)r * NumVocab];
+        const int32 Ref = (int32)(std::max_element(Row, Row + NumVocab) - Row);
+        if (FDirectorSampler::Greedy(Row, NumVocab) != Ref) ++Mismatches;
+    }
+
+    UE_LOG(LogTemp, Display, TEXT("BenchSampler vocab=%d iters=%d top_k=%d top_p=%.2f temp=%.2f"), NumVocab, Iters, TopK, TopP, Temp);
+    UE_LOG(LogTemp, Display, TEXT("  legacy lambda : %8.1f us/token"), LegacyUs);
+    UE_LOG(LogTemp, Display, TEXT("  FDirectorSampler: %8.1f us/token (%.1fx)"), NewUs, NewUs > 0.0 ? LegacyUs / NewUs : 0.0);
+    UE_LOG(LogTemp, Display, TEXT("  greedy        : %8.1f us/token, argmax mismatches %d/%d (checksum %lld)"), GreedyUs, Mismatches, NumRows, Checksum);
+}
+
+static FAutoConsoleCommand CmdBenchSampler(
+    TEXT("GameDirector.BenchSampler"),
+    TEXT("Times FDirectorSampler against the legacy per-token sampler on random logits. Args: [NumVocab] [Iters] [TopK] [TopP] [Temp]"),
+    FConsoleCommandWithArgsDelegate::CreateStatic(&BenchSampler));
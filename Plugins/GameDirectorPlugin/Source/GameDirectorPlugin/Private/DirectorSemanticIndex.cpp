@@ -0,0 +1,112 @@
+#include "DirectorSemanticIndex.h"
+#include "Misc/ScopeLock.h"
+#include "Math/VectorRegister.h"
+
+void FDirectorSemanticIndex::Reset(int32 InDims, int32 InMaxEntries)
+{
+    FScopeLock Lock(&Mutex);
+    Dims = FMath::Max(0, InDims);
+    Stride = Align(Dims, 4);
+    MaxEntries = FMath::Max(0, InMaxEntries);
+    Entries.Reset(MaxEntries);
+    Vectors.Reset(MaxEntries * Stride);
+    UseClock = 0;
+}
+
+void FDirectorSemanticIndex::Normalize(const float* Embedding, float* Out) const
+{
+    double SumSq = 0.0;
+    for (int32 i = 0; i < Dims; ++i) SumSq += (double)Embedding[i] * Embedding[i];
+    const float Scale = SumSq > 0.0 ? (float)(1.0 / FMath::Sqrt(SumSq)) : 0.f;
+    for (int32 i = 0; i < Dims; ++i) Out[i] = Embedding[i] * Scale;
+    for (int32 i = Dims; i < Stride; ++i) Out[i] = 0.f;
+}
+
+float FDirectorSemanticIndex::Dot(const float* A, const float* B, int32 Stride)
+{
+    // four lanes at a time, two accumulators to hide the FMA latency; Stride is a multiple of 4
+    VectorRegister4Float Acc0 = VectorZeroFloat();
+    VectorRegister4Float Acc1 = VectorZeroFloat();
+    int32 i = 0;
+    for (; i + 8 <= Stride; i += 8)
+    {
+        Acc0 = VectorMultiplyAdd(VectorLoad(A + i), VectorLoad(B + i), Acc0);
+        Acc1 = VectorMultiplyAdd(VectorLoad(A + i + 4), VectorLoad(B + i + 4), Acc1);
+    }
+    if (i < Stride) Acc0 = VectorMultiplyAdd(VectorLoad(A + i), VectorLoad(B + i), Acc0);
+
+    alignas(16) float Lanes[4];
+    VectorStoreAligned(VectorAdd(Acc0, Acc1), Lanes);
+    return Lanes[0] + Lanes[1] + Lanes[2] + Lanes[3];
+}
+
+bool FDirectorSemanticIndex::Find(uint64 Group, const float* Embedding, float Threshold, FString& OutJson, float& OutSimilarity)
+{
+    OutSimilarity = 0.f;
+    if (Dims <= 0 || !Embedding) return false;
+
+    TArray<float> Query;
+    Query.SetNumUninitialized(Stride);
+    Normalize(Embedding, Query.GetData());
+
+    FScopeLock Lock(&Mutex);
+    const int64 Now = FDateTime::UtcNow().ToUnixTimestamp();
+    int32 Best = INDEX_NONE;
+    float BestSim = -1.f;
+    for (int32 i = 0; i < Entries.Num(); ++i)
+    {
+        if (Entries[i].Group != Group || Entries[i].ExpiresUnix <= Now) continue;
+        const float Sim = Dot(Query.GetData(), Vectors.GetData() + (int64)i * Stride, Stride);
+        if (Sim > BestSim) { BestSim = Sim; Best = i; }
+    }
+
+    OutSimilarity = FMath::Max(BestSim, 0.f);
+    if (Best == INDEX_NONE || BestSim < Threshold)
+    {
+        ++Misses;
+        return false;
+    }
+    Entries[Best].LastUse = ++UseClock;
+    OutJson = Entries[Best].Json;
+    ++Hits;
+    return true;
+}
+
+void FDirectorSemanticIndex::Add(uint64 Group, const float* Embedding, const FString& Json, double TtlSeconds)
+{
+    if (Dims <= 0 || MaxEntries <= 0 || !Embedding || TtlSeconds <= 0.0 || Json.IsEmpty()) return;
+
+    FScopeLock Lock(&Mutex);
+    const int64 Now = FDateTime::UtcNow().ToUnixTimestamp();
+
+    // 1) Row to fill: a new one while there is room, else an expired entry, else the least recently used
+    int32 Row = Entries.Num();
+    if (Row >= MaxEntries)
+    {
+        Row = 0;
+        for (int32 i = 0; i < Entries.Num(); ++i)
+        {
+            if (Entries[i].ExpiresUnix <= Now) { Row = i; break; }
+            if (Entries[i].LastUse < Entries[Row].LastUse) Row = i;
+        }
+    }
+    else
+    {
+        Entries.AddDefaulted();
+        Vectors.AddUninitialized(Stride);
+    }
+
+    // 2) Entry and its normalized vector
+    FEntry& Entry = Entries[Row];
+    Entry.Group = Group;
+    Entry.Json = Json;
+    Entry.ExpiresUnix = Now + (int64)TtlSeconds;
+    Entry.LastUse = ++UseClock;
+    Normalize(Embedding, Vectors.GetData() + (int64)Row * Stride);
+}
+
+int32 FDirectorSemanticIndex::Num() const
+{
+    FScopeLock Lock(&Mutex);
+    return Entries.Num();
+}
@@ -0,0 +1,198 @@
+#include "DirectorThreadpool.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMisc.h"
+#include "Misc/FileHelper.h"
+#include "llama.h"
+#include "ggml-cpu.h"
+
+static TAutoConsoleVariable<int32> CVarThreadPool(
+    TEXT("GameDirector.ThreadPool"),
+    1,
+    TEXT("1 = each context decodes on its own pinned ggml threadpools (default). 0 = llama.cpp creates its threads. Read at Initiate."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<FString> CVarThreadAffinity(
+    TEXT("GameDirector.ThreadAffinity"),
+    TEXT(""),
+    TEXT("CPUs the decode threads may run on, as a list (\"4-11,14\") or a hex mask (\"0xFF0\").\n")
+    TEXT("Empty = every CPU except the first GameDirector.ThreadReserveCores cores."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<FString> CVarThreadAffinityBatch(
+    TEXT("GameDirector.ThreadAffinityBatch"),
+    TEXT(""),
+    TEXT("CPUs for the prompt prefill threads, same format as GameDirector.ThreadAffinity. Empty = same CPUs as decode."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarThreadReserveCores(
+    TEXT("GameDirector.ThreadReserveCores"),
+    2,
+    TEXT("Physical cores (counted from CPU 0) kept free of inference when no affinity is set, for the game and render threads.\n")
+    TEXT("Windows and Linux only; elsewhere, and at 0, there is no affinity."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarThreadPriority(
+    TEXT("GameDirector.ThreadPriority"),
+    -1,
+    TEXT("Scheduling priority of the inference threads: -1 low (default), 0 normal, 1 medium, 2 high, 3 realtime."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarThreadPoll(
+    TEXT("GameDirector.ThreadPoll"),
+    0,
+    TEXT("How long idle inference threads spin before sleeping, 0..100. 0 (default) leaves the cores to the engine between graph nodes."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarThreadStrictCpu(
+    TEXT("GameDirector.ThreadStrictCpu"),
+    0,
+    TEXT("1 = pin each thread to one CPU of the mask in turn. 0 (default) = threads float within the mask."),
+    ECVF_Default);
+
+// "4-11,14" or "0xFF0" -> sorted CPU indices; false on a malformed spec
+static bool ParseCpuList(const FString& InSpec, TArray<int32>& Out)
+{
+    Out.Reset();
+    const FString Spec = InSpec.TrimStartAndEnd();
+    const int32 MaxCpu = FMath::Min(GGML_MAX_N_THREADS, FPlatformMisc::NumberOfCoresIncludingHyperthreads());
+
+    if (Spec.StartsWith(TEXT("0x"), ESearchCase::IgnoreCase))
+    {
+        // lowest bit = CPU 0, like llama.cpp's --cpu-mask
+        int32 Bit = 0;
+        for (int32 i = Spec.Len() - 1; i >= 2; --i, Bit += 4)
+        {
+            const TCHAR C = Spec[i];
+            if (!FChar::IsHexDigit(C)) return false;
+            const int32 Nibble = FParse::HexDigit(C);
+            for (int32 b = 0; b < 4; ++b)
+            {
+                if ((Nibble & (1 << b)) && Bit + b < MaxCpu) Out.AddUnique(Bit + b);
+            }
+        }
+    }
+    else
+    {
+        TArray<FString> Parts;
+        Spec.ParseIntoArray(Parts, TEXT(","));
+        for (const FString& Part : Parts)
+        {
+            const FString Range = Part.TrimStartAndEnd();
+            FString Lo, Hi;
+            if (!Range.Split(TEXT("-"), &Lo, &Hi)) Lo = Hi = Range;
+            Lo.TrimStartAndEndInline(); Hi.TrimStartAndEndInline();
+            if (!Lo.IsNumeric() || !Hi.IsNumeric()) return false;
+            const int32 First = FCString::Atoi(*Lo), Last = FCString::Atoi(*Hi);
+            for (int32 Cpu = First; Cpu <= Last && Cpu < MaxCpu; ++Cpu) Out.AddUnique(Cpu);
+        }
+    }
+    Out.Sort();
+    return true;
+}
+
+// Configured CPUs, or all but the reserved cores (Windows and Linux); empty = no affinity
+static TArray<int32> ResolveCpus(const FString& Spec)
+{
+    TArray<int32> Cpus;
+    if (!Spec.TrimStartAndEnd().IsEmpty())
+    {
+        if (ParseCpuList(Spec, Cpus) && Cpus.Num() > 0) return Cpus;
+        UE_LOG(LogTemp, Warning, TEXT("Threadpool: ignoring affinity \"%s\""), *Spec);
+        Cpus.Reset();
+    }
+
+    const int32 Reserve = CVarThreadReserveCores.GetValueOnAnyThread();
+    const int32 Physical = FMath::Max(1, FPlatformMisc::NumberOfCores());
+    const int32 Logical = FMath::Min(GGML_MAX_N_THREADS, FMath::Max(Physical, FPlatformMisc::NumberOfCoresIncludingHyperthreads()));
+    if (Reserve <= 0 || Reserve >= Physical) return Cpus;
+
+#if PLATFORM_WINDOWS
+    // Windows numbers hyperthread siblings next to each other, so reserving a core skips all of its logical CPUs
+    const int32 FirstFree = Reserve * (Logical / Physical);
+    for (int32 Cpu = FirstFree; Cpu < Logical; ++Cpu) Cpus.Add(Cpu);
+#elif PLATFORM_LINUX
+    // Linux usually numbers siblings Physical apart (CPU i and i + Physical), but the kernel lists each CPU's siblings:
+    // a CPU is reserved when the lowest of its siblings belongs to one of the first Reserve cores
+    TArray<int32> ReservedCores;
+    for (int32 Cpu = 0; Cpu < Logical; ++Cpu)
+    {
+        FString Text;
+        TArray<int32> Siblings;
+        if (!FFileHelper::LoadFileToString(Text, *FString::Printf(TEXT("/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list"), Cpu))
+            || !ParseCpuList(Text, Siblings) || Siblings.Num() == 0)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Threadpool: no topology for CPU %d, leaving the affinity to the OS"), Cpu);
+            return TArray<int32>();
+        }
+        const int32 Core = Siblings[0];
+        if (!ReservedCores.Contains(Core) && ReservedCores.Num() < Reserve) ReservedCores.Add(Core);
+        if (!ReservedCores.Contains(Core)) Cpus.Add(Cpu);
+    }
+#endif
+    return Cpus;
+}
+
+static ggml_threadpool* NewPool(const TArray<int32>& Cpus, int32 Share, int32 NumShares, int32 NumThreads, const TCHAR* What)
+{
+    // 1) This context's slice of the mask; a slice with no CPU left falls back to the whole mask
+    TArray<int32> Slice;
+    if (Cpus.Num() > 0)
+    {
+        const int32 First = Cpus.Num() * Share / NumShares, Last = Cpus.Num() * (Share + 1) / NumShares;
+        for (int32 i = First; i < Last; ++i) Slice.Add(Cpus[i]);
+        if (Slice.Num() == 0) Slice = Cpus;
+        NumThreads = FMath::Min(NumThreads, Slice.Num());   // more threads than CPUs would only time-slice
+    }
+    NumThreads = FMath::Clamp(NumThreads, 1, GGML_MAX_N_THREADS);
+
+    // 2) Params: an all-zero mask keeps the default affinity
+    ggml_threadpool_params Params = ggml_threadpool_params_default(NumThreads);
+    for (int32 Cpu : Slice) Params.cpumask[Cpu] = true;
+    Params.prio = (ggml_sched_priority)FMath::Clamp(CVarThreadPriority.GetValueOnAnyThread(), (int32)GGML_SCHED_PRIO_LOW, (int32)GGML_SCHED_PRIO_REALTIME);
+    Params.poll = (uint32_t)FMath::Clamp(CVarThreadPoll.GetValueOnAnyThread(), 0, 100);
+    Params.strict_cpu = Slice.Num() > 0 && CVarThreadStrictCpu.GetValueOnAnyThread() != 0;
+
+    ggml_threadpool* Pool = ggml_threadpool_new(&Params);
+    if (!Pool)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Threadpool: could not start %d %s threads"), NumThreads, What);
+        return nullptr;
+    }
+
+    FString CpuText = Slice.Num() > 0 ? FString() : FString(TEXT("any"));
+    for (int32 Cpu : Slice) CpuText += CpuText.IsEmpty() ? FString::FromInt(Cpu) : FString::Printf(TEXT(",%d"), Cpu);
+    UE_LOG(LogTemp, Display, TEXT("Threadpool %d: %d %s threads on CPUs %s, priority %d"), Share, NumThreads, What, *CpuText, (int32)Params.prio);
+    return Pool;
+}
+
+bool FDirectorThreadpools::Create(int32 NumThreads, int32 NumThreadsBatch, int32 Share, int32 NumShares)
+{
+    Free();
+    if (CVarThreadPool.GetValueOnAnyThread() <= 0) return false;
+
+    NumShares = FMath::Max(1, NumShares);
+    Share = FMath::Clamp(Share, 0, NumShares - 1);
+    const TArray<int32> DecodeCpus = ResolveCpus(CVarThreadAffinity.GetValueOnAnyThread());
+    const FString BatchSpec = CVarThreadAffinityBatch.GetValueOnAnyThread();
+    const TArray<int32> BatchCpus = BatchSpec.TrimStartAndEnd().IsEmpty() ? DecodeCpus : ResolveCpus(BatchSpec);
+
+    Decode = NewPool(DecodeCpus, Share, NumShares, NumThreads, TEXT("decode"));
+    Batch = NewPool(BatchCpus, Share, NumShares, NumThreadsBatch, TEXT("prefill"));
+    if (!IsValid())
+    {
+        Free();
+        return false;
+    }
+    return true;
+}
+
+void FDirectorThreadpools::Attach(llama_context* Ctx) const
+{
+    if (Ctx && IsValid()) llama_attach_threadpool(Ctx, Decode, Batch);
+}
+
+void FDirectorThreadpools::Free()
+{
+    if (Decode) { ggml_threadpool_free(Decode); Decode = nullptr; }
+    if (Batch) { ggml_threadpool_free(Batch); Batch = nullptr; }
+}
@@ -0,0 +1,182 @@
+#include "DirectorTuning.h"
+#include "HAL/IConsoleManager.h"
+#include "HAL/PlatformMisc.h"
+#include "Misc/ConfigCacheIni.h"
+#include "Misc/Paths.h"
+#include "Misc/DateTime.h"
+#include "Hash/CityHash.h"
+#include "llama.h"
+#include <vector>
+
+static TAutoConsoleVariable<int32> CVarAutotune(
+    TEXT("GameDirector.Autotune"),
+    1,
+    TEXT("0 = default thread counts and batch sizes.\n")
+    TEXT("1 = apply the stored tuning profile for this machine and model, benchmarking once if there is none (default).\n")
+    TEXT("2 = benchmark at every Initiate and replace the stored profile."),
+    ECVF_Default);
+
+// Benchmark size: long enough to be stable, short enough for a startup step
+static constexpr int32 kPrefillTokens = 256;
+static constexpr int32 kDecodeTokens = 16;
+
+static uint64 MachineKey()
+{
+    const FString Cpu = FPlatformMisc::GetCPUBrand().TrimStartAndEnd();
+    const uint64 Shape[3] = { (uint64)FPlatformMisc::NumberOfCores(), (uint64)FPlatformMisc::NumberOfCoresIncludingHyperthreads(),
+        (uint64)FPlatformMemory::GetConstants().TotalPhysicalGB };
+    FTCHARToUTF8 CpuUtf8(*Cpu);
+    return CityHash64WithSeed(CpuUtf8.Get(), CpuUtf8.Length(), CityHash64(reinterpret_cast<const char*>(Shape), sizeof(Shape)));
+}
+
+static FString SectionName(uint64 InModelKey, int32 NumContexts)
+{
+    return FString::Printf(TEXT("Tuning.%016llx.%016llx.%d"), MachineKey(), InModelKey, FMath::Max(1, NumContexts));
+}
+
+uint64 FDirectorTuning::ModelKey(const llama_model* Model)
+{
+    char Desc[256] = {};
+    llama_model_desc(Model, Desc, sizeof(Desc));
+    const uint64 Sizes[2] = { llama_model_size(Model), llama_model_n_params(Model) };
+    return CityHash64WithSeed(Desc, FCStringAnsi::Strlen(Desc), CityHash64(reinterpret_cast<const char*>(Sizes), sizeof(Sizes)));
+}
+
+FString FDirectorTuning::ConfigPath()
+{
+    return FPaths::ProjectSavedDir() / TEXT("Config") / TEXT("GameDirectorTuning.ini");
+}
+
+bool FDirectorTuning::Load(uint64 InModelKey, int32 NumContexts, FDirectorTuneProfile& OutProfile)
+{
+    FConfigFile Config;
+    Config.Read(ConfigPath());
+
+    const FString Section = SectionName(InModelKey, NumContexts);
+    FDirectorTuneProfile Profile;
+    Config.GetInt(*Section, TEXT("NumThreads"), Profile.NumThreads);
+    Config.GetInt(*Section, TEXT("NumThreadsBatch"), Profile.NumThreadsBatch);
+    Config.GetInt(*Section, TEXT("UBatch"), Profile.UBatch);
+    if (!Profile.IsValid()) return false;
+
+    OutProfile = Profile;
+    return true;
+}
+
+bool FDirectorTuning::Save(uint64 InModelKey, int32 NumContexts, const FDirectorTuneProfile& Profile)
+{
+    FConfigFile Config;
+    Config.Read(ConfigPath());
+
+    // CPU and date are only there for whoever opens the file
+    const FString Section = SectionName(InModelKey, NumContexts);
+    Config.SetString(*Section, TEXT("CPU"), *FPlatformMisc::GetCPUBrand().TrimStartAndEnd());
+    Config.SetString(*Section, TEXT("TunedAt"), *FDateTime::UtcNow().ToIso8601());
+    Config.SetString(*Section, TEXT("NumThreads"), *FString::FromInt(Profile.NumThreads));
+    Config.SetString(*Section, TEXT("NumThreadsBatch"), *FString::FromInt(Profile.NumThreadsBatch));
+    Config.SetString(*Section, TEXT("UBatch"), *FString::FromInt(Profile.UBatch));
+    return Config.Write(ConfigPath());
+}
+
+bool FDirectorTuning::Resolve(llama_model* Model, const llama_context_params& BaseParams, int32 NumContexts, FDirectorTuneProfile& OutProfile)
+{
+    const int32 Mode = CVarAutotune.GetValueOnAnyThread();
+    if (Mode <= 0 || !Model) return false;
+
+    const uint64 Key = ModelKey(Model);
+    if (Mode == 1 && Load(Key, NumContexts, OutProfile))
+    {
+        UE_LOG(LogTemp, Display, TEXT("Autotune: using stored profile (n_threads %d, n_threads_batch %d, n_ubatch %d)"),
+            OutProfile.NumThreads, OutProfile.NumThreadsBatch, OutProfile.UBatch);
+        return true;
+    }
+
+    UE_LOG(LogTemp, Display, TEXT("Autotune: benchmarking thread counts and n_ubatch for this machine and model"));
+    const double T0 = FPlatformTime::Seconds();
+    OutProfile = Run(Model, BaseParams, NumContexts);
+    if (!OutProfile.IsValid())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Autotune: benchmark failed, keeping the defaults"));
+        return false;
+    }
+    if (!Save(Key, NumContexts, OutProfile))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Autotune: could not write %s, the benchmark will run again next launch"), *ConfigPath());
+    }
+    UE_LOG(LogTemp, Display, TEXT("Autotune: n_threads %d, n_threads_batch %d, n_ubatch %d (%.1f s)"),
+        OutProfile.NumThreads, OutProfile.NumThreadsBatch, OutProfile.UBatch, FPlatformTime::Seconds() - T0);
+    return true;
+}
+
+FDirectorTuneProfile FDirectorTuning::Run(llama_model* Model, const llama_context_params& BaseParams, int32 NumContexts)
+{
+    FDirectorTuneProfile Best;
+    const llama_vocab* Vocab = llama_model_get_vocab(Model);
+    const int32 NumVocab = Vocab ? llama_vocab_n_tokens(Vocab) : 0;
+    if (NumVocab <= 0) return Best;
+
+    // 1) Candidates: fractions of each context's share of the physical cores, and its hyperthreaded share
+    NumContexts = FMath::Max(1, NumContexts);
+    const int32 Physical = FMath::Max(1, FPlatformMisc::NumberOfCores() / NumContexts);
+    const int32 Logical = FMath::Max(Physical, FPlatformMisc::NumberOfCoresIncludingHyperthreads() / NumContexts);
+    TArray<int32> Threads;
+    for (int32 T : { Physical / 4, Physical / 2, (Physical * 3) / 4, Physical, Logical })
+    {
+        if (T >= 1) Threads.AddUnique(T);
+    }
+    const int32 UBatches[] = { 64, 128, 256 };
+
+    // Token ids do not matter for timing
+    std::vector<llama_token> Tokens((size_t)kPrefillTokens);
+    for (int32 i = 0; i < kPrefillTokens; ++i) Tokens[i] = (llama_token)(((int64)i * 7919) % NumVocab);
+
+    double BestPrefill = 0.0, BestDecode = 0.0;
+    for (int32 UBatch : UBatches)
+    {
+        llama_context_params Params = BaseParams;
+        Params.n_ctx = (uint32_t)(kPrefillTokens + kDecodeTokens + 64);
+        Params.n_seq_max = 1;
+        Params.n_batch = (uint32_t)kPrefillTokens;
+        Params.n_ubatch = (uint32_t)UBatch;
+        llama_context* Ctx = llama_init_from_model(Model, Params);
+        if (!Ctx) continue;
+
+        // Warm-up so graph allocation is not billed to the first candidate
+        llama_decode(Ctx, llama_batch_get_one(Tokens.data(), UBatch));
+
+        // Single-token steps do not depend on n_ubatch: time them with the first context only
+        const bool bMeasureDecode = (UBatch == UBatches[0]);
+        for (int32 T : Threads)
+        {
+            llama_set_n_threads(Ctx, T, T);
+            llama_memory_clear(llama_get_memory(Ctx), /*data*/ true);
+
+            // 2) Prefill: the whole prompt in one call, which llama.cpp splits into n_ubatch pieces
+            double T0 = FPlatformTime::Seconds();
+            if (llama_decode(Ctx, llama_batch_get_one(Tokens.data(), kPrefillTokens)) != 0) break;
+            const double PrefillTps = kPrefillTokens / FMath::Max(FPlatformTime::Seconds() - T0, 1e-6);
+
+            // 3) Decode: one token at a time on top of the prompt
+            double DecodeTps = 0.0;
+            if (bMeasureDecode)
+            {
+                T0 = FPlatformTime::Seconds();
+                int32 NumDecoded = 0;
+                for (; NumDecoded < kDecodeTokens; ++NumDecoded)
+                {
+                    llama_token Tok = Tokens[(size_t)NumDecoded];
+                    if (llama_decode(Ctx, llama_batch_get_one(&Tok, 1)) != 0) break;
+                }
+                DecodeTps = NumDecoded / FMath::Max(FPlatformTime::Seconds() - T0, 1e-6);
+            }
+
+            UE_LOG(LogTemp, Display, TEXT("Autotune: threads %2d  n_ubatch %3d  prefill %7.1f tok/s  decode %s"), T, UBatch, PrefillTps,
+                bMeasureDecode ? *FString::Printf(TEXT("%6.1f tok/s"), DecodeTps) : TEXT("-"));
+
+            if (PrefillTps > BestPrefill) { BestPrefill = PrefillTps; Best.NumThreadsBatch = T; Best.UBatch = UBatch; }
+            if (DecodeTps > BestDecode) { BestDecode = DecodeTps; Best.NumThreads = T; }
+        }
+        llama_free(Ctx);
+    }
+    return Best;
+}
@@ -0,0 +1,197 @@
+#include "GameDirectorQuantizeCommandlet.h"
+#include "DirectorModelSelect.h"
+#include "LLamaRunnerAsync.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Dom/JsonObject.h"
+#include "Serialization/JsonReader.h"
+#include "Serialization/JsonSerializer.h"
+#include "llama.h"
+
+namespace
+{
+    struct FDatasetPrompt
+    {
+        FString Input;
+        FString Intent;     // intent of the reference answer, passed like the game passes its own
+    };
+
+    // JSONL lines with "input" and "output"; in the .md dataset they sit inside a ```jsonl fence
+    TArray<FDatasetPrompt> LoadDatasetPrompts(const FString& Path, int32 MaxPrompts)
+    {
+        TArray<FDatasetPrompt> Prompts;
+        TArray<FString> Lines;
+        if (!FFileHelper::LoadFileToStringArray(Lines, *Path)) return Prompts;
+
+        for (const FString& RawLine : Lines)
+        {
+            const FString Line = RawLine.TrimStartAndEnd();
+            if (!Line.StartsWith(TEXT("{"))) continue;
+
+            TSharedPtr<FJsonObject> Obj;
+            TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(Line);
+            FDatasetPrompt Prompt;
+            FString Output;
+            if (!FJsonSerializer::Deserialize(Reader, Obj) || !Obj.IsValid() || !Obj->TryGetStringField(TEXT("input"), Prompt.Input)) continue;
+
+            TSharedPtr<FJsonObject> Answer;
+            TSharedRef<TJsonReader<>> AnswerReader = TJsonReaderFactory<>::Create(Obj->GetStringField(TEXT("output")));
+            if (FJsonSerializer::Deserialize(AnswerReader, Answer) && Answer.IsValid()) Answer->TryGetStringField(TEXT("intent"), Prompt.Intent);
+
+            Prompts.Add(MoveTemp(Prompt));
+            if (MaxPrompts > 0 && Prompts.Num() >= MaxPrompts) break;
+        }
+        return Prompts;
+    }
+
+    bool QuantFType(const FString& Quant, llama_ftype& OutType)
+    {
+        if (Quant == TEXT("Q8_0"))   { OutType = LLAMA_FTYPE_MOSTLY_Q8_0;   return true; }
+        if (Quant == TEXT("Q5_K_M")) { OutType = LLAMA_FTYPE_MOSTLY_Q5_K_M; return true; }
+        if (Quant == TEXT("Q4_K_M")) { OutType = LLAMA_FTYPE_MOSTLY_Q4_K_M; return true; }
+        return false;
+    }
+
+    // Quantizes into a temp file first so a crash never leaves a truncated variant for the selector to pick
+    bool Quantize(const FString& SourcePath, const FString& OutPath, llama_ftype FType, int32 NumThreads)
+    {
+        const FString TempPath = OutPath + TEXT(".tmp");
+        llama_model_quantize_params Params = llama_model_quantize_default_params();
+        Params.ftype = FType;
+        Params.nthread = NumThreads;
+
+        const double T0 = FPlatformTime::Seconds();
+        const uint32_t Result = llama_model_quantize(TCHAR_TO_UTF8(*SourcePath), TCHAR_TO_UTF8(*TempPath), &Params);
+        if (Result != 0 || !IFileManager::Get().Move(*OutPath, *TempPath, /*Replace*/ true))
+        {
+            IFileManager::Get().Delete(*TempPath);
+            return false;
+        }
+        UE_LOG(LogTemp, Display, TEXT("Quantize: wrote %s in %.0f s"), *FPaths::GetCleanFilename(OutPath), FPlatformTime::Seconds() - T0);
+        return true;
+    }
+
+    // Runs every prompt through the game's own request path (system prompt, grammar, sampling defaults)
+    bool Measure(FDirectorModelVariant& Variant, const TArray<FDatasetPrompt>& Prompts)
+    {
+        LLamaRunnerAsync Runner;
+        if (!Runner.Initiate(Variant.Path, 4096, /*MaxSequences*/ 1, /*PoolSize*/ 1))
+        {
+            UE_LOG(LogTemp, Error, TEXT("Quantize: could not load %s for the report"), *Variant.Path);
+            return false;
+        }
+
+        TArray<double> LatencyMs;
+        int32 NumValid = 0;
+        for (const FDatasetPrompt& Prompt : Prompts)
+        {
+            const double T0 = FPlatformTime::Seconds();
+            const FString Output = Runner.GenerateJSON(Prompt.Input, /*max_new*/ 800, /*top_k*/ 20, /*top_p*/ 0.8f, /*temp*/ 0.2f, Prompt.Intent);
+            LatencyMs.Add((FPlatformTime::Seconds() - T0) * 1000.0);
+
+            FString Clean, Error;
+            if (Runner.IsValidDirectorJSON(Output, Clean, Error)) ++NumValid;
+            else UE_LOG(LogTemp, Display, TEXT("Quantize: %s invalid for \"%s\": %s"), *Variant.Quant, *Prompt.Input.Left(60), *Error);
+        }
+        Runner.Shutdown();
+
+        LatencyMs.Sort();
+        double Sum = 0.0;
+        for (double Ms : LatencyMs) Sum += Ms;
+        Variant.Validity = Prompts.Num() > 0 ? (float)NumValid / Prompts.Num() : -1.f;
+        Variant.MeanMs = LatencyMs.Num() > 0 ? (float)(Sum / LatencyMs.Num()) : 0.f;
+        Variant.P95Ms = LatencyMs.Num() > 0 ? (float)LatencyMs[FMath::Min(LatencyMs.Num() - 1, (int32)(LatencyMs.Num() * 0.95))] : 0.f;
+        return true;
+    }
+}
+
+UGameDirectorQuantizeCommandlet::UGameDirectorQuantizeCommandlet()
+{
+    IsClient = false;
+    IsServer = false;
+    IsEditor = true;
+    LogToConsole = true;
+}
+
+int32 UGameDirectorQuantizeCommandlet::Main(const FString& Params)
+{
+    // 1) Arguments
+    FString SourcePath = FPaths::ProjectDir() / TEXT("gptoss20b.f16pure.gguf");
+    FString TypesArg = TEXT("Q8_0,Q5_K_M,Q4_K_M");
+    FString DatasetPath = FPaths::ProjectDir() / TEXT("GAMEDIRECTOR_AI_TRAINING_DATASET.md");
+    int32 MaxPrompts = 0, NumThreads = 0;
+    FParse::Value(*Params, TEXT("Source="), SourcePath);
+    FParse::Value(*Params, TEXT("Types="), TypesArg);
+    FParse::Value(*Params, TEXT("Dataset="), DatasetPath);
+    FParse::Value(*Params, TEXT("MaxPrompts="), MaxPrompts);
+    FParse::Value(*Params, TEXT("Threads="), NumThreads);
+    const bool bForce = FParse::Param(*Params, TEXT("Force"));
+    const bool bReport = !FParse::Param(*Params, TEXT("NoReport"));
+    const bool bReportSource = FParse::Param(*Params, TEXT("ReportSource"));   // the f16 baseline needs ~40 GB
+
+    SourcePath = FPaths::ConvertRelativePathToFull(SourcePath);
+    if (!FPaths::FileExists(SourcePath))
+    {
+        UE_LOG(LogTemp, Error, TEXT("Quantize: source model not found: %s"), *SourcePath);
+        return 1;
+    }
+
+    TArray<FString> Types;
+    TypesArg.ParseIntoArray(Types, TEXT(","));
+
+    // 2) Quantize; existing variants are kept unless -Force
+    int32 NumFailed = 0;
+    llama_backend_init();
+    for (FString& Quant : Types)
+    {
+        Quant = Quant.TrimStartAndEnd().ToUpper();
+        llama_ftype FType;
+        if (!QuantFType(Quant, FType))
+        {
+            UE_LOG(LogTemp, Error, TEXT("Quantize: unsupported type %s (use Q8_0, Q5_K_M or Q4_K_M)"), *Quant);
+            ++NumFailed;
+            continue;
+        }
+        const FString OutPath = FDirectorModelSelector::VariantPath(SourcePath, Quant);
+        if (!bForce && FPaths::FileExists(OutPath))
+        {
+            UE_LOG(LogTemp, Display, TEXT("Quantize: %s exists, skipping (-Force to redo)"), *FPaths::GetCleanFilename(OutPath));
+            continue;
+        }
+        if (!Quantize(SourcePath, OutPath, FType, NumThreads))
+        {
+            UE_LOG(LogTemp, Error, TEXT("Quantize: %s failed"), *Quant);
+            ++NumFailed;
+        }
+    }
+    llama_backend_free();
+
+    if (!bReport) return NumFailed > 0 ? 1 : 0;
+
+    // 3) Validity / latency report against the training dataset prompts
+    const TArray<FDatasetPrompt> Prompts = LoadDatasetPrompts(DatasetPath, MaxPrompts);
+    if (Prompts.Num() == 0)
+    {
+        UE_LOG(LogTemp, Error, TEXT("Quantize: no prompts in %s"), *DatasetPath);
+        return 1;
+    }
+
+    TArray<FDirectorModelVariant> Measured;
+    for (FDirectorModelVariant& Variant : FDirectorModelSelector::FindVariants(SourcePath))
+    {
+        if (Variant.Quant == TEXT("F16") ? !bReportSource : !Types.Contains(Variant.Quant)) continue;
+        UE_LOG(LogTemp, Display, TEXT("Quantize: measuring %s on %d prompts"), *Variant.Quant, Prompts.Num());
+        if (Measure(Variant, Prompts)) Measured.Add(Variant);
+        else ++NumFailed;
+    }
+    FDirectorModelSelector::SaveReport(SourcePath, Measured);
+
+    UE_LOG(LogTemp, Display, TEXT("Quantize report (%s)"), *FDirectorModelSelector::ReportPath(SourcePath));
+    UE_LOG(LogTemp, Display, TEXT("  quant      size GB  valid    mean ms    p95 ms"));
+    for (const FDirectorModelVariant& V : Measured)
+    {
+        UE_LOG(LogTemp, Display, TEXT("  %-8s  %7.1f  %4.0f%%  %9.0f  %8.0f"), *V.Quant, V.SizeBytes / 1e9, V.Validity * 100.f, V.MeanMs, V.P95Ms);
+    }
+    return NumFailed > 0 ? 1 : 0;
+}
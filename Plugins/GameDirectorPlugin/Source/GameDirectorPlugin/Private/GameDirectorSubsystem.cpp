@@ -2,7 +2,26 @@
 
 
 #include "GameDirectorSubsystem.h"
+#include "DirectorModelSelect.h"
+#include "DirectorSessionSave.h"
+#include "Kismet/GameplayStatics.h"
 #include "Misc/Paths.h"
+#include "HAL/IConsoleManager.h"
+#include "Engine/World.h"
+#include "Engine/GameInstance.h"
+
+// Runner sizing, read once in InitializeRunner
+static TAutoConsoleVariable<int32> CVarContextPoolSize(
+    TEXT("GameDirector.ContextPoolSize"),
+    1,
+    TEXT("Number of llama contexts (each with its own worker thread) sharing the loaded model."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarThreadsPerContext(
+    TEXT("GameDirector.ThreadsPerContext"),
+    0,
+    TEXT("Decode threads per pooled context. 0 = split the physical cores evenly across the pool."),
+    ECVF_Default);
 
 #if PLATFORM_WINDOWS
 #include "Windows/AllowWindowsPlatformTypes.h"
@@ -102,11 +121,28 @@ bool UGameDirectorSubsystem::InitializeRunner()
     if (!RunnerAsync)
     {
         RunnerAsync = MakeUnique<LLamaRunnerAsync>();
-        FString ModelPath = FPaths::ConvertRelativePathToFull(
+        // best quantization of the shipped model that fits in RAM (see GameDirectorQuantize commandlet)
+        FString ModelPath = FDirectorModelSelector::Select(FPaths::ConvertRelativePathToFull(
             FPaths::ProjectDir() / TEXT("gptoss20b.f16pure.gguf")
-        );
+        ));
+        ModelFile = FPaths::GetCleanFilename(ModelPath);
 
-        return RunnerAsync->Initiate(*ModelPath, 4096);
+        TWeakObjectPtr<UGameDirectorSubsystem> WeakThis(this);
+        RunnerAsync->InitiateAsync(*ModelPath, 4096, /*MaxSequences*/ 4,
+            CVarContextPoolSize.GetValueOnGameThread(), CVarThreadsPerContext.GetValueOnGameThread(),
+            [WeakThis](float Progress)
+            {
+                if (UGameDirectorSubsystem* This = WeakThis.Get()) This->OnDirectorLoadProgress.Broadcast(Progress);
+            },
+            [WeakThis](bool bLoaded)
+            {
+                UGameDirectorSubsystem* This = WeakThis.Get();
+                if (!This) return;
+                if (bLoaded && This->PendingSessionState.Num() > 0) This->RunnerAsync->ImportSession(This->PendingSessionState);
+                This->PendingSessionState.Empty();
+                This->OnDirectorRunnerReady.Broadcast(bLoaded);
+            });
+        return true;
        // return RunnerAsync->Initiate(TEXT("C:\\models\\rpg_director\\gptoss20b.f16pure.gguf"), 4096);
     }
 
@@ -118,30 +154,294 @@ bool UGameDirectorSubsystem::InitializeRunner()
     //}
     return false;
 }
-bool UGameDirectorSubsystem::Generate2(FString Prompt, FString Intent)
+bool UGameDirectorSubsystem::IsRunnerLoading() const
+{
+    return RunnerAsync && RunnerAsync->IsLoading();
+}
+
+float UGameDirectorSubsystem::GetRunnerLoadProgress() const
+{
+    return RunnerAsync ? RunnerAsync->GetLoadProgress() : 0.f;
+}
+
+static FString DirectorSessionSlot(const FString& SlotName)
+{
+    return SlotName + TEXT("_Director");
+}
+
+bool UGameDirectorSubsystem::SaveDirectorSession(const FString& SlotName, int32 UserIndex)
+{
+    if (!RunnerAsync || !RunnerAsync->IsInitialized()) return false;
+
+    UDirectorSessionSave* Save = Cast<UDirectorSessionSave>(UGameplayStatics::CreateSaveGameObject(UDirectorSessionSave::StaticClass()));
+    if (!Save || !RunnerAsync->ExportSession(Save->RunnerState)) return false;
+    Save->ModelFile = ModelFile;
+    Save->SavedAt = FDateTime::UtcNow();
+    return UGameplayStatics::SaveGameToSlot(Save, DirectorSessionSlot(SlotName), UserIndex);
+}
+
+bool UGameDirectorSubsystem::LoadDirectorSession(const FString& SlotName, int32 UserIndex)
+{
+    const FString Slot = DirectorSessionSlot(SlotName);
+    if (!UGameplayStatics::DoesSaveGameExist(Slot, UserIndex)) return false;
+
+    UDirectorSessionSave* Save = Cast<UDirectorSessionSave>(UGameplayStatics::LoadGameFromSlot(Slot, UserIndex));
+    if (!Save || Save->RunnerState.Num() == 0) return false;
+    UE_LOG(LogTemp, Display, TEXT("Director session %s: %s, saved %s"), *Slot, *Save->ModelFile, *Save->SavedAt.ToString());
+
+    // the model key inside the blob can only be checked against loaded weights
+    if (RunnerAsync && RunnerAsync->IsLoading())
+    {
+        PendingSessionState = MoveTemp(Save->RunnerState);
+        return true;
+    }
+    return RunnerAsync && RunnerAsync->ImportSession(Save->RunnerState);
+}
+
+void UGameDirectorSubsystem::RunPrefillBenchmark(int32 NumTokens, float MaxChunkMs)
+{
+    if (!RunnerAsync || !RunnerAsync->IsInitialized())
+    {
+        UE_LOG(LogTemp, Warning, TEXT("BenchPrefill: runner not initialized"));
+        return;
+    }
+
+    const TArray<int32> UBatchSizes = { 128, 256, 512, 1024 };
+    const TArray<int32> ChunkSizes = { 64, 128, 256, 512, 0 };
+    const TArray<LLamaRunnerAsync::FPrefillBenchResult> Results = RunnerAsync->BenchmarkPrefill(NumTokens, UBatchSizes, ChunkSizes);
+
+    // Best throughput overall, and best among the settings whose longest chunk fits the latency budget
+    const LLamaRunnerAsync::FPrefillBenchResult* Best = nullptr;
+    const LLamaRunnerAsync::FPrefillBenchResult* BestInBudget = nullptr;
+    UE_LOG(LogTemp, Display, TEXT("BenchPrefill %d tokens   n_ubatch  chunk     tok/s  max chunk ms"), NumTokens);
+    for (const LLamaRunnerAsync::FPrefillBenchResult& R : Results)
+    {
+        UE_LOG(LogTemp, Display, TEXT("                          %8d  %5d  %8.0f  %12.1f"), R.UBatch, R.Chunk, R.TokensPerSecond, R.MaxChunkMs);
+        if (!Best || R.TokensPerSecond > Best->TokensPerSecond) Best = &R;
+        if (R.MaxChunkMs <= MaxChunkMs && (!BestInBudget || R.TokensPerSecond > BestInBudget->TokensPerSecond)) BestInBudget = &R;
+    }
+    if (Best)
+    {
+        UE_LOG(LogTemp, Display, TEXT("  fastest: n_ubatch %d, chunk %d (%.0f tok/s)"), Best->UBatch, Best->Chunk, Best->TokensPerSecond);
+    }
+    if (BestInBudget)
+    {
+        UE_LOG(LogTemp, Display, TEXT("  within %.0f ms per chunk: GameDirector.UBatchSize %d, GameDirector.PrefillChunk %d (%.0f tok/s)"),
+            MaxChunkMs, BestInBudget->UBatch, BestInBudget->Chunk, BestInBudget->TokensPerSecond);
+    }
+}
+
+static void BenchPrefill(const TArray<FString>& Args, UWorld* World)
+{
+    UGameInstance* GameInstance = World ? World->GetGameInstance() : nullptr;
+    UGameDirectorSubsystem* Director = GameInstance ? GameInstance->GetSubsystem<UGameDirectorSubsystem>() : nullptr;
+    if (!Director)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("BenchPrefill: no GameDirector subsystem in this world"));
+        return;
+    }
+    Director->RunPrefillBenchmark(Args.Num() > 0 ? FCString::Atoi(*Args[0]) : 1024,
+        Args.Num() > 1 ? FCString::Atof(*Args[1]) : 50.f);
+}
+
+static FAutoConsoleCommandWithWorldAndArgs CmdBenchPrefill(
+    TEXT("GameDirector.BenchPrefill"),
+    TEXT("Times prompt prefill for several n_ubatch and chunk sizes on a scratch context. Args: [NumTokens] [MaxChunkMs]"),
+    FConsoleCommandWithWorldAndArgsDelegate::CreateStatic(&BenchPrefill));
+
+void UGameDirectorSubsystem::Initialize(FSubsystemCollectionBase& Collection)
+{
+    Super::Initialize(Collection);
+
+    // One drain per frame for every streaming request; the worker never hops to the game thread per token
+    StreamTickerHandle = FTSTicker::GetCoreTicker().AddTicker(
+        FTickerDelegate::CreateUObject(this, &UGameDirectorSubsystem::TickStreams));
+}
+
+void UGameDirectorSubsystem::Deinitialize()
+{
+    FTSTicker::GetCoreTicker().RemoveTicker(StreamTickerHandle);
+    StreamTickerHandle.Reset();
+
+    // Stop the workers now (within one decode step) instead of when the runner happens to be destroyed
+    CancelAllRequests();
+    RunnerAsync.Reset();
+    ActiveStreams.Reset();
+
+    Super::Deinitialize();
+}
+
+bool UGameDirectorSubsystem::TickStreams(float /*DeltaTime*/)
 {
-    RunnerAsync->GenerateJSONAsync(Prompt,
-        [this](FString Output)
+    for (TPair<int32, TSharedPtr<FDirectorStream, ESPMode::ThreadSafe>>& It : ActiveStreams)
+    {
+        DrainStream(It.Key, *It.Value);
+    }
+    return true;
+}
+
+static bool ParseToolCallJson(const FString& RawJson, FToolCall& Out);
+
+void UGameDirectorSubsystem::DrainStream(int32 RequestId, FDirectorStream& Stream)
+{
+    FString Delta;
+    TArray<FString> Lines;
+    TArray<FString> ToolCalls;
+    if (!Stream.Drain(Delta, Lines, ToolCalls)) return;
+
+    if (!Delta.IsEmpty())
+    {
+        OnDirectorTextDelta.Broadcast(RequestId, Delta);
+    }
+    for (const FString& Line : Lines)
+    {
+        OnDirectorDialogueLine.Broadcast(RequestId, Stream.NumLinesDelivered++, Line);
+    }
+    for (const FString& Raw : ToolCalls)
+    {
+        FToolCall Call;
+        if (!ParseToolCallJson(Raw, Call))
         {
-            // This lambda runs on the Game Thread
-            FString Intent;
-            TArray<FToolCall> Tools;
-            TArray<FObjective> Objectives;
-            FDialogue Dialogue;
-			FString Json;
-            if (ParseDirectorJSON(Output, Intent, Tools, Objectives, Dialogue,Json))
-            {
-                FDirectorDecision D;
-                D.Intent = MoveTemp(Intent);
-                D.ToolCalls = MoveTemp(Tools);
-                D.Objectives = MoveTemp(Objectives);
-                D.Dialogue = MoveTemp(Dialogue);
-                D.Response = Json;
-                OnDirectorDecision.Broadcast(D);
-            }
-        },Intent);
+            UE_LOG(LogTemp, Warning, TEXT("Streamed tool call did not parse, left for the final decision: %s"), *Raw);
+            continue;
+        }
+        ++Stream.NumToolCallsDelivered;
+        OnDirectorToolCall.Broadcast(RequestId, Call);
+    }
+}
+
+bool UGameDirectorSubsystem::Generate2(FString Prompt, FString Intent)
+{
+    if (!RunnerAsync) return false;
+    StartRequest(Prompt, Intent, NextRequestId++, nullptr);
+    return true;
+}
+
+int32 UGameDirectorSubsystem::GenerateStreaming(FString Prompt, FString Intent)
+{
+    if (!RunnerAsync) return 0;
+
+    const int32 RequestId = NextRequestId++;
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream = MakeShared<FDirectorStream, ESPMode::ThreadSafe>();
+    ActiveStreams.Add(RequestId, Stream);
+    StartRequest(Prompt, Intent, RequestId, MoveTemp(Stream));
+    return RequestId;
+}
+
+int32 UGameDirectorSubsystem::GenerateWithPriority(FString Prompt, FString Intent, EDirectorPriority Priority,
+    float DeadlineSeconds, FString MergeKey, bool bStream, bool bForceFresh, float CacheTtlSeconds, FString AssistantPrefix, FString Persona)
+{
+    if (!RunnerAsync) return 0;
+
+    FDirectorJobOptions Options;
+    Options.Priority = (int32)Priority;
+    Options.DeadlineSeconds = DeadlineSeconds;
+    Options.MergeKey = MoveTemp(MergeKey);
+    Options.bForceFresh = bForceFresh;
+    Options.CacheTtlSeconds = CacheTtlSeconds;
+    Options.AssistantPrefix = MoveTemp(AssistantPrefix);
+    Options.Persona = MoveTemp(Persona);
+
+    const int32 RequestId = NextRequestId++;
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream;
+    if (bStream)
+    {
+        Stream = MakeShared<FDirectorStream, ESPMode::ThreadSafe>();
+        ActiveStreams.Add(RequestId, Stream);
+    }
+    StartRequest(Prompt, Intent, RequestId, MoveTemp(Stream), Options);
+    return RequestId;
+}
+
+int32 UGameDirectorSubsystem::GenerateDialogueTurn(FString Speaker, FString Prompt, FString Intent, bool bStream)
+{
+    if (!RunnerAsync || Speaker.IsEmpty()) return 0;
+
+    FDirectorJobOptions Options;
+    Options.Conversation = MoveTemp(Speaker);
+
+    const int32 RequestId = NextRequestId++;
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream;
+    if (bStream)
+    {
+        Stream = MakeShared<FDirectorStream, ESPMode::ThreadSafe>();
+        ActiveStreams.Add(RequestId, Stream);
+    }
+    StartRequest(Prompt, Intent, RequestId, MoveTemp(Stream), Options);
+    return RequestId;
+}
+
+void UGameDirectorSubsystem::EndDialogue(FString Speaker)
+{
+    if (RunnerAsync) RunnerAsync->EndConversation(Speaker);
+}
+
+bool UGameDirectorSubsystem::CancelRequest(int32 RequestId)
+{
+    const TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>* Handle = ActiveJobs.Find(RequestId);
+    if (!Handle) return false;
+    (*Handle)->Cancel();
     return true;
 }
+
+void UGameDirectorSubsystem::CancelAllRequests()
+{
+    for (TPair<int32, TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>>& It : ActiveJobs)
+    {
+        It.Value->Cancel();
+    }
+}
+
+void UGameDirectorSubsystem::StartRequest(const FString& Prompt, const FString& Intent, int32 RequestId,
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream, const FDirectorJobOptions& Options)
+{
+    TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> Handle = RunnerAsync->GenerateJSONAsync(Prompt,
+        [WeakThis = TWeakObjectPtr<UGameDirectorSubsystem>(this), RequestId](FString Output)
+        {
+            // This lambda runs on the Game Thread, possibly after the subsystem is gone (end of PIE).
+            UGameDirectorSubsystem* This = WeakThis.Get();
+            if (!This) return;
+            This->OnRequestDone(RequestId, MoveTemp(Output));
+        },Intent, MoveTemp(Stream), Options);
+    ActiveJobs.Add(RequestId, MoveTemp(Handle));
+}
+
+void UGameDirectorSubsystem::OnRequestDone(int32 RequestId, FString Output)
+{
+    TSharedPtr<FDirectorJobHandle, ESPMode::ThreadSafe> Handle;
+    if (const TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>* Found = ActiveJobs.Find(RequestId))
+    {
+        Handle = *Found;
+        ActiveJobs.Remove(RequestId);
+    }
+
+    // Flush what the ticker has not delivered yet so deltas and lines always precede the decision.
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Finished;
+    int32 ToolCallsDispatched = 0;
+    if (ActiveStreams.RemoveAndCopyValue(RequestId, Finished) && Finished)
+    {
+        DrainStream(RequestId, *Finished);
+        ToolCallsDispatched = Finished->NumToolCallsDelivered;
+    }
+    if (Handle && Handle->IsCancelled()) return;
+
+    FString Intent;
+    TArray<FToolCall> Tools;
+    TArray<FObjective> Objectives;
+    FDialogue Dialogue;
+    FString Json;
+    if (ParseDirectorJSON(Output, Intent, Tools, Objectives, Dialogue,Json))
+    {
+        FDirectorDecision D;
+        D.Intent = MoveTemp(Intent);
+        D.ToolCalls = MoveTemp(Tools);
+        D.Objectives = MoveTemp(Objectives);
+        D.Dialogue = MoveTemp(Dialogue);
+        D.Response = Json;
+        D.NumToolCallsDispatched = FMath::Min(ToolCallsDispatched, D.ToolCalls.Num());
+        OnDirectorDecision.Broadcast(D);
+    }
+}
 bool UGameDirectorSubsystem::Generate(FString Prompt)
 {
 
@@ -268,6 +568,30 @@ static bool JsonToString(const TSharedPtr<FJsonObject>& Obj, FString& Out)
         TJsonWriterFactory<TCHAR, TCondensedJsonPrintPolicy<TCHAR>>::Create(&Out);
     return FJsonSerializer::Serialize(Obj.ToSharedRef(), Writer);
 }
+// { "name": ..., "args": { ... } } -> FToolCall, args compact-stringified
+static void ToolCallFromObject(const TSharedPtr<FJsonObject>& ToolObj, FToolCall& Out)
+{
+    ToolObj->TryGetStringField(TEXT("name"), Out.Name);
+
+    const TSharedPtr<FJsonObject>* ArgsPtr = nullptr;
+    if (ToolObj->TryGetObjectField(TEXT("args"), ArgsPtr) && ArgsPtr && ArgsPtr->IsValid()) {
+        FString ArgsStr;
+        if (JsonToString(*ArgsPtr, ArgsStr)) {
+            Out.ArgsJson = MoveTemp(ArgsStr);
+        }
+    }
+}
+
+// One tool_calls element as handed out by the stream scanner
+static bool ParseToolCallJson(const FString& RawJson, FToolCall& Out)
+{
+    TSharedPtr<FJsonObject> ToolObj;
+    TSharedRef<TJsonReader<>> Reader = TJsonReaderFactory<>::Create(RawJson);
+    if (!FJsonSerializer::Deserialize(Reader, ToolObj) || !ToolObj.IsValid()) return false;
+
+    ToolCallFromObject(ToolObj, Out);
+    return !Out.Name.IsEmpty();
+}
 static TArray<FString> JsonToStringArray(const TArray<TSharedPtr<FJsonValue>>& InVals)
 {
     TArray<FString> Out;
@@ -481,16 +805,7 @@ bool UGameDirectorSubsystem::ParseDirectorJSON(
             if (!ToolObj.IsValid()) continue;
 
             FToolCall T;
-            ToolObj->TryGetStringField(TEXT("name"), T.Name);
-
-            // args: compact-stringify the object
-            const TSharedPtr<FJsonObject>* ArgsPtr = nullptr;
-            if (ToolObj->TryGetObjectField(TEXT("args"), ArgsPtr) && ArgsPtr && ArgsPtr->IsValid()) {
-                FString ArgsStr;
-                if (JsonToString(*ArgsPtr, ArgsStr)) {
-                    T.ArgsJson = MoveTemp(ArgsStr);
-                }
-            }
+            ToolCallFromObject(ToolObj, T);
             OutTools.Add(T);
         }
     }
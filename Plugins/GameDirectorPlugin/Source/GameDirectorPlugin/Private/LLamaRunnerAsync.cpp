@@ -1,9 +1,16 @@
 #include "LLamaRunnerAsync.h"
 #include "Misc/Paths.h"
 #include "HAL/PlatformProcess.h"
+#include "HAL/IConsoleManager.h"
 
 #include "Serialization/JsonReader.h"
 #include "Serialization/JsonSerializer.h"
+#include "DirectorTuning.h"
+#include "HAL/FileManager.h"
+#include "HAL/PlatformMemory.h"
+#include "Misc/FileHelper.h"
+#include "Serialization/MemoryWriter.h"
+#include "Serialization/MemoryReader.h"
 
 #if PLATFORM_WINDOWS
 #include "Windows/AllowWindowsPlatformTypes.h"
@@ -11,6 +18,11 @@
 #include "Windows/HideWindowsPlatformTypes.h"
 #endif
 
+#if PLATFORM_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // If you prefer to include "llama.h" here, do it now:
 
 
@@ -359,6 +371,308 @@ static void PushThirdPartyDllDir()
     }
 }
 
+// ---------- Cold start ----------
+// Pulls the GGUF into the OS page cache before llama mmaps it, so the weights fault in from RAM instead of one random
+// disk read at a time during the first decodes. Skipped when the file would not fit in free memory anyway.
+static void PrefetchModelFile(const FString& Path, const TAtomic<bool>& bAbort)
+{
+    const int64 Size = IFileManager::Get().FileSize(*Path);
+    if (Size <= 0 || (uint64)Size > FPlatformMemory::GetStats().AvailablePhysical)
+    {
+        UE_LOG(LogGameAI, Display, TEXT("Prefetch skipped: %.1f GB model, %.1f GB free"), Size / 1e9, FPlatformMemory::GetStats().AvailablePhysical / 1e9);
+        return;
+    }
+    const double T0 = FPlatformTime::Seconds();
+
+#if PLATFORM_LINUX
+    // readahead blocks until the range is in the page cache; do it in slices so an abort is noticed
+    const int Fd = open(TCHAR_TO_UTF8(*Path), O_RDONLY);
+    if (Fd < 0) return;
+    posix_fadvise(Fd, 0, 0, POSIX_FADV_WILLNEED);
+    constexpr int64 Slice = 256ll << 20;
+    for (int64 Offset = 0; Offset < Size && !bAbort; Offset += Slice)
+    {
+        readahead(Fd, (off64_t)Offset, (size_t)FMath::Min(Slice, Size - Offset));
+    }
+    close(Fd);
+#else
+    // no readahead: a sequential read leaves the pages in the standby list just the same
+    TUniquePtr<FArchive> Reader(IFileManager::Get().CreateFileReader(*Path));
+    if (!Reader) return;
+    TArray<uint8> Buffer;
+    Buffer.SetNumUninitialized(16 << 20);
+    for (int64 Offset = 0; Offset < Size && !bAbort; Offset += Buffer.Num())
+    {
+        Reader->Serialize(Buffer.GetData(), FMath::Min<int64>(Buffer.Num(), Size - Offset));
+    }
+#endif
+    UE_LOG(LogGameAI, Display, TEXT("Prefetched %.1f GB of weights in %.1f s"), Size / 1e9, FPlatformTime::Seconds() - T0);
+}
+
+// Runs the weights once so nothing is faulted in or allocated on the first real request: a prompt-sized batch and a
+// single-token step. With warmup set llama.cpp also runs every MoE expert, not just the routed ones.
+static void WarmupContext(llama_context* Ctx, int32 n_vocab, int32 NumTokens)
+{
+    std::vector<llama_token> Tokens((size_t)NumTokens);
+    for (int32 i = 0; i < NumTokens; ++i) Tokens[i] = (llama_token)(((int64)i * 7919) % n_vocab);
+
+    llama_set_warmup(Ctx, true);
+    llama_decode(Ctx, llama_batch_get_one(Tokens.data(), NumTokens));
+    llama_decode(Ctx, llama_batch_get_one(Tokens.data(), 1));
+    llama_set_warmup(Ctx, false);
+    llama_synchronize(Ctx);
+    llama_memory_clear(llama_get_memory(Ctx), /*data*/ true);
+    llama_perf_context_reset(Ctx);
+}
+
+// ---------- Cached results ----------
+// Same stream contract as a generated job: the text, then its lines and tool calls
+static void StreamCachedDecision(FDirectorStream& Stream, const FString& Json)
+{
+    FTCHARToUTF8 Utf8(*Json);
+    FDirectorOutputScanner Scanner;
+    TArray<FString> Lines, Tools;
+    Stream.AppendUtf8(Utf8.Get(), Utf8.Length());
+    Scanner.Feed(Utf8.Get(), Utf8.Length(), Lines, Tools);
+    for (FString& Line : Lines) Stream.AddDialogueLine(MoveTemp(Line));
+    for (FString& Tool : Tools) Stream.AddToolCall(MoveTemp(Tool));
+}
+
+// ---------- Prompt helpers ----------
+static bool ApplyChatTemplate(const llama_chat_message* Msgs, size_t NumMsgs, std::string& Out)
+{
+    const int32_t needed = llama_chat_apply_template(nullptr, Msgs, NumMsgs, /*add_assistant*/ true, nullptr, 0);
+    if (needed <= 0)
+    {
+        UE_LOG(LogTemp, Error, TEXT("apply_template(size) failed (%d)"), needed);
+        return false;
+    }
+
+    Out.assign((size_t)needed, '\0');
+    const int32_t written = llama_chat_apply_template(nullptr, Msgs, NumMsgs, /*add_assistant*/ true, Out.data(), needed);
+    if (written <= 0 || written > needed)
+    {
+        UE_LOG(LogTemp, Error, TEXT("apply_template(write) failed (%d)"), written);
+        return false;
+    }
+    Out.resize((size_t)written);
+    return true;
+}
+
+// bSpecial = add BOS etc. and parse special tokens; off for text that continues a sequence (assistant prefix, forced runs)
+static bool TokenizeUtf8(const llama_vocab* Vocab, const std::string& Text, std::vector<llama_token>& Out, bool bSpecial = true)
+{
+    int32_t needed = llama_tokenize(Vocab, Text.data(), (int32_t)Text.size(), nullptr, 0, /*add_special*/ bSpecial, /*parse_special*/ bSpecial);
+    if (needed < 0) needed = -needed;
+    if (needed <= 0)
+    {
+        UE_LOG(LogGameAI, Display, TEXT("tokenize(size) failed (%d)"), needed);
+        return false;
+    }
+
+    Out.resize((size_t)needed);
+    const int32_t count = llama_tokenize(Vocab, Text.data(), (int32_t)Text.size(), Out.data(), (int32_t)Out.size(), /*add_special*/ bSpecial, /*parse_special*/ bSpecial);
+    if (count < 0)
+    {
+        UE_LOG(LogGameAI, Display, TEXT("tokenize(write) failed (%d)"), count);
+        return false;
+    }
+    Out.resize((size_t)count);
+    return true;
+}
+
+// Renders the chat template with a marker in place of the user content and returns everything before it,
+// i.e. the part of the prompt that depends only on the system text.
+static bool RenderSystemPrefix(const std::string& SystemUtf8, std::string& OutPrefix)
+{
+    static const char* kUserMarker = "\x1FGD_USER_SPLIT\x1F";
+    const llama_chat_message msgs[2] = {
+        { "system", SystemUtf8.c_str() },
+        { "user",   kUserMarker }
+    };
+
+    std::string templ;
+    if (!ApplyChatTemplate(msgs, 2, templ)) return false;
+
+    const size_t at = templ.find(kUserMarker);
+    if (at == std::string::npos || at == 0) return false;
+    OutPrefix = templ.substr(0, at);
+    return true;
+}
+
+// ---------- Director JSON grammar ----------
+// GBNF for the director schema with a fixed key order. The enums mirror kAllowedIntents / kAllowedTools in
+// IsValidDirectorJSON; keep them in sync. Strings are single-line, and sections the validator requires to be
+// non-empty use nestr.
+static const char* kDirectorGrammar = R"GBNF(
+root        ::= "{" ws "\"intent\":" ws intent "," ws "\"reason\":" ws nestr "," ws "\"tool_calls\":" ws toolcalls "," ws "\"dialogue\":" ws dialogue "," ws "\"quest_patch\":" ws questpatch ws "}"
+intent      ::= "\"" ("offer_quest" | "warn" | "give_clue" | "continue" | "escalate" | "deescalate" | "spawn_event") "\""
+toolcalls   ::= "[" ws (toolcall ("," ws toolcall){0,3})? ws "]"
+toolcall    ::= "{" ws "\"name\":" ws toolname "," ws "\"args\":" ws args ws "}"
+toolname    ::= "\"" ("QuestPatch" | "SpawnEncounter" | "SetFlag" | "GiveItem" | "WeatherControl" | "ForeshadowEvent" | "TensionMeterAdjust") "\""
+args        ::= "{" ws (arg ("," ws arg){0,5})? ws "}"
+arg         ::= nestr ":" ws (str | number | "true" | "false")
+dialogue    ::= "{" ws "\"speaker\":" ws nestr "," ws "\"emote\":" ws emote "," ws "\"lines\":" ws "[" ws nestr ("," ws nestr){0,3} ws "]" ws "}"
+emote       ::= "\"" ("urgent" | "wary" | "calm") "\""
+questpatch  ::= "{}" | "{" ws "\"questId\":" ws nestr "," ws "\"addObjectives\":" ws "[" ws (objective ("," ws objective){0,3})? ws "]" ws "}"
+objective   ::= "{" ws "\"id\":" ws nestr "," ws "\"desc\":" ws nestr ws "}"
+number      ::= "-"? [0-9]+ ("." [0-9]+)?
+str         ::= "\"" char* "\""
+nestr       ::= "\"" char+ "\""
+char        ::= [^"\\\x00-\x1F] | "\\" (["\\/bfnrt] | "u" [0-9a-fA-F]{4})
+ws          ::= " "?
+)GBNF";
+
+// True if the grammar in its current state accepts Id. One-candidate apply, so it is cheap.
+static bool GrammarAllows(llama_sampler* Grammar, llama_token Id, float Logit)
+{
+    llama_token_data Cand = { Id, Logit, 0.0f };
+    llama_token_data_array Arr = { &Cand, 1, /*selected*/ -1, /*sorted*/ false };
+    llama_sampler_apply(Grammar, &Arr);
+    return Cand.logit != -INFINITY;
+}
+
+// Copies logits into OutMasked with every token the grammar rejects set to -INFINITY
+static const float* ApplyGrammarMask(llama_sampler* Grammar, const float* Logits, int n_vocab,
+    std::vector<llama_token_data>& Cands, std::vector<float>& OutMasked)
+{
+    for (int i = 0; i < n_vocab; ++i) Cands[i] = { (llama_token)i, Logits[i], 0.0f };
+    llama_token_data_array Arr = { Cands.data(), (size_t)n_vocab, /*selected*/ -1, /*sorted*/ false };
+    llama_sampler_apply(Grammar, &Arr);
+    for (int i = 0; i < n_vocab; ++i) OutMasked[i] = Cands[i].logit;
+    return OutMasked.data();
+}
+
+static TAutoConsoleVariable<int32> CVarGrammarConstrained(
+    TEXT("GameDirector.GrammarConstrained"),
+    1,
+    TEXT("1 = constrain decoding with the director JSON grammar (default).\n")
+    TEXT("0 = unconstrained decoding, output is only validated afterwards."),
+    ECVF_Default);
+
+// A/B switch for measuring per-request setup cost against the old free + recreate behaviour
+static TAutoConsoleVariable<int32> CVarRecreateContextPerRequest(
+    TEXT("GameDirector.RecreateContextPerRequest"),
+    0,
+    TEXT("0 = clear the KV memory in place between requests (default).\n")
+    TEXT("1 = free and recreate the llama context for every request (legacy, for timing comparisons only)."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarMaxQueuedJobs(
+    TEXT("GameDirector.MaxQueuedJobs"),
+    16,
+    TEXT("Jobs waiting per context before the overflow policy kicks in. 0 = unbounded."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarQueueOverflowPolicy(
+    TEXT("GameDirector.QueueOverflowPolicy"),
+    0,
+    TEXT("What a full director queue does with a new job:\n")
+    TEXT("0 = drop the oldest queued job of the lowest priority, if it is not above the new one (default).\n")
+    TEXT("1 = reject the new job.\n")
+    TEXT("2 = merge into a queued job with the same MergeKey (callers share its result), else reject."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarCoalesceRequests(
+    TEXT("GameDirector.CoalesceRequests"),
+    1,
+    TEXT("1 = identical non-streaming requests in flight share one decode (default).\n")
+    TEXT("0 = every request is generated on its own."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarDecisionCacheSize(
+    TEXT("GameDirector.DecisionCacheSize"),
+    256,
+    TEXT("Validated decisions kept in the persistent LRU decision cache. 0 = cache off."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarDecisionCacheTTL(
+    TEXT("GameDirector.DecisionCacheTTL"),
+    1800.0f,
+    TEXT("Seconds a cached decision stays valid, unless the request sets its own TTL."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarSemanticCache(
+    TEXT("GameDirector.SemanticCache"),
+    0,
+    TEXT("1 = also reuse a cached decision whose prompt embedding is close enough to the new prompt's (see\n")
+    TEXT("GameDirector.SemanticThreshold). Costs one embedding pass of the prompt per cacheable request. Read at Initiate."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<float> CVarSemanticThreshold(
+    TEXT("GameDirector.SemanticThreshold"),
+    0.97f,
+    TEXT("Cosine similarity of prompt embeddings above which a cached decision is reused for a different prompt."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<FString> CVarDraftModel(
+    TEXT("GameDirector.DraftModel"),
+    TEXT(""),
+    TEXT("Small GGUF with the main model's vocab used for speculative decoding of greedy jobs (absolute or relative to\n")
+    TEXT("the project dir). Read at Initiate; empty = off."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarDraftTokens(
+    TEXT("GameDirector.DraftTokens"),
+    4,
+    TEXT("Tokens the draft model proposes per step (1..16). 0 = keep the draft model loaded but do not speculate."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarBatchSize(
+    TEXT("GameDirector.BatchSize"),
+    0,
+    TEXT("n_batch: most tokens one llama_decode takes. Read at Initiate; 0 = llama.cpp default."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarUBatchSize(
+    TEXT("GameDirector.UBatchSize"),
+    0,
+    TEXT("n_ubatch: physical batch size llama_decode splits its input into. Read at Initiate; 0 = llama.cpp default.\n")
+    TEXT("See GameDirector.BenchPrefill for picking it."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarPrefillChunk(
+    TEXT("GameDirector.PrefillChunk"),
+    256,
+    TEXT("Prompt tokens prefilled per scheduler step. Between chunks running sequences generate, cancellation is\n")
+    TEXT("checked and a more important job's prefill goes first. 0 = whole prompt in one step (still split at n_batch)."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarJumpForward(
+    TEXT("GameDirector.JumpForward"),
+    1,
+    TEXT("1 = tokens the director schema forces (keys, separators, brackets, the requested intent) are inserted as\n")
+    TEXT("multi-token runs without sampling (default). 0 = every token is sampled."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<FString> CVarPersonas(
+    TEXT("GameDirector.Personas"),
+    TEXT(""),
+    TEXT("LoRA persona adapters for the director model, as name=path[@scale] pairs separated by commas, e.g.\n")
+    TEXT("\"grim=Loras/grim.gguf,comedic=Loras/comedic.gguf@0.8\". Relative paths are under the project. Read at Initiate."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarConversationTurns(
+    TEXT("GameDirector.ConversationTurns"),
+    8,
+    TEXT("Earlier turns a conversation (FDirectorJobOptions::Conversation) keeps as chat history; older ones are dropped.\n")
+    TEXT("Turns are also dropped, oldest first, when the history and the answer would not fit the sequence's context."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarWarmup(
+    TEXT("GameDirector.Warmup"),
+    1,
+    TEXT("Cold-start work at Initiate, so the first request runs at steady-state speed:\n")
+    TEXT("0 = none. 1 = throwaway decode on every context (default). 2 = also read the GGUF into the page cache first."),
+    ECVF_Default);
+
+static TAutoConsoleVariable<int32> CVarHugePages(
+    TEXT("GameDirector.HugePages"),
+    0,
+    TEXT("Linux: 1 = load the weights into anonymous memory instead of mmapping the GGUF, so transparent huge pages can\n")
+    TEXT("back them (needs /sys/kernel/mm/transparent_hugepage/enabled = always). Costs a full read at load. Read at Initiate."),
+    ECVF_Default);
+
 // ---------- LLamaRunnerAsync ----------
 LLamaRunnerAsync::LLamaRunnerAsync() {}
 LLamaRunnerAsync::~LLamaRunnerAsync()
@@ -367,8 +681,9 @@ LLamaRunnerAsync::~LLamaRunnerAsync()
 }
 
 // ---------- Worker implementation (note full qualification) ----------
-LLamaRunnerAsync::FWorker::FWorker(LLamaRunnerAsync* InOwner)
+LLamaRunnerAsync::FWorker::FWorker(LLamaRunnerAsync* InOwner, FContextSlot* InSlot)
     : Owner(InOwner)
+    , Slot(InSlot)
 {
     WakeEvent = FPlatformProcess::GetSynchEventFromPool(false);
 }
@@ -393,30 +708,41 @@ uint32 LLamaRunnerAsync::FWorker::Run()
 {
     while (!bStop)
     {
-        if (WakeEvent) WakeEvent->Wait();
+        // Only sleep when nothing is in flight; active sequences keep the loop stepping
+        if (!Slot->HasActiveSequences() && WakeEvent) WakeEvent->Wait();
 
-        FJob Job;
-        while (!bStop && Queue.Dequeue(Job))
+        // Conversations ended from other threads give their sequences back between steps; session tasks run here too
+        TArray<FString> Ended;
+        TArray<TUniqueFunction<void()>> Pending;
         {
-            FString Output;
-            if (Owner && Owner->IsInitialized())
-            {
-                const int   top_k = 20;
-                const float top_p = 0.8f;
-                const float temp = 0.20f;
+            FScopeLock Lock(&QueueMutex);
+            Swap(Ended, EndedConversations);
+            Swap(Pending, Tasks);
+        }
+        for (const FString& Key : Ended) Owner->DropConversation(*Slot, Key);
+        for (TUniqueFunction<void()>& Task : Pending) Task();
 
-                // Call synchronous generation on the worker thread
-                Output = Owner->GenerateJSON(Job.Prompt, /*max_new*/800, /*top_k*/20, /*top_p*/0.8f, /*temp*/0.20f,Job.Intent);
-            }
+        // New jobs join between steps, as long as a sequence is free
+        FJob Job;
+        while (!bStop && Slot->HasFreeSequence() && PopNextJob(Job))
+        {
+            if (Job.IsCancelled()) { Owner->CompleteJob(*Slot, Job, TEXT("{}")); continue; }
 
-            if (Job.OnDone)
+            // Stale by now: not worth a prefill
+            const double Now = FPlatformTime::Seconds();
+            if (Job.IsExpired(Now))
             {
-                AsyncTask(ENamedThreads::GameThread,
-                    [OnDone = MoveTemp(Job.OnDone), Output = MoveTemp(Output)]() mutable
-                    {
-                        OnDone(Output);
-                    });
+                UE_LOG(LogGameAI, Display, TEXT("Job skipped, %.0f ms past its deadline (ctx %d)"), (Now - Job.Deadline) * 1000.0, Slot->Index);
+                Owner->CompleteJob(*Slot, Job, TEXT("{}"));
+                continue;
             }
+            Owner->BeginSequence(*Slot, MoveTemp(Job));
+        }
+
+        // One prefill chunk, then one batched llama_decode advancing every generating sequence by one token
+        if (!bStop && Slot->HasActiveSequences())
+        {
+            Owner->StepSequences(*Slot);
         }
     }
     return 0;
@@ -428,31 +754,392 @@ void LLamaRunnerAsync::FWorker::Stop()
     if (WakeEvent) WakeEvent->Trigger();
 }
 
+void LLamaRunnerAsync::FWorker::EndConversation(const FString& Conversation)
+{
+    {
+        FScopeLock Lock(&QueueMutex);
+        EndedConversations.Add(Conversation);
+    }
+    if (WakeEvent) WakeEvent->Trigger();
+}
+
+void LLamaRunnerAsync::FWorker::RunBetweenSteps(TUniqueFunction<void()>&& Task)
+{
+    {
+        FScopeLock Lock(&QueueMutex);
+        Tasks.Add(MoveTemp(Task));
+    }
+    if (WakeEvent) WakeEvent->Trigger();
+}
+
 void LLamaRunnerAsync::FWorker::Enqueue(FJob&& Job)
 {
-    Queue.Enqueue(MoveTemp(Job));
+    const int32 MaxQueued = CVarMaxQueuedJobs.GetValueOnAnyThread();
+    const int32 Policy = CVarQueueOverflowPolicy.GetValueOnAnyThread();
+
+    // Completed outside the lock
+    TArray<FJob, TInlineAllocator<1>> Dropped;
+    bool bMerged = false;
+    {
+        FScopeLock Lock(&QueueMutex);
+        Job.Serial = NextSerial++;
+
+        if (MaxQueued <= 0 || Queue.Num() < MaxQueued)
+        {
+            Queue.Add(MoveTemp(Job));
+        }
+        else if (Policy == 0)
+        {
+            // Oldest of the lowest priority goes, unless everything queued outranks the new job
+            int32 Victim = INDEX_NONE;
+            for (int32 i = 0; i < Queue.Num(); ++i)
+            {
+                if (Queue[i].Priority > Job.Priority) continue;
+                if (Victim == INDEX_NONE || Queue[i].Priority < Queue[Victim].Priority
+                    || (Queue[i].Priority == Queue[Victim].Priority && Queue[i].Serial < Queue[Victim].Serial))
+                {
+                    Victim = i;
+                }
+            }
+            if (Victim != INDEX_NONE)
+            {
+                Dropped.Add(MoveTemp(Queue[Victim]));
+                Queue.RemoveAt(Victim);
+                Queue.Add(MoveTemp(Job));
+            }
+            else
+            {
+                Dropped.Add(MoveTemp(Job));
+            }
+        }
+        else
+        {
+            // Merge: the queued job keeps its place and takes over the newer prompt; both callers get its result.
+            // Blocking jobs complete on the worker and are never merged with game-thread ones, conversation turns never at all.
+            // The result is cached under the newer job's key, so everything else in that key has to match already.
+            FJob* Into = nullptr;
+            if (Policy == 2 && !Job.MergeKey.IsEmpty() && !Job.bCompleteOnWorker && Job.Conversation.IsEmpty())
+            {
+                auto CanMerge = [&Job](const FJob& Q)
+                    {
+                        return !Q.bCompleteOnWorker && Q.Conversation.IsEmpty() && Q.MergeKey == Job.MergeKey && !Q.IsCancelled()
+                            && Q.MaxNew == Job.MaxNew && Q.TopP == Job.TopP
+                            && Q.TopK == Job.TopK && Q.Temp == Job.Temp    // greedy and sampled jobs never share a decode
+                            && Q.AssistantPrefix == Job.AssistantPrefix && Q.Persona == Job.Persona
+                            && !Q.Stream && !Job.Stream;                   // a stream belongs to one caller
+                    };
+                Into = Queue.FindByPredicate(CanMerge);
+            }
+            if (Into)
+            {
+                // The old prompt's callers must not attach to a job that now answers the new one
+                Owner->ForgetInFlight(*Into);
+
+                // One handle counting both callers: the job is cancelled only once both have cancelled
+                TSharedPtr<FDirectorJobHandle, ESPMode::ThreadSafe> Merged = MakeShared<FDirectorJobHandle, ESPMode::ThreadSafe>();
+                Merged->NumCallers = 2;
+                Into->Handle->Shared = Merged;
+                Job.Handle->Shared = Merged;
+
+                Into->OnDone = [Older = MoveTemp(Into->OnDone), OlderHandle = MoveTemp(Into->Handle),
+                    Newer = MoveTemp(Job.OnDone), NewerHandle = Job.Handle](FString Output)
+                    {
+                        if (Older) Older(OlderHandle->IsCancelled() ? FString(TEXT("{}")) : Output);
+                        if (Newer) Newer(NewerHandle->IsCancelled() ? FString(TEXT("{}")) : MoveTemp(Output));
+                    };
+                Into->Handle = Merged;
+                Into->Prompt = MoveTemp(Job.Prompt);
+                Into->Intent = MoveTemp(Job.Intent);
+                Into->Priority = FMath::Max(Into->Priority, Job.Priority);
+                Into->Deadline = (Into->Deadline > 0.0 && Job.Deadline > 0.0) ? FMath::Max(Into->Deadline, Job.Deadline) : 0.0;
+                Into->CacheKey = Job.CacheKey;
+                Into->CacheTtl = Job.CacheTtl;
+                Into->SemanticGroup = Job.SemanticGroup;        // the group follows the newer intent
+                Into->bSemanticLookup = Into->bSemanticLookup && Job.bSemanticLookup;   // bForceFresh from either caller wins
+                bMerged = true;
+            }
+            else
+            {
+                Dropped.Add(MoveTemp(Job));
+            }
+        }
+    }
+
+    if (bMerged)
+    {
+        Owner->ForgetInFlight(Job);
+        --Slot->Load; // counted by Dispatch, but no new job exists
+        UE_LOG(LogGameAI, Display, TEXT("Director queue full (ctx %d): merged into a queued job"), Slot->Index);
+    }
+    for (FJob& Lost : Dropped)
+    {
+        UE_LOG(LogGameAI, Warning, TEXT("Director queue full (ctx %d): %s a priority %d job"),
+            Slot->Index, Policy == 0 ? TEXT("dropped") : TEXT("rejected"), Lost.Priority);
+        Owner->CompleteJob(*Slot, Lost, TEXT("{}"));
+    }
     if (WakeEvent) WakeEvent->Trigger();
 }
 
+bool LLamaRunnerAsync::FWorker::PopNextJob(FJob& OutJob)
+{
+    FScopeLock Lock(&QueueMutex);
+    if (Queue.Num() == 0) return false;
+
+    // A conversation takes one turn at a time: the next one waits until the current one has finished
+    auto IsEligible = [this](const FJob& J)
+        {
+            const FConversation* Conv = J.Conversation.IsEmpty() ? nullptr : Slot->Conversations.Find(J.Conversation);
+            return !Conv || !Conv->bBusy;
+        };
+
+    // No deadline sorts after any deadline
+    auto DeadlineKey = [](const FJob& J) { return J.Deadline > 0.0 ? J.Deadline : DBL_MAX; };
+    int32 Best = INDEX_NONE;
+    for (int32 i = 0; i < Queue.Num(); ++i)
+    {
+        if (!IsEligible(Queue[i])) continue;
+        if (Best == INDEX_NONE) { Best = i; continue; }
+        const FJob& A = Queue[i];
+        const FJob& B = Queue[Best];
+        if (A.Priority != B.Priority) { if (A.Priority > B.Priority) Best = i; continue; }
+        if (DeadlineKey(A) != DeadlineKey(B)) { if (DeadlineKey(A) < DeadlineKey(B)) Best = i; continue; }
+        if (A.Serial < B.Serial) Best = i;
+    }
+    if (Best == INDEX_NONE) return false;
+
+    // One adapter per context: a job for another persona waits for the context to drain, but jobs for the current one
+    // that are as urgent as it may still join in the meantime
+    const int32 Persona = Slot->ActivePersona.Load();
+    if (Slot->HasActiveSequences() && Queue[Best].Persona != Persona)
+    {
+        int32 Same = INDEX_NONE;
+        for (int32 i = 0; i < Queue.Num(); ++i)
+        {
+            if (Queue[i].Persona != Persona || Queue[i].Priority < Queue[Best].Priority || !IsEligible(Queue[i])) continue;
+            if (Same == INDEX_NONE || Queue[i].Serial < Queue[Same].Serial) Same = i;
+        }
+        if (Same == INDEX_NONE) return false;
+        Best = Same;
+    }
+    OutJob = MoveTemp(Queue[Best]);
+    Queue.RemoveAt(Best);
+    return true;
+}
+
 void LLamaRunnerAsync::FWorker::Shutdown()
 {
     if (!bStop) Stop();
 }
 
+TArray<LLamaRunnerAsync::FJob> LLamaRunnerAsync::FWorker::TakeQueue()
+{
+    FScopeLock Lock(&QueueMutex);
+    TArray<FJob> Jobs = MoveTemp(Queue);
+    Queue.Reset();
+    return Jobs;
+}
+
 // ---------- Runner thread mgmt ----------
-void LLamaRunnerAsync::StartWorkerIfNeeded()
+void LLamaRunnerAsync::StartWorkers()
 {
-    if (!Worker)
-        Worker = MakeUnique<FWorker>(this);
-    if (!WorkerThread)
-        WorkerThread.Reset(FRunnableThread::Create(Worker.Get(), TEXT("LlamaRunnerWorker"), 0, TPri_BelowNormal));
+    for (TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        if (!Slot->Worker)
+            Slot->Worker = MakeUnique<FWorker>(this, Slot.Get());
+        if (!Slot->WorkerThread)
+            Slot->WorkerThread.Reset(FRunnableThread::Create(Slot->Worker.Get(),
+                *FString::Printf(TEXT("LlamaRunnerWorker%d"), Slot->Index), 0, TPri_BelowNormal));
+    }
+}
+
+bool LLamaRunnerAsync::IsWorkerThread() const
+{
+    const uint32 ThisThread = FPlatformTLS::GetCurrentThreadId();
+    for (const TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        if (Slot->WorkerThread && Slot->WorkerThread->GetThreadID() == ThisThread) return true;
+    }
+    return false;
+}
+
+void LLamaRunnerAsync::Dispatch(FJob&& Job)
+{
+    // A conversation stays on the context that holds its sequence. Otherwise the least-loaded context wins; ties go to
+    // one already running the job's persona, then to the lowest index so a pool of 1 behaves exactly as before
+    FContextSlot* Best = nullptr;
+    {
+        FScopeLock Lock(&ConversationMutex);
+        const int32* Home = Job.Conversation.IsEmpty() ? nullptr : ConversationSlots.Find(Job.Conversation);
+        if (Home && Slots.IsValidIndex(*Home))
+        {
+            Best = Slots[*Home].Get();
+        }
+        else
+        {
+            for (TUniquePtr<FContextSlot>& Slot : Slots)
+            {
+                if (!Best || Slot->Load.Load() < Best->Load.Load()
+                    || (Slot->Load.Load() == Best->Load.Load() && Slot->ActivePersona.Load() == Job.Persona && Best->ActivePersona.Load() != Job.Persona))
+                {
+                    Best = Slot.Get();
+                }
+            }
+            if (!Job.Conversation.IsEmpty()) ConversationSlots.Add(Job.Conversation, Best->Index);
+        }
+    }
+    ++Best->Load;
+    Best->Worker->Enqueue(MoveTemp(Job));
+}
+
+// ---------- LoRA personas ----------
+void LLamaRunnerAsync::LoadPersonas()
+{
+    Personas.Reset();
+    TArray<FString> Entries;
+    CVarPersonas.GetValueOnAnyThread().ParseIntoArray(Entries, TEXT(","));
+    for (const FString& Entry : Entries)
+    {
+        FString Name, Spec, PathPart, ScalePart;
+        if (!Entry.Split(TEXT("="), &Name, &Spec))
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("GameDirector.Personas: expected name=path, got \"%s\""), *Entry);
+            continue;
+        }
+        FPersona Persona;
+        Persona.Name = Name.TrimStartAndEnd();
+        if (Spec.Split(TEXT("@"), &PathPart, &ScalePart, ESearchCase::IgnoreCase, ESearchDir::FromEnd) && ScalePart.TrimStartAndEnd().IsNumeric())
+        {
+            Spec = PathPart;
+            Persona.Scale = FCString::Atof(*ScalePart);
+        }
+        Spec.TrimStartAndEndInline();
+        const FString Path = FPaths::IsRelative(Spec) ? FPaths::ProjectDir() / Spec : Spec;
+
+        Persona.Adapter = llama_adapter_lora_init(Model, TCHAR_TO_UTF8(*Path));
+        if (!Persona.Adapter)
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("LoRA persona %s not loaded from %s, its requests use the base model"), *Persona.Name, *Path);
+            continue;
+        }
+        Persona.Crc = FCrc::StrCrc32(*FString::Printf(TEXT("%s|%s|%g"), *Persona.Name, *FPaths::GetCleanFilename(Path), Persona.Scale));
+        UE_LOG(LogGameAI, Display, TEXT("LoRA persona %s: %s (scale %.2f)"), *Persona.Name, *Path, Persona.Scale);
+        Personas.Add(MoveTemp(Persona));
+    }
+}
+
+int32 LLamaRunnerAsync::FindPersona(const FString& Name) const
+{
+    if (Name.IsEmpty()) return INDEX_NONE;
+    const int32 Index = Personas.IndexOfByPredicate([&Name](const FPersona& P) { return P.Name.Equals(Name, ESearchCase::IgnoreCase); });
+    if (Index == INDEX_NONE) UE_LOG(LogGameAI, Warning, TEXT("Unknown persona %s, using the base model"), *Name);
+    return Index;
+}
+
+void LLamaRunnerAsync::ApplyPersona(FContextSlot& Slot, int32 Persona)
+{
+    if (Slot.ActivePersona.Load() == Persona) return;
+
+    FScopeLock Lock(&Slot.DecodeMutex);
+    llama_clear_adapter_lora(Slot.Ctx);
+    if (Persona != INDEX_NONE && llama_set_adapter_lora(Slot.Ctx, Personas[Persona].Adapter, Personas[Persona].Scale) != 0)
+    {
+        UE_LOG(LogGameAI, Warning, TEXT("Context %d: could not apply persona %s, using the base model"), Slot.Index, *Personas[Persona].Name);
+        Persona = INDEX_NONE;
+    }
+    Slot.ActivePersona = Persona;
+
+    // conversation KV was computed under the old adapter; the pins stay, their next turn prefills again
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (Seq.Conversation.IsEmpty()) continue;
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, -1, -1);
+        if (FConversation* Conv = Slot.Conversations.Find(Seq.Conversation)) Conv->Tokens.clear();
+    }
+    UE_LOG(LogGameAI, Display, TEXT("Context %d persona: %s"), Slot.Index, Persona != INDEX_NONE ? *Personas[Persona].Name : TEXT("base"));
 }
 
 // ---------- Init / Shutdown ----------
-bool LLamaRunnerAsync::Initiate(const FString& ModelPath, int32 ContextSize)
+bool LLamaRunnerAsync::Initiate(const FString& ModelPath, int32 ContextSize, int32 MaxSequences, int32 PoolSize, int32 ThreadsPerContext)
+{
+    Shutdown(); // in case re-init
+    return Load(ModelPath, ContextSize, MaxSequences, PoolSize, ThreadsPerContext);
+}
+
+// ---------- Background loading ----------
+void LLamaRunnerAsync::InitiateAsync(const FString& ModelPath, int32 ContextSize, int32 MaxSequences, int32 PoolSize, int32 ThreadsPerContext,
+    TFunction<void(float)> OnProgress, TFunction<void(bool)> OnLoaded)
 {
+    check(IsInGameThread());
     Shutdown(); // in case re-init
 
+    LoadCancelled = MakeShared<FThreadSafeBool, ESPMode::ThreadSafe>(false);
+    LoadProgressFn = MoveTemp(OnProgress);
+    LoadPermille = 0;
+    MaxPendingRequests = CVarMaxQueuedJobs.GetValueOnGameThread() * FMath::Clamp(PoolSize, 1, 16);
+    bLoading = true;
+
+    TSharedPtr<FThreadSafeBool, ESPMode::ThreadSafe> Cancelled = LoadCancelled;
+    LoadFuture = Async(EAsyncExecution::Thread,
+        [this, ModelPath, ContextSize, MaxSequences, PoolSize, ThreadsPerContext, Cancelled, OnLoaded = MoveTemp(OnLoaded)]() mutable
+        {
+            const bool bLoaded = Load(ModelPath, ContextSize, MaxSequences, PoolSize, ThreadsPerContext);
+            AsyncTask(ENamedThreads::GameThread, [this, bLoaded, Cancelled, OnLoaded = MoveTemp(OnLoaded)]()
+                {
+                    if (*Cancelled) return;     // Shutdown already failed the held requests
+                    FinishLoad(bLoaded);
+                    if (OnLoaded) OnLoaded(bLoaded);
+                });
+            return bLoaded;
+        });
+}
+
+bool LLamaRunnerAsync::LoadProgressCallback(float Progress, void* RunnerPtr)
+{
+    LLamaRunnerAsync* Self = static_cast<LLamaRunnerAsync*>(RunnerPtr);
+
+    // the weights are most of the wait; the last 5% is context setup. Post at most once per percent.
+    const int32 Permille = FMath::Clamp((int32)(Progress * 950.f), 0, 950);
+    if (Permille / 10 != Self->LoadPermille.Exchange(Permille) / 10 && Self->LoadProgressFn && Self->LoadCancelled)
+    {
+        AsyncTask(ENamedThreads::GameThread, [Fn = Self->LoadProgressFn, Cancelled = Self->LoadCancelled, Permille]()
+            {
+                if (!*Cancelled) Fn(Permille / 1000.f);
+            });
+    }
+    return !Self->bAbortLoad;   // false stops llama_model_load_from_file
+}
+
+void LLamaRunnerAsync::FinishLoad(bool bLoaded)
+{
+    TArray<FPendingRequest> Pending;
+    {
+        FScopeLock Lock(&PendingMutex);
+        bLoading = false;
+        Swap(Pending, PendingRequests);
+    }
+    if (bLoaded) LoadPermille = 1000;
+    UE_LOG(LogGameAI, Display, TEXT("Model %s, %d requests were waiting for it"), bLoaded ? TEXT("ready") : TEXT("failed to load"), Pending.Num());
+
+    const double Now = FPlatformTime::Seconds();
+    for (FPendingRequest& Request : Pending)
+    {
+        // cancelled or past its deadline while waiting: same outcome as being skipped in a worker queue
+        const double Waited = Now - Request.QueuedAt;
+        const bool bExpired = Request.Options.DeadlineSeconds > 0.0 && Waited >= Request.Options.DeadlineSeconds;
+        if (!bLoaded || bExpired || Request.Handle->IsCancelled())
+        {
+            AsyncTask(ENamedThreads::GameThread, [OnDone = MoveTemp(Request.OnDone)]() {
+                if (OnDone) OnDone(TEXT("{}"));
+                });
+            continue;
+        }
+        if (Request.Options.DeadlineSeconds > 0.0) Request.Options.DeadlineSeconds -= Waited;
+        SubmitRequest(Request.Prompt, MoveTemp(Request.OnDone), Request.Intent, MoveTemp(Request.Stream), Request.Options, Request.Handle);
+    }
+}
+
+bool LLamaRunnerAsync::Load(const FString& ModelPath, int32 ContextSize, int32 MaxSequences, int32 PoolSize, int32 ThreadsPerContext)
+{
     llama_log_set(LlamaLog, nullptr);
     PushThirdPartyDllDir();
 
@@ -483,28 +1170,28 @@ bool LLamaRunnerAsync::Initiate(const FString& ModelPath, int32 ContextSize)
     llama_model_params mparams = llama_model_default_params();
     mparams.n_gpu_layers = -1;; // CPU-only for now
     mparams.main_gpu = 0;
+    mparams.progress_callback = &LLamaRunnerAsync::LoadProgressCallback;
+    mparams.progress_callback_user_data = this;
+
+    // --- Cold start: page cache and huge pages ---
+    bFirstRequestDone = false;
+    if (CVarWarmup.GetValueOnAnyThread() >= 2) PrefetchModelFile(ModelPath, bAbortLoad);
+#if PLATFORM_LINUX
+    if (CVarHugePages.GetValueOnAnyThread() != 0)
+    {
+        FString ThpMode;
+        FFileHelper::LoadFileToString(ThpMode, TEXT("/sys/kernel/mm/transparent_hugepage/enabled"));
+        UE_LOG(LogGameAI, Display, TEXT("Huge pages: reading weights into anonymous memory (THP: %s)"), *ThpMode.TrimStartAndEnd());
+        mparams.use_mmap = false;
+    }
+#endif
 
     // --- Load model ---
     FTCHARToUTF8 PathUtf8(*ModelPath);
     Model = llama_model_load_from_file(PathUtf8.Get(), mparams);
     if (!Model)
     {
-        UE_LOG(LogTemp, Error, TEXT("Failed to load model: %s"), *ModelPath);
-        llama_backend_free();
-        return false;
-    }
-
-    // --- Context params ---
-   cparams = llama_context_default_params();
-    cparams.n_ctx = FMath::Max(256, ContextSize);
-    cparams.n_threads = FPlatformMisc::NumberOfCores();
-
-    // --- Create context from model ---
-    Ctx = llama_init_from_model(Model, cparams);
-    if (!Ctx)
-    {
-        UE_LOG(LogTemp, Error, TEXT("Failed to create context"));
-        llama_model_free(Model); Model = nullptr;
+        UE_LOG(LogTemp, Error, TEXT("Failed to load model: %s%s"), *ModelPath, bAbortLoad ? TEXT(" (aborted)") : TEXT(""));
         llama_backend_free();
         return false;
     }
@@ -514,7 +1201,6 @@ bool LLamaRunnerAsync::Initiate(const FString& ModelPath, int32 ContextSize)
     if (!Vocab)
     {
         UE_LOG(LogTemp, Error, TEXT("Failed to get vocab"));
-        llama_free(Ctx);           Ctx = nullptr;
         llama_model_free(Model);   Model = nullptr;
         llama_backend_free();
         return false;
@@ -524,393 +1210,1907 @@ bool LLamaRunnerAsync::Initiate(const FString& ModelPath, int32 ContextSize)
     if (n_vocab <= 0)
     {
         UE_LOG(LogTemp, Error, TEXT("Bad tokenizer/vocab"));
-        llama_free(Ctx);           Ctx = nullptr;
         llama_model_free(Model);   Model = nullptr;
         llama_backend_free();
         return false;
     }
 
-    bInitialized = true;
-    StartWorkerIfNeeded();
-    return true;
-}
-void LLamaRunnerAsync::Shutdown()
-{
-    // stop worker first
-    if (Worker) Worker->Shutdown();
-    if (WorkerThread)
+    // --- Optional draft model for speculative decoding ---
+    const FString DraftSetting = CVarDraftModel.GetValueOnAnyThread();
+    if (!DraftSetting.IsEmpty())
     {
-        WorkerThread->Kill(true);
-        WorkerThread.Reset();
+        const FString DraftPath = FPaths::IsRelative(DraftSetting) ? FPaths::ProjectDir() / DraftSetting : DraftSetting;
+        mparams.progress_callback = nullptr;   // progress only tracks the main weights
+        DraftModel = llama_model_load_from_file(TCHAR_TO_UTF8(*DraftPath), mparams);
+        const llama_vocab* DraftVocab = DraftModel ? llama_model_get_vocab(DraftModel) : nullptr;
+
+        // Verification compares token ids, so both models must tokenize identically; spot-check the vocab
+        bool bCompatible = DraftVocab && llama_vocab_n_tokens(DraftVocab) == n_vocab;
+        for (int32 i = 0; bCompatible && i < 64; ++i)
+        {
+            const llama_token Id = (llama_token)((int64)i * (n_vocab - 1) / 63);
+            bCompatible = FCStringAnsi::Strcmp(llama_vocab_get_text(Vocab, Id), llama_vocab_get_text(DraftVocab, Id)) == 0;
+        }
+        if (!bCompatible)
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Draft model %s not loaded or its vocab differs from the main model, speculative decoding off"), *DraftPath);
+            if (DraftModel) { llama_model_free(DraftModel); DraftModel = nullptr; }
+        }
+        else
+        {
+            UE_LOG(LogGameAI, Display, TEXT("Draft model loaded for speculative decoding: %s"), *DraftPath);
+        }
     }
-    Worker.Reset();
-
-    if (Ctx) { llama_free(Ctx);   Ctx = nullptr; }
-    if (Model) { llama_free_model(Model); Model = nullptr; }
-    Vocab = nullptr;
 
-    if (bInitialized)
+    // --- Identity of the weights for the decision cache ---
+    ModelKey = FDirectorTuning::ModelKey(Model);
+    if (CVarDecisionCacheSize.GetValueOnAnyThread() > 0)
     {
-        llama_backend_free();
-        bInitialized = false;
+        DecisionCache.SetMaxEntries(CVarDecisionCacheSize.GetValueOnAnyThread());
+        DecisionCache.Load(FDirectorDecisionCache::DefaultPath());
     }
-}
 
-// ---------- Async enqueue ----------
-void LLamaRunnerAsync::GenerateJSONAsync(const FString& Prompt, TFunction<void(FString)> OnDone,FString Intent)
-{
-    if (!IsInitialized() || !Worker)
+    // --- LoRA personas: one copy of each adapter, shared by the pool ---
+    LoadPersonas();
+
+    // --- Director grammar: parsed once, cloned per sequence ---
+    DirectorGrammar = llama_sampler_init_grammar(Vocab, kDirectorGrammar, "root");
+    if (!DirectorGrammar)
     {
-        AsyncTask(ENamedThreads::GameThread, [OnDone = MoveTemp(OnDone)]() mutable {
-            if (OnDone) OnDone(TEXT("{}"));
-            });
-        return;
+        UE_LOG(LogGameAI, Error, TEXT("Director grammar failed to compile, decoding will be unconstrained"));
     }
 
-    FJob Job;
-    Job.Prompt = Prompt;
-    Job.OnDone = MoveTemp(OnDone);
-    Job.Intent = Intent;
-    Worker->Enqueue(MoveTemp(Job));
-}
-void  LLamaRunnerAsync::ResetContext() {
-    FScopeLock _(&DecodeMutex);
-    if (Ctx) { llama_free(Ctx); Ctx = nullptr; }
-    // Recreate with the same params/model you used in Initiate()
-    Ctx = llama_new_context_with_model(Model, cparams);
-}
-
-// ---------- Synchronous GenerateJSON (PUT YOUR EXISTING BODY HERE) ----------
-FString LLamaRunnerAsync::GenerateJSON(const FString& Prompt, int max_new, int top_k, float top_p, float temp,FString Intent)
-{
-
-    // Add near the top of GenerateJSON, after you include Json headers and have IsValidDirectorJSON available.
-
-    enum class EJsonProbe { None, ClosedValid, ClosedInvalid };
-
-    // Returns:
-    //  - ClosedValid    -> first balanced object is valid per IsValidDirectorJSON
-    //  - ClosedInvalid  -> a balanced object exists but fails schema; keep generating
-    //  - None           -> no balanced top-level object yet
-    auto CheckJsonClosure = [&](const std::string& s) -> EJsonProbe
+    // --- Context params (shared by every context in the pool) ---
+    const int32 NumCtx = FMath::Clamp(PoolSize, 1, 16);
+    const int32 NumSeq = FMath::Clamp(MaxSequences, 1, 64);
+    const int32 NumThreads = ThreadsPerContext > 0 ? ThreadsPerContext
+        : FMath::Max(1, FPlatformMisc::NumberOfCores() / NumCtx);   // fallback when there is no tuned profile
+   cparams = llama_context_default_params();
+    cparams.n_ctx = FMath::Max(256, ContextSize) * NumSeq; // every sequence keeps a full ContextSize window
+    cparams.n_seq_max = NumSeq;
+    cparams.n_threads = NumThreads;
+    cparams.n_threads_batch = NumThreads;
+    // n_batch has to hold a full step batch (every sequence with its draft or forced rows)
+    if (CVarBatchSize.GetValueOnAnyThread() > 0) cparams.n_batch = (uint32_t)CVarBatchSize.GetValueOnAnyThread();
+    cparams.n_batch = FMath::Max<uint32_t>(cparams.n_batch, (uint32_t)(NumSeq * (FMath::Max(MaxDraftTokens, MaxForcedTokens) + 1)));
+    if (CVarUBatchSize.GetValueOnAnyThread() > 0) cparams.n_ubatch = (uint32_t)CVarUBatchSize.GetValueOnAnyThread();
+
+    // --- Tuned thread counts / n_ubatch for this machine + model; explicit ThreadsPerContext / UBatchSize win ---
+    FDirectorTuneProfile Tuned;
+    if (FDirectorTuning::Resolve(Model, cparams, NumCtx, Tuned))
+    {
+        if (ThreadsPerContext <= 0)
         {
-            int depth = 0;
-            bool in_q = false, escp = false, seen_open = false;
-            int start = -1;
+            cparams.n_threads = Tuned.NumThreads;
+            cparams.n_threads_batch = Tuned.NumThreadsBatch;
+        }
+        if (CVarUBatchSize.GetValueOnAnyThread() <= 0) cparams.n_ubatch = (uint32_t)Tuned.UBatch;
+    }
+    cparams.n_ubatch = FMath::Min(cparams.n_ubatch, cparams.n_batch);
 
-            for (size_t i = 0; i < s.size(); ++i)
+    // --- Create the context pool; the weights stay loaded once in Model ---
+    for (int32 i = 0; i < NumCtx; ++i)
+    {
+        TUniquePtr<FContextSlot> Slot = CreateSlot(i, NumCtx, NumSeq, n_vocab);
+        if (!Slot)
+        {
+            UE_LOG(LogTemp, Error, TEXT("Failed to create context %d of %d"), i + 1, NumCtx);
+            for (TUniquePtr<FContextSlot>& Created : Slots) FreeSlot(*Created);
+            Slots.Reset();
+            if (DirectorGrammar) { llama_sampler_free(DirectorGrammar); DirectorGrammar = nullptr; }
+            if (DraftModel) { llama_model_free(DraftModel); DraftModel = nullptr; }
+            llama_model_free(Model); Model = nullptr;
+            Personas.Reset();   // adapters go with the model
+            Vocab = nullptr;
+            llama_backend_free();
+            return false;
+        }
+        Slots.Add(MoveTemp(Slot));
+    }
+    UE_LOG(LogGameAI, Display, TEXT("Context pool: %d x (%d seqs, n_ctx %d, n_batch %d, n_ubatch %d, %d/%d threads)"),
+        NumCtx, NumSeq, (int32)cparams.n_ctx, (int32)cparams.n_batch, (int32)cparams.n_ubatch, (int32)cparams.n_threads, (int32)cparams.n_threads_batch);
+
+    // --- Semantic cache: a one-sequence embedding context on the same weights ---
+    if (CVarSemanticCache.GetValueOnAnyThread() != 0 && CVarDecisionCacheSize.GetValueOnAnyThread() > 0)
+    {
+        llama_context_params eparams = cparams;
+        eparams.n_ctx = eparams.n_batch = eparams.n_ubatch = 512;
+        eparams.n_seq_max = 1;
+        eparams.embeddings = true;
+        eparams.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        EmbedCtx = llama_init_from_model(Model, eparams);
+        if (EmbedCtx)
+        {
+            SemanticIndex.Reset(llama_model_n_embd(Model), CVarDecisionCacheSize.GetValueOnAnyThread());
+            UE_LOG(LogGameAI, Display, TEXT("Semantic cache on: %d-dim prompt embeddings, threshold %.2f"),
+                llama_model_n_embd(Model), CVarSemanticThreshold.GetValueOnAnyThread());
+        }
+        else
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Embedding context failed to create, semantic cache off"));
+        }
+    }
+
+    // --- Warmup: fault in the weights and allocate compute buffers now rather than on the first request ---
+    if (CVarWarmup.GetValueOnAnyThread() >= 1)
+    {
+        const double T0 = FPlatformTime::Seconds();
+        const int32 NumTokens = FMath::Min(32, (int32)cparams.n_ubatch);
+        for (TUniquePtr<FContextSlot>& Slot : Slots)
+        {
+            WarmupContext(Slot->Ctx, n_vocab, NumTokens);
+            if (Slot->DraftCtx) WarmupContext(Slot->DraftCtx, n_vocab, NumTokens);
+        }
+        WarmupMs = (FPlatformTime::Seconds() - T0) * 1000.0;
+        UE_LOG(LogGameAI, Display, TEXT("Warmup: %.0f ms over %d contexts"), WarmupMs, Slots.Num());
+    }
+
+    bInitialized = true;
+    StartWorkers();
+    return true;
+}
+
+TUniquePtr<LLamaRunnerAsync::FContextSlot> LLamaRunnerAsync::CreateSlot(int32 Index, int32 NumSlots, int32 NumSeq, int32 n_vocab)
+{
+    TUniquePtr<FContextSlot> Slot = MakeUnique<FContextSlot>();
+    Slot->Index = Index;
+    Slot->Ctx = llama_init_from_model(Model, cparams);
+    if (!Slot->Ctx) return nullptr;
+    llama_set_abort_callback(Slot->Ctx, &LLamaRunnerAsync::AbortDecodeCallback, Slot.Get());
+
+    // own threads on this slot's share of the inference CPUs, so pooled contexts do not fight over cores
+    if (Slot->Threadpools.Create((int32)cparams.n_threads, (int32)cparams.n_threads_batch, Index, NumSlots))
+    {
+        Slot->Threadpools.Attach(Slot->Ctx);
+    }
+
+    // --- Scheduler state: one sequence slot per llama_seq_id ---
+    Slot->Sequences.SetNum(NumSeq);
+    for (int32 i = 0; i < NumSeq; ++i)
+    {
+        Slot->Sequences[i].SeqId = (llama_seq_id)i;
+        Slot->Sequences[i].Grammar = DirectorGrammar ? llama_sampler_clone(DirectorGrammar) : nullptr;
+    }
+    Slot->NumActiveSequences = 0;
+    Slot->StepBatch = llama_batch_init(NumSeq * (FMath::Max(DraftModel ? MaxDraftTokens : 0, MaxForcedTokens) + 1), /*embd*/ 0, /*n_seq_max*/ 1);
+
+    if (DraftModel)
+    {
+        Slot->DraftCtx = llama_init_from_model(DraftModel, cparams);
+        if (Slot->DraftCtx)
+        {
+            llama_set_abort_callback(Slot->DraftCtx, &LLamaRunnerAsync::AbortDecodeCallback, Slot.Get());
+            Slot->Threadpools.Attach(Slot->DraftCtx);   // same worker thread as Ctx, never computes concurrently
+            Slot->DraftBatch = llama_batch_init(NumSeq * (MaxDraftTokens + MaxForcedTokens + 2), /*embd*/ 0, /*n_seq_max*/ 1);
+        }
+        else
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Draft context %d failed to create, context %d decodes without speculation"), Index, Index);
+        }
+    }
+
+    if (DirectorGrammar)
+    {
+        Slot->GrammarCandidates.resize((size_t)n_vocab);
+        Slot->MaskedLogits.resize((size_t)n_vocab);
+    }
+    return Slot;
+}
+
+void LLamaRunnerAsync::FreeSlot(FContextSlot& Slot)
+{
+    // Shutdown has completed the in-flight sequences by now
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (Seq.Grammar) { llama_sampler_free(Seq.Grammar); Seq.Grammar = nullptr; }
+    }
+    Slot.Sequences.Reset();
+    Slot.NumActiveSequences = 0;
+    if (Slot.StepBatch.token) { llama_batch_free(Slot.StepBatch); Slot.StepBatch = {}; }
+    if (Slot.DraftBatch.token) { llama_batch_free(Slot.DraftBatch); Slot.DraftBatch = {}; }
+    if (Slot.DraftCtx) { llama_free(Slot.DraftCtx); Slot.DraftCtx = nullptr; }
+    Slot.PrefixCache.Reset(); // snapshots are only valid for the model/context they were taken from
+    if (Slot.Ctx) { llama_free(Slot.Ctx);   Slot.Ctx = nullptr; }
+    Slot.Threadpools.Free();
+}
+void LLamaRunnerAsync::Shutdown()
+{
+    // a background load goes first: llama stops reading weights at its next progress callback, held requests get "{}"
+    if (LoadFuture.IsValid())
+    {
+        if (LoadCancelled) *LoadCancelled = true;
+        bAbortLoad = true;
+        LoadFuture.Wait();
+        LoadFuture = TFuture<bool>();
+        bAbortLoad = false;
+    }
+    if (bLoading) FinishLoad(false);
+
+    // stop every worker first; a decode in progress bails out through the abort callback,
+    // so each join waits at most one ubatch
+    for (TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        Slot->bAbortDecode = true;
+        if (Slot->Worker) Slot->Worker->Shutdown();
+    }
+    for (TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        if (Slot->WorkerThread)
+        {
+            Slot->WorkerThread->Kill(true);
+            Slot->WorkerThread.Reset();
+        }
+
+        // whatever the workers left behind still answers its caller, with "{}"
+        for (FSequence& Seq : Slot->Sequences)
+        {
+            if (Seq.bActive) CancelSequence(*Slot, Seq);
+        }
+        if (Slot->Worker)
+        {
+            for (FJob& Job : Slot->Worker->TakeQueue()) CompleteJob(*Slot, Job, TEXT("{}"));
+        }
+        Slot->Worker.Reset();
+    }
+
+    for (TUniquePtr<FContextSlot>& Slot : Slots) FreeSlot(*Slot);
+    Slots.Reset();
+    {
+        FScopeLock Lock(&ConversationMutex);
+        ConversationSlots.Reset();
+    }
+
+    if (DirectorGrammar) { llama_sampler_free(DirectorGrammar); DirectorGrammar = nullptr; }
+    if (EmbedCtx) { llama_free(EmbedCtx); EmbedCtx = nullptr; }
+    SemanticIndex.Reset(0, 0);
+    if (DraftModel) { llama_model_free(DraftModel); DraftModel = nullptr; }
+    if (Model) { llama_free_model(Model); Model = nullptr; }
+    Personas.Reset();   // adapters go with the model
+
+    if (DecisionCache.IsDirty() && !DecisionCache.Save(FDirectorDecisionCache::DefaultPath()))
+    {
+        UE_LOG(LogGameAI, Warning, TEXT("Failed to save the decision cache to %s"), *FDirectorDecisionCache::DefaultPath());
+    }
+    Vocab = nullptr;
+
+    if (bInitialized)
+    {
+        llama_backend_free();
+        bInitialized = false;
+    }
+}
+
+// ---------- Async enqueue ----------
+TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> LLamaRunnerAsync::GenerateJSONAsync(const FString& Prompt, TFunction<void(FString)> OnDone,FString Intent,
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream, const FDirectorJobOptions& Options)
+{
+    TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> Handle = MakeShared<FDirectorJobHandle, ESPMode::ThreadSafe>();
+
+    // Model still loading: hold the request until FinishLoad submits it
+    {
+        FScopeLock Lock(&PendingMutex);
+        if (bLoading)
+        {
+            if (MaxPendingRequests <= 0 || PendingRequests.Num() < MaxPendingRequests)
             {
-                unsigned char ch = (unsigned char)s[i];
+                PendingRequests.Add({ Prompt, MoveTemp(OnDone), Intent, MoveTemp(Stream), Options, Handle, FPlatformTime::Seconds() });
+                return Handle;
+            }
+            UE_LOG(LogGameAI, Warning, TEXT("Model still loading and %d requests already waiting, dropping this one"), PendingRequests.Num());
+            AsyncTask(ENamedThreads::GameThread, [OnDone = MoveTemp(OnDone)]() mutable {
+                if (OnDone) OnDone(TEXT("{}"));
+                });
+            return Handle;
+        }
+    }
 
-                if (escp) { escp = false; continue; }
-                if (ch == '\\') { escp = true; continue; }
-                if (ch == '"') { in_q = !in_q; continue; }
-                if (in_q) continue;
+    SubmitRequest(Prompt, MoveTemp(OnDone), Intent, MoveTemp(Stream), Options, Handle);
+    return Handle;
+}
 
-                if (ch == '{')
-                {
-                    if (depth == 0) { start = (int)i; seen_open = true; }
-                    ++depth;
-                }
-                else if (ch == '}')
-                {
-                    if (depth > 0) --depth;
+void LLamaRunnerAsync::SubmitRequest(const FString& Prompt, TFunction<void(FString)> OnDone, const FString& Intent,
+    TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream, const FDirectorJobOptions& Options,
+    const TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>& Handle)
+{
+    if (!IsInitialized() || Slots.Num() == 0)
+    {
+        AsyncTask(ENamedThreads::GameThread, [OnDone = MoveTemp(OnDone)]() mutable {
+            if (OnDone) OnDone(TEXT("{}"));
+            });
+        return;
+    }
+
+    FJob Job;
+    Job.Prompt = Prompt;
+    Job.OnDone = MoveTemp(OnDone);
+    Job.Intent = Intent;
+    Job.AssistantPrefix = Options.AssistantPrefix;
+    Job.Persona = FindPersona(Options.Persona);
+    Job.Conversation = Options.Conversation;
+    Job.Stream = MoveTemp(Stream);
+    Job.Handle = Handle;
+    Job.Priority = Options.Priority;
+    Job.Deadline = Options.DeadlineSeconds > 0.0 ? FPlatformTime::Seconds() + Options.DeadlineSeconds : 0.0;
+    Job.MergeKey = Options.MergeKey;
+    if (Options.bGreedy)
+    {
+        Job.TopK = 1;
+        Job.Temp = 0.0f;
+    }
+
+    // Validated decision already cached: answer without a worker
+    const double CacheTtl = Options.CacheTtlSeconds >= 0.0 ? Options.CacheTtlSeconds : (double)CVarDecisionCacheTTL.GetValueOnAnyThread();
+    // a conversation turn depends on its history, so it is neither cached nor coalesced
+    if (CVarDecisionCacheSize.GetValueOnAnyThread() > 0 && CacheTtl > 0.0 && Job.Conversation.IsEmpty())
+    {
+        // a persona answers differently, so it counts as other weights
+        const uint64 WeightsKey = Job.Persona != INDEX_NONE ? ModelKey ^ ((uint64)Personas[Job.Persona].Crc * 0x9E3779B97F4A7C15ull) : ModelKey;
+        Job.CacheKey = FDirectorDecisionCache::MakeKey(WeightsKey, Job.Prompt, Job.Intent, Job.AssistantPrefix, Job.MaxNew, Job.TopK, Job.TopP, Job.Temp);
+        Job.CacheTtl = CacheTtl;
+        if (EmbedCtx)
+        {
+            // the embedding pass runs on the worker, so a semantic hit still goes through Dispatch
+            Job.SemanticGroup = FDirectorDecisionCache::MakeKey(WeightsKey, FString(), Job.Intent, Job.AssistantPrefix, Job.MaxNew, Job.TopK, Job.TopP, Job.Temp);
+            Job.bSemanticLookup = !Options.bForceFresh;
+        }
+
+        FString Cached;
+        if (!Options.bForceFresh && DecisionCache.Find(Job.CacheKey, Cached))
+        {
+            UE_LOG(LogGameAI, Display, TEXT("Decision cache hit (%lld hits / %lld misses)"), DecisionCache.GetHits(), DecisionCache.GetMisses());
+            if (Job.Stream) StreamCachedDecision(*Job.Stream, Cached);
+            AsyncTask(ENamedThreads::GameThread, [OnDone = MoveTemp(Job.OnDone), Cached = MoveTemp(Cached)]() mutable {
+                if (OnDone) OnDone(Cached);
+                });
+            return;
+        }
+    }
+
+    if (!Job.Stream && Job.Conversation.IsEmpty() && CVarCoalesceRequests.GetValueOnAnyThread() != 0 && CoalesceOrRegister(Job, Handle))
+    {
+        return;
+    }
+    Dispatch(MoveTemp(Job));
+}
+
+bool LLamaRunnerAsync::CoalesceOrRegister(FJob& Job, const TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>& CallerHandle)
+{
+    // Everything that decides the output: prompt, intent, assistant prefix, persona and sampling
+    const int32 Sampling[4] = { Job.MaxNew, Job.TopK, (int32)(Job.Temp * 1000.0f), Job.Persona };
+    uint32 Key = FCrc::StrCrc32(*Job.Prompt);
+    Key = FCrc::StrCrc32(*Job.Intent, Key);
+    Key = FCrc::StrCrc32(*Job.AssistantPrefix, Key);
+    Key = FCrc::MemCrc32(Sampling, sizeof(Sampling), Key);
+    Key = FCrc::MemCrc32(&Job.TopP, sizeof(Job.TopP), Key);
+
+    FScopeLock Lock(&InFlightMutex);
+    if (TSharedRef<FInFlightRequest, ESPMode::ThreadSafe>* Found = InFlight.Find(Key))
+    {
+        FInFlightRequest& Running = **Found;
+        // A CRC collision, or a job every caller already cancelled, runs separately
+        if (Running.Prompt != Job.Prompt || Running.Intent != Job.Intent || Running.AssistantPrefix != Job.AssistantPrefix
+            || Running.Persona != Job.Persona || !Running.JobHandle->TryAddCaller())
+        {
+            return false;
+        }
+        CallerHandle->Shared = Running.JobHandle;
+        Running.Callers.Add({ MoveTemp(Job.OnDone), CallerHandle });
+        ++CoalescedRequests;
+        UE_LOG(LogGameAI, Display, TEXT("Request coalesced into an identical in-flight job (%d callers, %lld coalesced total)"),
+            Running.Callers.Num(), CoalescedRequests.Load());
+        return true;
+    }
+
+    // First of its kind: the job runs on a shared handle, and its completion fans out to every caller attached by then
+    TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> JobHandle = MakeShared<FDirectorJobHandle, ESPMode::ThreadSafe>();
+    JobHandle->NumCallers = 1;
+    CallerHandle->Shared = JobHandle;
+
+    TSharedRef<FInFlightRequest, ESPMode::ThreadSafe> Request = MakeShared<FInFlightRequest, ESPMode::ThreadSafe>();
+    Request->Key = Key;
+    Request->Prompt = Job.Prompt;
+    Request->Intent = Job.Intent;
+    Request->AssistantPrefix = Job.AssistantPrefix;
+    Request->Persona = Job.Persona;
+    Request->JobHandle = JobHandle;
+    Request->Callers.Add({ MoveTemp(Job.OnDone), CallerHandle });
+    InFlight.Add(Key, Request);
+
+    Job.Handle = JobHandle;
+    Job.Coalesced = Request;
+    Job.OnDone = [Request](FString Output)
+        {
+            for (FCoalescedCaller& Caller : Request->Callers)
+            {
+                if (Caller.OnDone) Caller.OnDone(Caller.Handle->IsCancelled() ? FString(TEXT("{}")) : Output);
+            }
+        };
+    return false;
+}
+
+void LLamaRunnerAsync::ForgetInFlight(const FJob& Job)
+{
+    if (!Job.Coalesced) return;
+    FScopeLock Lock(&InFlightMutex);
+    const TSharedRef<FInFlightRequest, ESPMode::ThreadSafe>* Found = InFlight.Find(Job.Coalesced->Key);
+    if (Found && &Found->Get() == Job.Coalesced.Get()) InFlight.Remove(Job.Coalesced->Key);
+}
+void  LLamaRunnerAsync::ResetContext() {
+    for (TUniquePtr<FContextSlot>& Slot : Slots) ResetSlotContext(*Slot);
+}
+
+void LLamaRunnerAsync::ResetSlotContext(FContextSlot& Slot)
+{
+    FScopeLock _(&Slot.DecodeMutex);
+    if (!Model) return;
+
+    const double StartTime = FPlatformTime::Seconds();
+    const bool bRecreate = !Slot.Ctx || CVarRecreateContextPerRequest.GetValueOnAnyThread() != 0;
+    if (bRecreate)
+    {
+        if (Slot.Ctx) { llama_free(Slot.Ctx); Slot.Ctx = nullptr; }
+        // Recreate with the same params/model you used in Initiate()
+        Slot.Ctx = llama_init_from_model(Model, cparams);
+        if (Slot.Ctx) llama_set_abort_callback(Slot.Ctx, &LLamaRunnerAsync::AbortDecodeCallback, &Slot);
+        Slot.Threadpools.Attach(Slot.Ctx);
+        Slot.ActivePersona = INDEX_NONE;    // a new context starts without adapters
+    }
+    else
+    {
+        // Context lives as long as the model; only the KV metadata is dropped, buffers stay allocated
+        llama_memory_clear(llama_get_memory(Slot.Ctx), /*data*/ false);
+    }
+    if (Slot.DraftCtx) llama_memory_clear(llama_get_memory(Slot.DraftCtx), /*data*/ false);
+
+    const double ResetMs = (FPlatformTime::Seconds() - StartTime) * 1000.0;
+    Slot.ResetMsTotal += ResetMs;
+    ++Slot.ResetCount;
+    UE_LOG(LogGameAI, Display, TEXT("Context %d reset (%s): %.3f ms (avg %.3f ms over %lld)"),
+        Slot.Index, bRecreate ? TEXT("recreate") : TEXT("in place"), ResetMs, Slot.ResetMsTotal / Slot.ResetCount, Slot.ResetCount);
+}
+
+LLamaRunnerAsync::FDecodeStats LLamaRunnerAsync::GetDecodeStats() const
+{
+    FDecodeStats Stats;
+    Stats.TokensGenerated = TokensGenerated.Load();
+    Stats.DecodeSeconds = DecodeMicros.Load() / 1e6;
+    Stats.DraftedTokens = DraftedTokens.Load();
+    Stats.AcceptedTokens = AcceptedTokens.Load();
+    Stats.SpeculativeSteps = SpeculativeSteps.Load();
+    Stats.ForcedTokens = ForcedTokens.Load();
+    Stats.WarmupMs = WarmupMs;
+    Stats.FirstRequestMs = FirstRequestMicros.Load() / 1000.0;
+    Stats.SteadyRequests = SteadyRequests.Load();
+    Stats.SteadyRequestMs = Stats.SteadyRequests > 0 ? SteadyRequestMicros.Load() / 1000.0 / Stats.SteadyRequests : 0.0;
+    return Stats;
+}
+
+LLamaRunnerAsync::FPrefixCacheStats LLamaRunnerAsync::GetPrefixCacheStats() const
+{
+    FPrefixCacheStats Stats;
+    Stats.Hits = PrefixHits.Load();
+    Stats.Misses = PrefixMisses.Load();
+    Stats.PrefillTokensSaved = PrefixTokensSaved.Load();
+    Stats.ConversationTokensReused = ConversationTokensReused.Load();
+    return Stats;
+}
+
+// ---------- Session persistence ----------
+static constexpr uint32 SessionMagic = 0x53534447;     // "GDSS"
+static constexpr int32  SessionVersion = 2;         // 2: conversations after the prefix snapshots
+
+static void WriteUtf8(FArchive& Ar, const std::string& Text)
+{
+    int32 Len = (int32)Text.size();
+    Ar << Len;
+    Ar.Serialize((void*)Text.data(), Len);
+}
+
+static bool ReadUtf8(FArchive& Ar, std::string& OutText)
+{
+    int32 Len = 0;
+    Ar << Len;
+    if (Ar.IsError() || Len < 0 || Ar.Tell() + Len > Ar.TotalSize()) return false;
+    OutText.resize((size_t)Len);
+    Ar.Serialize(OutText.data(), Len);
+    return true;
+}
+
+bool LLamaRunnerAsync::ExportSession(TArray<uint8>& OutBlob)
+{
+    OutBlob.Reset();
+    if (!IsInitialized() || Slots.Num() == 0) return false;
+
+    // 1) Snapshots of every context; contexts share the model and layout, so each system prefix is written once
+    TArray<uint8> Body;
+    FMemoryWriter Writer(Body);
+    TSet<uint32> Written;
+    int32 NumEntries = 0;
+    for (const TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        FScopeLock Lock(&Slot->PrefixMutex);
+        for (const TPair<uint32, FPrefixSnapshot>& It : Slot->PrefixCache)
+        {
+            bool bWritten = false;
+            Written.Add(It.Key, &bWritten);
+            if (bWritten) continue;
+
+            uint32 Key = It.Key;
+            int32 NumTokens = (int32)It.Value.Tokens.size();
+            int64 NumBytes = (int64)It.Value.State.size();
+            Writer << Key << NumTokens << NumBytes;
+            Writer.Serialize((void*)It.Value.Tokens.data(), NumTokens * (int64)sizeof(llama_token));
+            Writer.Serialize((void*)It.Value.State.data(), NumBytes);
+            ++NumEntries;
+        }
+    }
+
+    // 2) Conversations, written by each context's worker between two steps. A worker that does not answer in time
+    //    (a long prefill chunk) leaves its conversations out rather than stall the save.
+    check(!IsWorkerThread());
+    struct FConversationExport
+    {
+        TArray<uint8> Data;
+        int32 Num = 0;
+        FEvent* Done = FPlatformProcess::GetSynchEventFromPool(true);
+        ~FConversationExport() { FPlatformProcess::ReturnSynchEventToPool(Done); }
+    };
+    TArray<TSharedRef<FConversationExport, ESPMode::ThreadSafe>> Exports;
+    for (const TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        if (!Slot->Worker) continue;
+        TSharedRef<FConversationExport, ESPMode::ThreadSafe> Export = MakeShared<FConversationExport, ESPMode::ThreadSafe>();
+        FContextSlot* SlotPtr = Slot.Get();
+        Slot->Worker->RunBetweenSteps([this, SlotPtr, Export]()
+            {
+                FMemoryWriter ConvWriter(Export->Data);
+                WriteConversations(*SlotPtr, ConvWriter, Export->Num);
+                Export->Done->Trigger();
+            });
+        Exports.Add(Export);
+    }
+    int32 NumConversations = 0;
+    TArray<uint8> Conversations;
+    for (const TSharedRef<FConversationExport, ESPMode::ThreadSafe>& Export : Exports)
+    {
+        if (!Export->Done->Wait(5000))
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Session export: a worker did not answer, its conversations are not saved"));
+            continue;
+        }
+        NumConversations += Export->Num;
+        Conversations.Append(Export->Data);
+    }
+    Writer << NumConversations;
+    Body.Append(Conversations);
+
+    // 3) Header: what the KV state is only valid for
+    FMemoryWriter Out(OutBlob);
+    uint32 Magic = SessionMagic;
+    int32 Version = SessionVersion;
+    uint64 Key = ModelKey;
+    uint32 NumCtx = llama_n_ctx(Slots[0]->Ctx);
+    int32 TypeK = (int32)cparams.type_k, TypeV = (int32)cparams.type_v;
+    Out << Magic << Version << Key << NumCtx << TypeK << TypeV << NumEntries;
+    OutBlob.Append(Body);
+
+    UE_LOG(LogGameAI, Display, TEXT("Session export: %d prefix snapshots, %d conversations, %d KB"), NumEntries, NumConversations, OutBlob.Num() / 1024);
+    return true;
+}
+
+bool LLamaRunnerAsync::ImportSession(const TArray<uint8>& Blob)
+{
+    if (!IsInitialized() || Slots.Num() == 0) return false;
+
+    // 1) Header
+    FMemoryReader Reader(Blob);
+    uint32 Magic = 0, NumCtx = 0;
+    int32 Version = 0, TypeK = -1, TypeV = -1, NumEntries = 0;
+    uint64 Key = 0;
+    Reader << Magic << Version << Key << NumCtx << TypeK << TypeV << NumEntries;
+    if (Reader.IsError() || Magic != SessionMagic || Version < 1 || Version > SessionVersion)
+    {
+        UE_LOG(LogGameAI, Warning, TEXT("Session import: not a director session blob (%d bytes)"), Blob.Num());
+        return false;
+    }
+    if (Key != ModelKey || NumCtx != llama_n_ctx(Slots[0]->Ctx) || TypeK != (int32)cparams.type_k || TypeV != (int32)cparams.type_v)
+    {
+        UE_LOG(LogGameAI, Display, TEXT("Session import: saved with other weights or another context layout, prefixes will be prefilled"));
+        return false;
+    }
+
+    // 2) Snapshots; a truncated blob is dropped whole
+    TArray<TPair<uint32, FPrefixSnapshot>> Entries;
+    for (int32 i = 0; i < NumEntries; ++i)
+    {
+        uint32 EntryKey = 0;
+        int32 NumTokens = 0;
+        int64 NumBytes = 0;
+        Reader << EntryKey << NumTokens << NumBytes;
+        if (Reader.IsError() || NumTokens <= 0 || NumBytes <= 0
+            || Reader.Tell() + NumTokens * (int64)sizeof(llama_token) + NumBytes > Reader.TotalSize())
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Session import: blob is truncated, ignoring it"));
+            return false;
+        }
+
+        FPrefixSnapshot Snap;
+        Snap.Tokens.resize(NumTokens);
+        Snap.State.resize((size_t)NumBytes);
+        Reader.Serialize(Snap.Tokens.data(), NumTokens * (int64)sizeof(llama_token));
+        Reader.Serialize(Snap.State.data(), NumBytes);
+        Entries.Emplace(EntryKey, MoveTemp(Snap));
+    }
+
+    // 3) Conversations (version 2 on): history, and the KV of those that had a pinned sequence
+    TArray<TPair<int32, FSavedConversation>> Conversations;
+    int32 NumConversations = 0;
+    if (Version >= 2) Reader << NumConversations;
+    for (int32 i = 0; i < NumConversations; ++i)
+    {
+        FSavedConversation Saved;
+        FString PersonaName;
+        int32 Index = 0, NumTurns = 0, NumTokens = 0;
+        int64 NumBytes = 0;
+        Reader << Saved.Key << Index << PersonaName << NumTurns;
+        bool bOk = !Reader.IsError() && NumTurns >= 0;
+        for (int32 t = 0; bOk && t < NumTurns; ++t)
+        {
+            TPair<std::string, std::string> Turn;
+            bOk = ReadUtf8(Reader, Turn.Key) && ReadUtf8(Reader, Turn.Value);
+            Saved.Turns.Add(MoveTemp(Turn));
+        }
+        if (bOk)
+        {
+            Reader << NumTokens << NumBytes;
+            bOk = !Reader.IsError() && NumTokens >= 0 && NumBytes >= 0
+                && Reader.Tell() + NumTokens * (int64)sizeof(llama_token) + NumBytes <= Reader.TotalSize();
+        }
+        if (!bOk)
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Session import: blob is truncated, ignoring it"));
+            return false;
+        }
+
+        Saved.Tokens.resize(NumTokens);
+        Saved.State.resize((size_t)NumBytes);
+        Reader.Serialize(Saved.Tokens.data(), NumTokens * (int64)sizeof(llama_token));
+        Reader.Serialize(Saved.State.data(), NumBytes);
+
+        // KV computed under an adapter that is no longer configured is useless; the history still counts
+        Saved.Persona = FindPersona(PersonaName);
+        if (!PersonaName.IsEmpty() && Saved.Persona == INDEX_NONE)
+        {
+            Saved.Tokens.clear();
+            Saved.State.clear();
+        }
+        Conversations.Emplace(Index, MoveTemp(Saved));
+    }
+
+    // 4) Into every context. A snapshot taken this session wins; the tokens are still checked against each prompt on use
+    for (const TUniquePtr<FContextSlot>& Slot : Slots)
+    {
+        FScopeLock Lock(&Slot->PrefixMutex);
+        for (const TPair<uint32, FPrefixSnapshot>& It : Entries)
+        {
+            if (!Slot->PrefixCache.Contains(It.Key)) Slot->PrefixCache.Add(It.Key, It.Value);
+        }
+    }
+
+    // 5) Each conversation back on the context it was saved from (wrapping around a smaller pool). The restore runs on
+    //    that worker before any of its jobs; a conversation the game has already resumed this session keeps its state.
+    int32 NumRestored = 0;
+    for (TPair<int32, FSavedConversation>& It : Conversations)
+    {
+        const int32 Index = Slots.IsValidIndex(It.Key) ? It.Key : FMath::Abs(It.Key) % Slots.Num();
+        FContextSlot* Slot = Slots[Index].Get();
+        if (!Slot->Worker) continue;
+        {
+            FScopeLock Lock(&ConversationMutex);
+            if (ConversationSlots.Contains(It.Value.Key)) continue;
+            ConversationSlots.Add(It.Value.Key, Index);
+        }
+        Slot->Worker->RunBetweenSteps([this, Slot, Saved = MoveTemp(It.Value)]() mutable
+            {
+                RestoreConversation(*Slot, MoveTemp(Saved));
+            });
+        ++NumRestored;
+    }
+    UE_LOG(LogGameAI, Display, TEXT("Session import: %d prefix snapshots, %d conversations restored"), Entries.Num(), NumRestored);
+    return true;
+}
+
+void LLamaRunnerAsync::WriteConversations(FContextSlot& Slot, FArchive& Ar, int32& OutNum)
+{
+    // pinned KV was computed under the context's current adapter (ApplyPersona drops it on a switch)
+    const int32 Active = Slot.ActivePersona.Load();
+    FString PersonaName = Personas.IsValidIndex(Active) ? Personas[Active].Name : FString();
+
+    for (TPair<FString, FConversation>& It : Slot.Conversations)
+    {
+        FConversation& Conv = It.Value;
+        if (Conv.bEnded) continue;
+
+        // 1) KV only for an idle pinned sequence that still holds what Tokens says; a busy one saves its history
+        std::vector<uint8_t> State;
+        if (!Conv.bBusy && Conv.SeqId >= 0 && !Conv.Tokens.empty() && Conv.ResetEpoch == Slot.ResetCount)
+        {
+            FScopeLock Lock(&Slot.DecodeMutex);
+            State.resize(llama_state_seq_get_size(Slot.Ctx, Conv.SeqId));
+            State.resize(llama_state_seq_get_data(Slot.Ctx, State.data(), State.size(), Conv.SeqId));
+        }
+
+        // 2) Key, context, adapter, turns, then tokens and state (both empty = history only)
+        FString Key = It.Key;
+        int32 Index = Slot.Index;
+        int32 NumTurns = Conv.Turns.Num();
+        Ar << Key << Index << PersonaName << NumTurns;
+        for (const TPair<std::string, std::string>& Turn : Conv.Turns)
+        {
+            WriteUtf8(Ar, Turn.Key);
+            WriteUtf8(Ar, Turn.Value);
+        }
+        int32 NumTokens = State.empty() ? 0 : (int32)Conv.Tokens.size();
+        int64 NumBytes = NumTokens > 0 ? (int64)State.size() : 0;
+        Ar << NumTokens << NumBytes;
+        Ar.Serialize((void*)Conv.Tokens.data(), NumTokens * (int64)sizeof(llama_token));
+        Ar.Serialize(State.data(), NumBytes);
+        ++OutNum;
+    }
+}
+
+void LLamaRunnerAsync::RestoreConversation(FContextSlot& Slot, FSavedConversation&& Saved)
+{
+    if (Slot.Conversations.Contains(Saved.Key)) return;
+    FConversation& Conv = Slot.Conversations.Add(Saved.Key);
+    Conv.Turns = MoveTemp(Saved.Turns);
+    Conv.LastUsed = FPlatformTime::Seconds();
+
+    // KV only under the adapter it was computed with; otherwise the first turn prefills the history
+    if (Saved.State.empty() || Saved.Persona != Slot.ActivePersona.Load()) return;
+    FSequence* Seq = AcquireSequence(Slot, &Conv, Saved.Key);
+    if (!Seq || Conv.SeqId != Seq->SeqId) return;   // conversations already hold their share of sequences
+
+    bool bLoaded;
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq->SeqId, -1, -1);
+        bLoaded = llama_state_seq_set_data(Slot.Ctx, Saved.State.data(), Saved.State.size(), Seq->SeqId) != 0;
+    }
+    if (!bLoaded)
+    {
+        UE_LOG(LogGameAI, Warning, TEXT("Conversation %s: saved KV did not load, its next turn prefills the history"), *Saved.Key);
+        UnpinSequence(Slot, *Seq);
+        return;
+    }
+    Conv.Tokens = MoveTemp(Saved.Tokens);
+    Conv.ResetEpoch = Slot.ResetCount;
+}
+
+// ---------- Prefill benchmark ----------
+TArray<LLamaRunnerAsync::FPrefillBenchResult> LLamaRunnerAsync::BenchmarkPrefill(int32 NumTokens, const TArray<int32>& UBatchSizes, const TArray<int32>& ChunkSizes)
+{
+    TArray<FPrefillBenchResult> Results;
+    if (!IsInitialized() || NumTokens <= 0) return Results;
+
+    // Synthetic prompt: the grammar's tokens repeated up to exactly NumTokens. Only the count matters for timing.
+    std::vector<llama_token> Filler, Tokens;
+    if (!TokenizeUtf8(Vocab, kDirectorGrammar, Filler, /*bSpecial*/ false) || Filler.empty()) return Results;
+    Tokens.reserve((size_t)NumTokens);
+    while ((int32)Tokens.size() < NumTokens) Tokens.push_back(Filler[Tokens.size() % Filler.size()]);
+
+    for (int32 UBatch : UBatchSizes)
+    {
+        // Scratch context sized for the prompt alone; n_batch takes the whole prompt so every chunk size fits
+        llama_context_params Params = cparams;
+        Params.n_ctx = (uint32_t)NumTokens + 64;
+        Params.n_seq_max = 1;
+        Params.n_batch = (uint32_t)NumTokens;
+        Params.n_ubatch = (uint32_t)FMath::Clamp(UBatch, 1, NumTokens);
+        llama_context* Ctx = llama_init_from_model(Model, Params);
+        if (!Ctx)
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("BenchPrefill: no context for n_ubatch %d"), UBatch);
+            continue;
+        }
+
+        // Warm-up pass so graph allocation is not billed to the first chunk size
+        llama_decode(Ctx, llama_batch_get_one(Tokens.data(), FMath::Min(NumTokens, (int32)Params.n_ubatch)));
+
+        for (int32 Chunk : ChunkSizes)
+        {
+            Chunk = FMath::Clamp(Chunk > 0 ? Chunk : NumTokens, 1, NumTokens);
+            llama_memory_clear(llama_get_memory(Ctx), /*data*/ true);
+
+            FPrefillBenchResult& Result = Results.AddDefaulted_GetRef();
+            Result.UBatch = (int32)Params.n_ubatch;
+            Result.Chunk = Chunk;
+
+            const double T0 = FPlatformTime::Seconds();
+            bool bOk = true;
+            for (int32 Start = 0; Start < NumTokens && bOk; Start += Chunk)
+            {
+                const double C0 = FPlatformTime::Seconds();
+                bOk = llama_decode(Ctx, llama_batch_get_one(Tokens.data() + Start, FMath::Min(Chunk, NumTokens - Start))) == 0;
+                Result.MaxChunkMs = FMath::Max(Result.MaxChunkMs, (FPlatformTime::Seconds() - C0) * 1000.0);
+            }
+            const double Seconds = FPlatformTime::Seconds() - T0;
+            Result.TokensPerSecond = (bOk && Seconds > 0.0) ? NumTokens / Seconds : 0.0;
+        }
+        llama_free(Ctx);
+    }
+    return Results;
+}
+
+// ---------- Prefill ----------
+int32 LLamaRunnerAsync::DecodeTokens(FContextSlot& Slot, llama_seq_id SeqId, const std::vector<llama_token>& Tokens, int32 Begin, int32 End, bool bLogitsLast,
+    llama_context* Ctx)
+{
+    const int32 Count = End - Begin;
+    if (Count <= 0) return 0;
+    if (!Ctx) Ctx = Slot.Ctx;
+
+    // llama_decode rejects more than n_batch tokens at once
+    const int32 MaxBatch = FMath::Max(1, (int32)llama_n_batch(Ctx));
+    llama_batch batch = llama_batch_init(FMath::Min(Count, MaxBatch), /*embd*/ 0, /*n_seq_max*/ 1);
+
+    int32 dec = 0;
+    for (int32 Start = Begin; Start < End && dec == 0; Start += MaxBatch)
+    {
+        const int32 n_tokens = FMath::Min(MaxBatch, End - Start);
+        batch.n_tokens = n_tokens;
+        for (int32 i = 0; i < n_tokens; ++i) {
+            batch.token[i] = Tokens[Start + i];
+            batch.pos[i] = Start + i;
+            batch.n_seq_id[i] = 1;
+            batch.seq_id[i][0] = SeqId;
+            batch.logits[i] = (bLogitsLast && Start + i == End - 1) ? 1 : 0;
+        }
+
+        FScopeLock Lock(&Slot.DecodeMutex);
+        dec = llama_decode(Ctx, batch);
+    }
+    llama_batch_free(batch);
+    return dec;
+}
+
+int32 LLamaRunnerAsync::PrefillSystemPrefix(FContextSlot& Slot, llama_seq_id SeqId, const std::string& SystemUtf8, const std::vector<llama_token>& Tokens)
+{
+    const int32 TokCount = (int32)Tokens.size();
+    // keyed per adapter too: the same system text leaves different KV state under another persona
+    const int32 Persona = Slot.ActivePersona.Load();
+    const uint32 Key = FCrc::MemCrc32(SystemUtf8.data(), (int32)SystemUtf8.size(), Persona != INDEX_NONE ? Personas[Persona].Crc : 0);
+
+    // The snapshot is only usable if its tokens are a strict prefix of this prompt's tokenization
+    // (BPE may merge across the system/user boundary, in which case we just prefill everything).
+    auto IsPrefixOfPrompt = [&](const std::vector<llama_token>& Prefix)
+        {
+            return !Prefix.empty() && (int32)Prefix.size() < TokCount
+                && std::equal(Prefix.begin(), Prefix.end(), Tokens.begin());
+        };
+
+    int32 NumReused = 0;
+    FScopeLock PrefixLock(&Slot.PrefixMutex);
+    if (const FPrefixSnapshot* Snap = Slot.PrefixCache.Find(Key))
+    {
+        if (IsPrefixOfPrompt(Snap->Tokens))
+        {
+            size_t loaded;
+            {
+                FScopeLock Lock(&Slot.DecodeMutex);
+                loaded = llama_state_seq_set_data(Slot.Ctx, Snap->State.data(), Snap->State.size(), SeqId);
+            }
+            if (loaded > 0)
+            {
+                NumReused = (int32)Snap->Tokens.size();
+                ++PrefixHits;
+                PrefixTokensSaved += NumReused;
+            }
+            else
+            {
+                UE_LOG(LogGameAI, Warning, TEXT("Prefix snapshot restore failed, dropping it and prefilling fully"));
+                Slot.PrefixCache.Remove(Key);
+                FScopeLock Lock(&Slot.DecodeMutex);
+                llama_memory_seq_rm(llama_get_memory(Slot.Ctx), SeqId, -1, -1);
+            }
+        }
+    }
+    else
+    {
+        PrefixLock.Unlock();
+        ++PrefixMisses;
+
+        // Decode the system prefix on its own so its KV state can be captured before the user suffix lands in the sequence
+        std::string PrefixText;
+        std::vector<llama_token> PrefixTokens;
+        if (RenderSystemPrefix(SystemUtf8, PrefixText) && TokenizeUtf8(Vocab, PrefixText, PrefixTokens) && IsPrefixOfPrompt(PrefixTokens))
+        {
+            const int32 NumPrefix = (int32)PrefixTokens.size();
+            const int32 dec = DecodeTokens(Slot, SeqId, Tokens, 0, NumPrefix, /*bLogitsLast*/ false);
+            if (dec != 0)
+            {
+                UE_LOG(LogTemp, Error, TEXT("llama_decode(prefix) failed (%d)"), dec);
+                return -1;
+            }
+            NumReused = NumPrefix;
+
+            FPrefixSnapshot Snap;
+            Snap.Tokens = MoveTemp(PrefixTokens);
+            {
+                FScopeLock Lock(&Slot.DecodeMutex);
+                Snap.State.resize(llama_state_seq_get_size(Slot.Ctx, SeqId));
+                Snap.State.resize(llama_state_seq_get_data(Slot.Ctx, Snap.State.data(), Snap.State.size(), SeqId));
+            }
+            if (!Snap.State.empty())
+            {
+                UE_LOG(LogGameAI, Display, TEXT("Cached system prefix: %d tokens, %d KB state"), NumPrefix, (int32)(Snap.State.size() / 1024));
+                FScopeLock AddLock(&Slot.PrefixMutex);
+                Slot.PrefixCache.Add(Key, MoveTemp(Snap));
+            }
+        }
+    }
+
+    // Only the user suffix (plus the assistant header) is left to prefill, chunk by chunk
+    return NumReused;
+}
+
+// ---------- Prompt ----------
+bool LLamaRunnerAsync::EmbedPrompt(const FString& Prompt, std::vector<float>& Out)
+{
+    Out.clear();
+    if (!EmbedCtx) return false;
+
+    // the bare prompt: the system block is the same for every request of a group and would only dilute the mean
+    std::vector<llama_token> Tokens;
+    if (!TokenizeUtf8(Vocab, TCHAR_TO_UTF8(*Prompt), Tokens)) return false;
+    Tokens.resize(FMath::Min<size_t>(Tokens.size(), llama_n_batch(EmbedCtx)));
+
+    FScopeLock Lock(&EmbedMutex);
+    llama_memory_clear(llama_get_memory(EmbedCtx), /*data*/ true);
+    if (llama_decode(EmbedCtx, llama_batch_get_one(Tokens.data(), (int32_t)Tokens.size())) != 0) return false;
+
+    const float* Pooled = llama_get_embeddings_seq(EmbedCtx, 0);
+    if (!Pooled) return false;
+    Out.assign(Pooled, Pooled + llama_model_n_embd(Model));
+    return true;
+}
+
+bool LLamaRunnerAsync::BuildPromptTokens(const FJob& Job, const FConversation* Conv, std::string& OutSystemUtf8, std::vector<llama_token>& OutTokens) const
+{
+    // 0) Nudge model toward JSON-only
+    UE_LOG(LogGameAI, Display, TEXT("0) Nudge model toward JSON-only"));
+    static const char* kSystemJSONTrigger2 = R"(You are a game director planner. OUTPUT RULES: - STRICT JSON only; output must start with '{' and end with '}'. - Use exactly these keys: {"intent":"<intent_value>","reason":"<short>","tool_calls":[{"name":"<QuestPatch|SpawnEncounter|SetFlag|GiveItem|WeatherControl|ForeshadowEvent|TensionMeterAdjust>","args":{}}],"dialogue":{"speaker":"<NPC name like GuardCaptain>","emote":"<urgent|wary|calm>","lines":["<short line>"]},"quest_patch":{"questId":"<string id>","addObjectives":[{"id":"<string>","desc":"<short>"}]}} - If a section is not needed, use [] or {}. Do NOT invent keys (e.g., {"empty":true}). No ellipses or "..." lines. POLICY: - When weather cues are present (e.g., clouds gathering) or the player approaches an ACTIVE objective, include exactly ONE tool_call: Prefer WeatherControl("overcast") for light clouds; otherwise ONE of ForeshadowEvent or TensionMeterAdjust(+1). - Only use zero tool_calls if truly nothing is warranted; explain why in "reason". FEW-SHOT: INPUT: Player leaves CitySquare heading west; time=late afternoon; clouds gathering lightly; objective=guard_ruins (active). OUTPUT: BEGIN_JSON {"intent":"warn","reason":"Approaching active ruins as weather worsens.","tool_calls":[{"name":"WeatherControl","args":{"preset":"overcast"}}],"dialogue":{"speaker":"Villager","emote":"wary","lines":["Storms building by the ruins. Watch yourself."]},"quest_patch":{}} END_JSON)";
+    
+   // static const char* kSystemJSON = R"(You are a game director planner. OUTPUT RULES: - STRICT JSON only; no empty {}, no prose or reasoning,You must NEVER show reasoning or explanations, Keys EXACTLY: {"intent":"<offer_quest|warn|give_clue|continue|escalate|deescalate>","reason":"<short>","tool_calls":[{"name":"<QuestPatch|SpawnEncounter|GiveItem|WeatherControl|ForeshadowEvent>","args":{}}],"dialogue":{"speaker":"<NPC name like GuardCaptain>","emote":"<urgent|wary|calm>","lines":["<short line>"]},"quest_patch":{"questId":"<string id>","addObjectives":[{"id":"<string>","desc":"<short>"}]}}. Do NOT invent keys. You should have at least ONE or MANY tool_calls, No ellipses or "..." )";
+  
+   // FString kSystemJSON = FString::Printf(LR"(You are a game director planner. OUTPUT RULES: STRICT JSON OUTPUT ONLY. Reply with exactly one JSON object, no prose, no explanations. Begin with '{' and end with '}'. Fill all fields with short strings. Schema: {"intent":"string","reason":"string","tool_calls":[{"name":"string","args":{}}],"dialogue":{"speaker":"string","emote":"urgent|wary|calm","lines":["string"]},"quest_patch":{"questId":"string","addObjectives":[{"id":"string","desc":"string"}]}}. Example (structure only, values will differ): {"intent":"%s","reason":"short","tool_calls":[{"name":"WeatherControl","args":{}}],"dialogue":{"speaker":"GuardCaptain","emote":"urgent","lines":["Keep it tight."]},"quest_patch":{"questId":"q1","addObjectives":[{"id":"o1","desc":"Secure the square."}]}})", *Intent);
+   //// 1) Chat messages (system + user)
+   //
+   // 
+   // 
+   // llama_chat_message msgs[2] = {
+   //     { "system", TCHAR_TO_UTF8(*kSystemJSON) },
+   //     { "user",   TCHAR_TO_UTF8(*Prompt) }
+   // };
+
+
+
+    static const char* kSystemJSON = R"(You are a game director planner. OUTPUT RULES: - STRICT JSON only; no empty {}, no prose or reasoning,You must NEVER show reasoning or explanations, Keys EXACTLY: {"intent":"<intent_value>","reason":"<short>","tool_calls":[{"name":"<WeatherControl>","args":{}}],"dialogue":{"speaker":"<NPC name>","emote":"<urgent|wary|calm>","lines":["<short line>"]},"quest_patch":{"questId":"<string id>","addObjectives":[{"id":"<string>","desc":"<short>"}]}}. POLICY: do not leave any values empty. You should have at least ONE or MANY tool_calls, No ellipses or "..." -Use JSON stricly in response. No empty JSON. )";
+
+    FString json = kSystemJSON;
+    FString Result = json.Replace(TEXT("intent_value"), *Job.Intent);
+
+    FString Clean = Result.Replace(TEXT("\r\n"), TEXT("\n")).TrimStartAndEnd();
+    FTCHARToUTF8 Converter(*Clean);
+
+    // 1) Chat messages (system, the conversation's earlier turns, user)
+    OutSystemUtf8.assign(Converter.Get(), Converter.Length());
+    FTCHARToUTF8 PromptUtf8(*Job.Prompt);
+
+    std::vector<llama_chat_message> msgs;
+    msgs.push_back({ "system", OutSystemUtf8.c_str() });
+    if (Conv)
+    {
+        for (const TPair<std::string, std::string>& Turn : Conv->Turns)
+        {
+            msgs.push_back({ "user", Turn.Key.c_str() });
+            msgs.push_back({ "assistant", Turn.Value.c_str() });
+        }
+    }
+    msgs.push_back({ "user", PromptUtf8.Get() });
+    // 2) Apply chat template
+    UE_LOG(LogGameAI, Display, TEXT("2) Apply chat template"));
+    std::string templ;
+    if (!ApplyChatTemplate(msgs.data(), msgs.size(), templ)) {
+        return false;
+    }
+
+    // 3) Tokenize
+    UE_LOG(LogGameAI, Display, TEXT("3) Tokenize"));
+    return TokenizeUtf8(Vocab, templ, OutTokens);
+}
+
+// ---------- Conversations ----------
+void LLamaRunnerAsync::EndConversation(const FString& Conversation)
+{
+    int32 Index = INDEX_NONE;
+    {
+        FScopeLock Lock(&ConversationMutex);
+        ConversationSlots.RemoveAndCopyValue(Conversation, Index);
+    }
+    if (Slots.IsValidIndex(Index) && Slots[Index]->Worker) Slots[Index]->Worker->EndConversation(Conversation);
+}
+
+LLamaRunnerAsync::FSequence* LLamaRunnerAsync::AcquireSequence(FContextSlot& Slot, FConversation* Conv, const FString& Key)
+{
+    // 1) The conversation's own sequence; PopNextJob never admits a second turn while one is in flight
+    if (Conv && Conv->SeqId >= 0) return &Slot.Sequences[Conv->SeqId];
+
+    // 2) Conversations may pin all sequences but one, so stateless jobs always get in
+    const int32 MaxPinned = Slot.Sequences.Num() - 1;
+    int32 NumPinned = 0;
+    for (const FSequence& S : Slot.Sequences)
+    {
+        if (!S.Conversation.IsEmpty()) ++NumPinned;
+    }
+
+    FSequence* Free = Slot.Sequences.FindByPredicate([](const FSequence& S) { return !S.bActive && S.Conversation.IsEmpty(); });
+    if (!Free || (Conv && NumPinned >= MaxPinned))
+    {
+        // 3) The least recently used idle conversation gives its sequence up; its turns stay for a full prefill later
+        FSequence* Victim = nullptr;
+        double VictimUsed = DBL_MAX;
+        for (FSequence& S : Slot.Sequences)
+        {
+            if (S.bActive || S.Conversation.IsEmpty()) continue;
+            const FConversation* C = Slot.Conversations.Find(S.Conversation);
+            const double Used = C ? C->LastUsed : 0.0;
+            if (Used < VictimUsed) { Victim = &S; VictimUsed = Used; }
+        }
+        if (Victim)
+        {
+            UE_LOG(LogGameAI, Display, TEXT("Conversation %s evicted from seq %d (ctx %d)"), *Victim->Conversation, Victim->SeqId, Slot.Index);
+            UnpinSequence(Slot, *Victim);
+            --NumPinned;
+            if (!Free) Free = Victim;
+        }
+    }
 
-                    if (seen_open && depth == 0 && start >= 0)
-                    {
-                        // Candidate complete object [start..i]
-                        FString Candidate(UTF8_TO_TCHAR(std::string(s.begin() + start, s.begin() + i + 1).c_str()));
-                        FString Clean, Err;
-
-                        if (IsValidDirectorJSON(Candidate, /*out*/Clean, /*out*/Err))
-                        {
-                            UE_LOG(LogGameAI, Display, TEXT("Exit (valid JSON): %s"), *Clean);
-                            return EJsonProbe::ClosedValid;
-                        }
-                        else
-                        {
-                            UE_LOG(LogGameAI, Display, TEXT("Balanced but invalid JSON, continuing. Error: %s\nCandidate:\n%s"),
-                                *Err, *Candidate);
-                            return EJsonProbe::ClosedInvalid; // keep generating
-                        }
-                    }
-                }
-            }
-            return EJsonProbe::None;
-        };
+    // 4) Pin it, unless conversations already hold their share; the turn then runs like a stateless job
+    if (Free && Conv && NumPinned < MaxPinned)
+    {
+        Free->Conversation = Key;
+        Conv->SeqId = Free->SeqId;
+        Conv->Tokens.clear();
+    }
+    return Free;
+}
 
+void LLamaRunnerAsync::UnpinSequence(FContextSlot& Slot, FSequence& Seq)
+{
+    if (FConversation* Conv = Slot.Conversations.Find(Seq.Conversation))
     {
-        FScopeLock Lock(&DecodeMutex);      // same mutex you use for decode
-        ResetContext();
-        // wipe all past tokens
-        // (optional) llama_reset_timings(Ctx);
+        Conv->SeqId = -1;
+        Conv->Tokens.clear();
     }
+    Seq.Conversation.Empty();
+    FScopeLock Lock(&Slot.DecodeMutex);
+    llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, -1, -1);
+}
 
-    if (!Ctx || !Vocab || !Model) {
-        UE_LOG(LogGameAI, Display, TEXT("LlamaRunner not initialized"));
-        return "{}";
+int32 LLamaRunnerAsync::ReuseConversation(FContextSlot& Slot, FSequence& Seq, FConversation& Conv, const std::vector<llama_token>& Tokens)
+{
+    // a context reset since the last turn took the cells with it
+    if (Conv.SeqId != Seq.SeqId || Conv.Tokens.empty() || Conv.ResetEpoch != Slot.ResetCount)
+    {
+        Conv.Tokens.clear();
+        return 0;
     }
 
-    // 0) Nudge model toward JSON-only
-    UE_LOG(LogGameAI, Display, TEXT("0) Nudge model toward JSON-only"));
-    static const char* kSystemJSONTrigger2 = R"(You are a game director planner. OUTPUT RULES: - STRICT JSON only; output must start with '{' and end with '}'. - Use exactly these keys: {"intent":"<intent_value>","reason":"<short>","tool_calls":[{"name":"<QuestPatch|SpawnEncounter|SetFlag|GiveItem|WeatherControl|ForeshadowEvent|TensionMeterAdjust>","args":{}}],"dialogue":{"speaker":"<NPC name like GuardCaptain>","emote":"<urgent|wary|calm>","lines":["<short line>"]},"quest_patch":{"questId":"<string id>","addObjectives":[{"id":"<string>","desc":"<short>"}]}} - If a section is not needed, use [] or {}. Do NOT invent keys (e.g., {"empty":true}). No ellipses or "..." lines. POLICY: - When weather cues are present (e.g., clouds gathering) or the player approaches an ACTIVE objective, include exactly ONE tool_call: Prefer WeatherControl("overcast") for light clouds; otherwise ONE of ForeshadowEvent or TensionMeterAdjust(+1). - Only use zero tool_calls if truly nothing is warranted; explain why in "reason". FEW-SHOT: INPUT: Player leaves CitySquare heading west; time=late afternoon; clouds gathering lightly; objective=guard_ruins (active). OUTPUT: BEGIN_JSON {"intent":"warn","reason":"Approaching active ruins as weather worsens.","tool_calls":[{"name":"WeatherControl","args":{"preset":"overcast"}}],"dialogue":{"speaker":"Villager","emote":"wary","lines":["Storms building by the ruins. Watch yourself."]},"quest_patch":{}} END_JSON)";
-    
-   // static const char* kSystemJSON = R"(You are a game director planner. OUTPUT RULES: - STRICT JSON only; no empty {}, no prose or reasoning,You must NEVER show reasoning or explanations, Keys EXACTLY: {"intent":"<offer_quest|warn|give_clue|continue|escalate|deescalate>","reason":"<short>","tool_calls":[{"name":"<QuestPatch|SpawnEncounter|GiveItem|WeatherControl|ForeshadowEvent>","args":{}}],"dialogue":{"speaker":"<NPC name like GuardCaptain>","emote":"<urgent|wary|calm>","lines":["<short line>"]},"quest_patch":{"questId":"<string id>","addObjectives":[{"id":"<string>","desc":"<short>"}]}}. Do NOT invent keys. You should have at least ONE or MANY tool_calls, No ellipses or "..." )";
-  
-   // FString kSystemJSON = FString::Printf(LR"(You are a game director planner. OUTPUT RULES: STRICT JSON OUTPUT ONLY. Reply with exactly one JSON object, no prose, no explanations. Begin with '{' and end with '}'. Fill all fields with short strings. Schema: {"intent":"string","reason":"string","tool_calls":[{"name":"string","args":{}}],"dialogue":{"speaker":"string","emote":"urgent|wary|calm","lines":["string"]},"quest_patch":{"questId":"string","addObjectives":[{"id":"string","desc":"string"}]}}. Example (structure only, values will differ): {"intent":"%s","reason":"short","tool_calls":[{"name":"WeatherControl","args":{}}],"dialogue":{"speaker":"GuardCaptain","emote":"urgent","lines":["Keep it tight."]},"quest_patch":{"questId":"q1","addObjectives":[{"id":"o1","desc":"Secure the square."}]}})", *Intent);
-   //// 1) Chat messages (system + user)
-   //
-   // 
-   // 
-   // llama_chat_message msgs[2] = {
-   //     { "system", TCHAR_TO_UTF8(*kSystemJSON) },
-   //     { "user",   TCHAR_TO_UTF8(*Prompt) }
-   // };
+    // Longest common prefix of the sequence's content and the new prompt. It usually ends inside the last answer,
+    // where the template renders it differently from how it was generated. The last prompt token is always decoded
+    // again, for its logits.
+    const int32 Max = FMath::Min((int32)Conv.Tokens.size(), (int32)Tokens.size() - 1);
+    int32 Keep = 0;
+    while (Keep < Max && Conv.Tokens[Keep] == Tokens[Keep]) ++Keep;
+    Conv.Tokens.clear();
 
+    // A cache that cannot drop a tail (e.g. sliding-window layers) refuses the partial removal: start over
+    bool bTrimmed;
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_t Mem = llama_get_memory(Slot.Ctx);
+        bTrimmed = Keep > 0 && llama_memory_seq_rm(Mem, Seq.SeqId, Keep, -1);
+        if (!bTrimmed) llama_memory_seq_rm(Mem, Seq.SeqId, -1, -1);
+    }
+    if (!bTrimmed) return 0;
 
+    ConversationTokensReused += Keep;
+    UE_LOG(LogGameAI, Display, TEXT("Conversation %s: %d of %d prompt tokens already in seq %d"), *Seq.Conversation, Keep, (int32)Tokens.size(), Seq.SeqId);
+    return Keep;
+}
 
-    static const char* kSystemJSON = R"(You are a game director planner. OUTPUT RULES: - STRICT JSON only; no empty {}, no prose or reasoning,You must NEVER show reasoning or explanations, Keys EXACTLY: {"intent":"<intent_value>","reason":"<short>","tool_calls":[{"name":"<WeatherControl>","args":{}}],"dialogue":{"speaker":"<NPC name>","emote":"<urgent|wary|calm>","lines":["<short line>"]},"quest_patch":{"questId":"<string id>","addObjectives":[{"id":"<string>","desc":"<short>"}]}}. POLICY: do not leave any values empty. You should have at least ONE or MANY tool_calls, No ellipses or "..." -Use JSON stricly in response. No empty JSON. )";
+void LLamaRunnerAsync::EndConversationTurn(FContextSlot& Slot, FSequence& Seq, const FJob& Job, bool bCompleted)
+{
+    FConversation* Conv = Slot.Conversations.Find(Job.Conversation);
+    if (!Conv)
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, -1, -1);
+        return;
+    }
+    Conv->bBusy = false;
+    Conv->LastUsed = FPlatformTime::Seconds();
 
-    FString json = kSystemJSON;
-    FString Result = json.Replace(TEXT("intent_value"), *Intent);
+    // 1) History: answered turns only, the oldest go past GameDirector.ConversationTurns
+    if (bCompleted)
+    {
+        Conv->Turns.Emplace(std::string(TCHAR_TO_UTF8(*Job.Prompt)), Seq.Stream);
+        const int32 MaxTurns = FMath::Max(1, CVarConversationTurns.GetValueOnAnyThread());
+        if (Conv->Turns.Num() > MaxTurns) Conv->Turns.RemoveAt(0, Conv->Turns.Num() - MaxTurns);
+    }
 
-    FString Clean = Result.Replace(TEXT("\r\n"), TEXT("\n")).TrimStartAndEnd();
-    FTCHARToUTF8 Converter(*Clean);
+    // 2) KV: a pinned sequence holds the prompt and the generated tokens decoded so far (OutTokens[i] at PromptLen + i)
+    if (bCompleted && Seq.Conversation == Job.Conversation && !Conv->bEnded)
+    {
+        const int32 NumOut = FMath::Clamp(Seq.NumPast - Seq.PromptLen, 0, (int32)Seq.OutTokens.size());
+        Conv->Tokens = Seq.PromptTokens;
+        Conv->Tokens.insert(Conv->Tokens.end(), Seq.OutTokens.begin(), Seq.OutTokens.begin() + NumOut);
+        Conv->ResetEpoch = Slot.ResetCount;
+    }
+    else
+    {
+        Conv->Tokens.clear();
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, -1, -1);
+    }
+    Seq.PromptTokens.clear();
 
+    if (Conv->bEnded) DropConversation(Slot, Job.Conversation);
+}
 
-    // 1) Chat messages (system + user)
+void LLamaRunnerAsync::DropConversation(FContextSlot& Slot, const FString& Key)
+{
+    FConversation* Conv = Slot.Conversations.Find(Key);
+    if (!Conv) return;
+    if (Conv->bBusy)
+    {
+        Conv->bEnded = true;
+        return;
+    }
+    if (Slot.Sequences.IsValidIndex(Conv->SeqId)) UnpinSequence(Slot, Slot.Sequences[Conv->SeqId]);
+    UE_LOG(LogGameAI, Display, TEXT("Conversation %s ended after %d turns (ctx %d)"), *Key, Conv->Turns.Num(), Slot.Index);
+    Slot.Conversations.Remove(Key);
+}
 
+// ---------- Continuous-batching scheduler (worker thread) ----------
+void LLamaRunnerAsync::ClearSequence(FContextSlot& Slot, llama_seq_id SeqId)
+{
+    if (Slot.NumActiveSequences == 0 && !Slot.Sequences.ContainsByPredicate([](const FSequence& S) { return !S.Conversation.IsEmpty(); }))
+    {
+        // nothing else in flight or held by a conversation: full (timed) reset
+        ResetSlotContext(Slot);
+        return;
+    }
+    FScopeLock Lock(&Slot.DecodeMutex);
+    llama_memory_seq_rm(llama_get_memory(Slot.Ctx), SeqId, -1, -1);
+    if (Slot.DraftCtx) llama_memory_seq_rm(llama_get_memory(Slot.DraftCtx), SeqId, -1, -1);
+}
 
+void LLamaRunnerAsync::DropDraftSequence(FContextSlot& Slot, FSequence& Seq)
+{
+    if (Slot.DraftCtx && Seq.bSpeculative)
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.DraftCtx), Seq.SeqId, -1, -1);
+    }
+    Seq.bSpeculative = false;
+    Seq.Draft.clear();
+    Seq.DraftPast = 0;
+}
 
-    llama_chat_message msgs[2] = {
-        { "system", Converter.Get() },
-        { "user",   TCHAR_TO_UTF8(*Prompt) }
-    };
-    // 2) Apply chat template (size)
-    UE_LOG(LogGameAI, Display, TEXT("2) Apply chat template (size)"));
-    int32_t templ_bytes_needed = llama_chat_apply_template(nullptr, msgs, 2, /*add_assistant*/ true, nullptr, 0);
-    if (templ_bytes_needed <= 0) {
-        UE_LOG(LogTemp, Error, TEXT("apply_template(size) failed (%d)"), templ_bytes_needed);
-        return "{}";
+void LLamaRunnerAsync::BeginSequence(FContextSlot& Slot, FJob&& Job)
+{
+    const double AdmitTime = FPlatformTime::Seconds();
+    FConversation* Conv = Job.Conversation.IsEmpty() ? nullptr : &Slot.Conversations.FindOrAdd(Job.Conversation);
+    FSequence* Seq = AcquireSequence(Slot, Conv, Job.Conversation);
+    if (!Seq || !Slot.Ctx || !Vocab || !Model) {
+        UE_LOG(LogGameAI, Display, TEXT("LlamaRunner not initialized"));
+        CompleteJob(Slot, Job, TEXT("{}"));
+        return;
     }
 
-    // 3) Render template
-    UE_LOG(LogGameAI, Display, TEXT("3) Render template"));
-    std::string templ((size_t)templ_bytes_needed, '\0');
-    int32_t templ_written = llama_chat_apply_template(nullptr, msgs, 2, /*add_assistant*/ true, templ.data(), templ_bytes_needed);
-    if (templ_written <= 0 || templ_written > templ_bytes_needed) {
-        UE_LOG(LogTemp, Error, TEXT("apply_template(write) failed (%d)"), templ_written);
-        return "{}";
+    // 0) A cached decision for a prompt that only differs in wording answers this one
+    Seq->Embedding.clear();
+    if (Job.SemanticGroup != 0 && EmbedPrompt(Job.Prompt, Seq->Embedding) && Job.bSemanticLookup)
+    {
+        FString Cached;
+        float Similarity = 0.f;
+        if (SemanticIndex.Find(Job.SemanticGroup, Seq->Embedding.data(), CVarSemanticThreshold.GetValueOnAnyThread(), Cached, Similarity))
+        {
+            UE_LOG(LogGameAI, Display, TEXT("Semantic cache hit (similarity %.3f, %.1f ms, %lld hits / %lld misses)"),
+                Similarity, (FPlatformTime::Seconds() - AdmitTime) * 1000.0, SemanticIndex.GetHits(), SemanticIndex.GetMisses());
+            if (Job.Stream) StreamCachedDecision(*Job.Stream, Cached);
+            CompleteJob(Slot, Job, MoveTemp(Cached));
+            return;
+        }
     }
 
-    // 4) Tokenize (size + write)
-    UE_LOG(LogGameAI, Display, TEXT("4) Tokenize"));
-    int32_t tok_needed = llama_tokenize(Vocab, templ.data(), templ_written, nullptr, 0, /*add_special*/ true, /*parse_special*/ true);
-    if (tok_needed < 0) tok_needed = -tok_needed;
-    if (tok_needed <= 0) {
-        UE_LOG(LogGameAI, Display, TEXT("tokenize(size) failed (%d)"), tok_needed);
-        return "{}";
+    std::string SystemUtf8;
+    std::vector<llama_token> Tokens;
+    bool bBuilt = BuildPromptTokens(Job, Conv, SystemUtf8, Tokens);
+
+    // A long conversation drops its oldest turns until the prompt and the answer fit the sequence's window
+    const int32 Window = (int32)(cparams.n_ctx / FMath::Max<uint32>(1, cparams.n_seq_max));
+    while (bBuilt && Conv && Conv->Turns.Num() > 0 && (int32)Tokens.size() + Job.MaxNew > Window)
+    {
+        Conv->Turns.RemoveAt(0);
+        bBuilt = BuildPromptTokens(Job, Conv, SystemUtf8, Tokens);
+    }
+    if (!bBuilt) {
+        CompleteJob(Slot, Job, TEXT("{}"));
+        return;
     }
 
-    std::vector<llama_token> tokens((size_t)tok_needed);
-    int32_t tok_count = llama_tokenize(Vocab, templ.data(), templ_written, tokens.data(), (int32_t)tokens.size(), /*add_special*/ true, /*parse_special*/ true);
-    if (tok_count < 0) {
-        UE_LOG(LogGameAI, Display, TEXT("tokenize(write) failed (%d)"), tok_count);
-        return "{}";
+    // Grammar and schema cursor start before the prefill: the assistant prefix is decoded with the prompt
+    Seq->bConstrained = Seq->Grammar && CVarGrammarConstrained.GetValueOnAnyThread() != 0;
+    if (Seq->bConstrained) llama_sampler_reset(Seq->Grammar);
+    Seq->bJumpForward = CVarJumpForward.GetValueOnAnyThread() != 0;
+    std::vector<llama_token> PrefixTokens;
+    std::string PrefixText;
+    BuildAssistantPrefix(*Seq, Job, PrefixTokens, PrefixText);
+    Tokens.insert(Tokens.end(), PrefixTokens.begin(), PrefixTokens.end());
+
+    // 4) A conversation's sequence keeps what its last turn left there that this prompt still starts with. Otherwise the
+    //    system prefix goes into this job's sequence (restored from cache when possible). The rest is prefilled in chunks.
+    UE_LOG(LogGameAI, Display, TEXT("4) Decode prompt (ctx %d, seq %d)"), Slot.Index, Seq->SeqId);
+    if (Slot.NumActiveSequences == 0) ApplyPersona(Slot, Job.Persona);   // PopNextJob only admits the current persona otherwise
+    int32 NumReused = Conv ? ReuseConversation(Slot, *Seq, *Conv, Tokens) : 0;
+    if (NumReused == 0)
+    {
+        ClearSequence(Slot, Seq->SeqId);
+        if (Slot.NumActiveSequences == 0) ApplyPersona(Slot, Job.Persona);   // a full reset may have recreated the context
+        Slot.PrefillHandle = Job.Handle.Get();
+        NumReused = PrefillSystemPrefix(Slot, Seq->SeqId, SystemUtf8, Tokens);
+        Slot.PrefillHandle = nullptr;
+    }
+    if (NumReused < 0) {
+        if (Job.IsCancelled()) UE_LOG(LogGameAI, Display, TEXT("Job cancelled during prefill (ctx %d, seq %d)"), Slot.Index, Seq->SeqId);
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq->SeqId, -1, -1);
+        CompleteJob(Slot, Job, TEXT("{}"));
+        return;
     }
 
-    // 5) Decode prompt (logits only on last token)
-    UE_LOG(LogGameAI, Display, TEXT("5) Decode prompt"));
-    llama_batch prompt_batch = llama_batch_init(tok_count, /*embd*/ 0, /*n_seq_max*/ 1);
-    prompt_batch.n_tokens = tok_count;
-    for (int i = 0; i < tok_count; ++i) {
-        prompt_batch.token[i] = tokens[i];
-        prompt_batch.pos[i] = i;
-        prompt_batch.n_seq_id[i] = 1;
-        prompt_batch.seq_id[i][0] = 0;
-        prompt_batch.logits[i] = (i == tok_count - 1) ? 1 : 0;
+    if (Conv) Conv->bBusy = true;
+    Seq->Job = MoveTemp(Job);
+    Seq->bActive = true;
+    ++Slot.NumActiveSequences;
+
+    Seq->AdmitTime = AdmitTime;
+    Seq->bPrefilling = true;
+    Seq->NumPast = NumReused;
+    Seq->NumPrefillChunks = 0;
+    Seq->PrefillSeconds = 0.0;
+    Seq->NextToken = -1;
+    Seq->BatchIndex = -1;
+    Seq->OutTokens.clear();
+    Seq->OutTokens.reserve(Seq->Job.MaxNew);
+    Seq->Stream.clear();
+    Seq->Stream.reserve(1024);
+    Seq->LastLoggedLen = 0;
+    Seq->Json.Reset();
+    Seq->Scanner.Reset();
+    Seq->Forced.clear();
+    Seq->Rng.seed((uint32_t)(llama_time_us() & 0xFFFFFFFFu));
+    Seq->Sampler.Configure(Seq->Job.TopK, Seq->Job.TopP, Seq->Job.Temp);
+
+    // The prefix is part of the answer, it just was not generated
+    if (!PrefixText.empty()) AppendOutput(*Seq, PrefixText.data(), (int32)PrefixText.size());
+
+    Seq->PromptLen = (int32)Tokens.size();
+    Seq->PromptTokens = MoveTemp(Tokens);
+    Seq->bSpeculative = false;
+    Seq->Draft.clear();
+    Seq->Draft.reserve(MaxDraftTokens);
+    Seq->NumDrafted = 0;
+    Seq->NumAccepted = 0;
+}
+
+void LLamaRunnerAsync::PrefillNextChunk(FContextSlot& Slot)
+{
+    // Most important first, then oldest: a critical job admitted mid-way overtakes a long flavour prefill
+    FSequence* Next = nullptr;
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (!Seq.bActive || !Seq.bPrefilling) continue;
+        if (!Next || Seq.Job.Priority > Next->Job.Priority
+            || (Seq.Job.Priority == Next->Job.Priority && Seq.Job.Serial < Next->Job.Serial))
+        {
+            Next = &Seq;
+        }
+    }
+    if (!Next) return;
+    FSequence& Seq = *Next;
+
+    const int32 Total = Seq.PromptLen;
+    const int32 Chunk = CVarPrefillChunk.GetValueOnAnyThread();
+    const int32 End = Chunk > 0 ? FMath::Min(Total, Seq.NumPast + Chunk) : Total;
+
+    const double T0 = FPlatformTime::Seconds();
+    Slot.PrefillHandle = Seq.Job.Handle.Get();
+    const int32 dec = DecodeTokens(Slot, Seq.SeqId, Seq.PromptTokens, Seq.NumPast, End, /*bLogitsLast*/ End == Total);
+    Slot.PrefillHandle = nullptr;
+    Seq.PrefillSeconds += FPlatformTime::Seconds() - T0;
+    ++Seq.NumPrefillChunks;
+
+    if (dec != 0) {
+        if (!Seq.Job.IsCancelled()) UE_LOG(LogTemp, Error, TEXT("llama_decode(prompt) failed (%d), seq %d"), dec, Seq.SeqId);
+        CancelSequence(Slot, Seq);
+        return;
     }
+    Seq.NumPast = End;
+    if (End < Total) return;
 
+    UE_LOG(LogGameAI, Display, TEXT("Prefill: %d tokens in %d chunks, %.0f tok/s"), Total, Seq.NumPrefillChunks,
+        Seq.PrefillSeconds > 0.0 ? Total / Seq.PrefillSeconds : 0.0);
+    Seq.bPrefilling = false;
+    Seq.StartTime = FPlatformTime::Seconds();
 
-    // LlamaRunner.cpp
-    int dec;
+    // Speculation only for greedy jobs: verification then reproduces exactly the tokens plain greedy decoding picks
+    Seq.bSpeculative = Slot.DraftCtx && Seq.Sampler.GetMode() == FDirectorSampler::EMode::Greedy;
+    if (Seq.bSpeculative)
     {
-        FScopeLock Lock(&DecodeMutex);
-        dec = llama_decode(Ctx, prompt_batch);
+        // The draft has no prefix cache; its full prompt prefill is cheap next to the main model's
+        if (DecodeTokens(Slot, Seq.SeqId, Seq.PromptTokens, 0, Seq.PromptLen, /*bLogitsLast*/ false, Slot.DraftCtx) == 0)
+        {
+            Seq.DraftPast = Seq.PromptLen;
+        }
+        else
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Draft prefill failed (seq %d), decoding without speculation"), Seq.SeqId);
+            DropDraftSequence(Slot, Seq);
+        }
     }
+    if (Seq.Conversation.IsEmpty()) Seq.PromptTokens.clear();   // a conversation records them as its sequence's content
 
-    if (dec < 0) {
-        UE_LOG(LogTemp, Error, TEXT("llama_decode(prompt) failed (%d)"), dec);
-        llama_batch_free(prompt_batch);
-        return "{}";
+    // 5) First token comes straight from the prefill logits (the draft decode above went to its own context)
+    UE_LOG(LogGameAI, Display, TEXT("5) Generate (seq %d, %d active)"), Seq.SeqId, Slot.NumActiveSequences);
+    SampleNext(Slot, Seq, llama_get_logits_ith(Slot.Ctx, -1));
+}
+
+void LLamaRunnerAsync::StepSequences(FContextSlot& Slot)
+{
+    // Cancelled jobs leave before the batch is built, so they never cost another decode
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (Seq.bActive && Seq.Job.IsCancelled()) CancelSequence(Slot, Seq);
     }
 
-    // 6) Manual sampling setup
-    UE_LOG(LogGameAI, Display, TEXT("6) Manual sampling setup"));
-    const int n_vocab = llama_vocab_n_tokens(Vocab);
-    std::vector<float> work_logits((size_t)n_vocab);
-    std::vector<int>   idx((size_t)n_vocab);
-    std::iota(idx.begin(), idx.end(), 0);
-
-    std::mt19937 rng((uint32_t)(llama_time_us() & 0xFFFFFFFFu));
-    std::uniform_real_distribution<float> uni(0.0f, 1.0f);
-
-    auto greedy_pick = [&](const float* l)->int {
-        int best = 0;
-        float m = l[0];
-        for (int i = 1; i < n_vocab; ++i) if (l[i] > m) { m = l[i]; best = i; }
-        return best;
-        };
+    // 5b) One prefill chunk per step, so the generating sequences below never wait for a whole long prompt
+    PrefillNextChunk(Slot);
 
-    auto sample_topk_topp_temp = [&](const float* logits)->int {
-        // Copy logits
-        std::memcpy(work_logits.data(), logits, sizeof(float) * (size_t)n_vocab);
-
-        // Temperature
-        if (temp > 0.0f) {
-            const float invT = 1.0f / temp;
-            for (int i = 0; i < n_vocab; ++i) work_logits[i] *= invT;
-        }
-
-        // Top-k
-        int K = (top_k > 0) ? std::min(top_k, n_vocab) : n_vocab;
-        std::nth_element(idx.begin(), idx.begin() + K, idx.end(),
-            [&](int a, int b) { return work_logits[a] > work_logits[b]; });
-        idx.resize((size_t)K);
-
-        // Softmax over K (stable)
-        float maxl = -FLT_MAX;
-        for (int id : idx) maxl = std::max(maxl, work_logits[id]);
-        float sum = 0.0f;
-        for (int id : idx) { work_logits[id] = std::exp(work_logits[id] - maxl); sum += work_logits[id]; }
-        if (sum <= 0.0f) return idx[0];
-        for (int id : idx) work_logits[id] /= sum;
-
-        // Sort by prob desc
-        std::sort(idx.begin(), idx.end(), [&](int a, int b) { return work_logits[a] > work_logits[b]; });
-
-        // Top-p
-        if (top_p > 0.0f && top_p < 1.0f) {
-            float cum = 0.0f;
-            size_t cut = idx.size();
-            for (size_t j = 0; j < idx.size(); ++j) {
-                cum += work_logits[idx[j]];
-                if (cum >= top_p) { cut = j + 1; break; }
-            }
-            if (cut < idx.size()) idx.resize(cut);
-        }
-
-        // Sample
-        float r = uni(rng);
-        float acc = 0.0f;
-        int choice = idx.back();
-        for (int id : idx) { acc += work_logits[id]; if (r <= acc) { choice = id; break; } }
-        // restore idx size for next step
-        idx.resize((size_t)n_vocab);
-        std::iota(idx.begin(), idx.end(), 0);
-        return choice;
-        };
+    const double StepStart = FPlatformTime::Seconds();
 
+    // 6a) Greedy sequences get their draft proposals first
+    const int32 NumDraft = Slot.DraftCtx ? FMath::Clamp(CVarDraftTokens.GetValueOnAnyThread(), 0, MaxDraftTokens) : 0;
+    if (NumDraft > 0) DraftProposals(Slot, NumDraft);
 
+    // 6) Pack the pending token of every active sequence into one batch, followed by its draft or forced tokens if any.
+    // Draft rows all need logits for verification; forced rows only the last one, where sampling resumes.
+    Slot.StepBatch.n_tokens = 0;
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (!Seq.bActive || Seq.bPrefilling) continue;
+        const bool bVerify = !Seq.Draft.empty();
+        const std::vector<llama_token>& Extra = bVerify ? Seq.Draft : Seq.Forced;
+        const int32 First = Slot.StepBatch.n_tokens;
+        for (int32 i = 0; i <= (int32)Extra.size(); ++i)
+        {
+            const int32 n = Slot.StepBatch.n_tokens++;
+            Slot.StepBatch.token[n] = (i == 0) ? Seq.NextToken : Extra[i - 1];
+            Slot.StepBatch.pos[n] = Seq.NumPast + i;
+            Slot.StepBatch.n_seq_id[n] = 1;
+            Slot.StepBatch.seq_id[n][0] = Seq.SeqId;
+            Slot.StepBatch.logits[n] = (bVerify || i == (int32)Extra.size()) ? 1 : 0;
+        }
+        Seq.BatchIndex = bVerify ? First : Slot.StepBatch.n_tokens - 1;
+    }
+    if (Slot.StepBatch.n_tokens == 0) return;
 
+    int32 dec;
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        dec = llama_decode(Slot.Ctx, Slot.StepBatch);
+    }
+    if (dec != 0) {
+        // Shutdown aborted the step: the sequences are cancelled, not finished with half an answer
+        const bool bAborted = Slot.bAbortDecode.Load();
+        if (bAborted) UE_LOG(LogGameAI, Display, TEXT("Step aborted by shutdown, cancelling %d sequences"), Slot.NumActiveSequences);
+        else UE_LOG(LogTemp, Error, TEXT("llama_decode(step) failed (%d), finishing %d sequences"), dec, Slot.NumActiveSequences);
+        for (FSequence& Seq : Slot.Sequences) {
+            if (!Seq.bActive) continue;
+            if (bAborted) CancelSequence(Slot, Seq);
+            else if (!Seq.bPrefilling) FinishSequence(Slot, Seq);
+        }
+        return;
+    }
 
+    // 7) Each sequence samples from its own row, or verifies its draft against its rows
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (!Seq.bActive || Seq.bPrefilling) continue;
+        if (!Seq.Draft.empty())
+        {
+            VerifyDraft(Slot, Seq);
+            continue;
+        }
+        Seq.NumPast += 1 + (int32)Seq.Forced.size();
+        Seq.Forced.clear();
+        SampleNext(Slot, Seq, llama_get_logits_ith(Slot.Ctx, Seq.BatchIndex));
+    }
+    DecodeMicros += (int64)((FPlatformTime::Seconds() - StepStart) * 1e6);
+}
 
-    // 7) Generate loop
-    UE_LOG(LogGameAI, Display, TEXT("7) Generate loop"));
-    std::vector<llama_token> out_tokens;
-    out_tokens.reserve(max_new);
+void LLamaRunnerAsync::DraftProposals(FContextSlot& Slot, int32 K)
+{
+    const int n_vocab = llama_vocab_n_tokens(Vocab);
+    llama_batch& Batch = Slot.DraftBatch;
 
-    llama_batch step = llama_batch_init(/*capacity*/ 1, /*embd*/ 0, /*n_seq_max*/ 1);
-    int cur_pos = tok_count;
+    auto AddRow = [&Batch](FSequence& Seq, llama_token Token, int32 Pos, bool bLogits)
+        {
+            const int32 n = Batch.n_tokens++;
+            Batch.token[n] = Token;
+            Batch.pos[n] = Pos;
+            Batch.n_seq_id[n] = 1;
+            Batch.seq_id[n][0] = Seq.SeqId;
+            Batch.logits[n] = bLogits ? 1 : 0;
+            if (bLogits) Seq.DraftRow = n;
+        };
+    auto Decode = [&Slot, &Batch]()
+        {
+            FScopeLock Lock(&Slot.DecodeMutex);
+            return llama_decode(Slot.DraftCtx, Batch);
+        };
 
-    // Stream buffer + is JSON closed? detector
-    std::string stream;
-    stream.reserve(1024);
+    // Round 0: bring the draft up to NextToken (whatever it has not seen of the accepted output), propose d1.
+    // A sequence with forced tokens this step only catches up through them: the schema already knows what follows.
+    Batch.n_tokens = 0;
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        Seq.Draft.clear();
+        if (!Seq.bActive || !Seq.bSpeculative) continue;
 
-    auto json_done = [&](const std::string& s) -> bool { int depth = 0; bool in_q = false, escp = false, seen_open = false;
-    for (unsigned char ch : s) {
-        if (escp) { escp = false; continue; } if (ch == '\\') { escp = true; continue; }
-        if (ch == '"') { in_q = !in_q; continue; } 
-        if (in_q) continue; 
-        if (ch == '{') 
-        { 
-            ++depth; seen_open = true;
+        // no point drafting past the job's token budget
+        const int32 Room = Seq.Job.MaxNew - (int32)Seq.OutTokens.size() - 1;
+        if (Room <= 0) continue;
 
+        const int32 Last = Seq.NumPast + (int32)Seq.Forced.size();
+        const int32 CatchUp = Last - Seq.DraftPast + 1;
+        if (CatchUp < 1 || CatchUp > MaxDraftTokens + MaxForcedTokens + 2)
+        {
+            DropDraftSequence(Slot, Seq); // lost track (e.g. after a failed draft decode): finish without speculation
+            continue;
         }
-        else if (ch == '}') {
-            if (depth > 0) --depth; 
-            if (seen_open && depth == 0) { // log before returning 
-                UE_LOG(LogTemp, Display, TEXT("Exit Auto: %s"), *FString(s.c_str()));
-                return true; } } } 
-    return false; };
+        const bool bPropose = Seq.Forced.empty();
+        Seq.DraftRow = -1;
+        for (int32 Pos = Seq.DraftPast; Pos <= Last; ++Pos)
+        {
+            AddRow(Seq, Seq.OutTokens[(size_t)(Pos - Seq.PromptLen)], Pos, bPropose && Pos == Last);
+        }
+        Seq.DraftPast = Last + 1;
+        if (!bPropose) continue;
+        Seq.Draft.reserve((size_t)FMath::Min(K, Room));
+        Seq.Draft.push_back(-1); // placeholder, filled below
+    }
+    if (Batch.n_tokens == 0) return;
 
-    int LastLoggedLen = 0;
-    for (int i = 0; i < max_new; ++i) {
-        // Use last logits
-        const float* logits = llama_get_logits_ith(Ctx, -1);
-        if (!logits) {
-            UE_LOG(LogTemp, Error, TEXT("null logits pointer from llama_get_logits_ith"));
-            break;
+    if (Decode() != 0)
+    {
+        for (FSequence& Seq : Slot.Sequences)
+        {
+            if (Seq.bActive && Seq.bSpeculative) DropDraftSequence(Slot, Seq);
         }
+        return;
+    }
+    for (FSequence& Seq : Slot.Sequences)
+    {
+        if (Seq.Draft.empty()) continue;
+        Seq.Draft[0] = (llama_token)FDirectorSampler::Greedy(llama_get_logits_ith(Slot.DraftCtx, Seq.DraftRow), n_vocab);
+        if (Seq.Draft[0] < 0) Seq.Draft.clear();
+    }
 
-        // Pick token
-        int id = (temp <= 0.0f && top_k <= 1) ? greedy_pick(logits)
-            : sample_topk_topp_temp(logits);
-        if (id < 0 || id >= n_vocab) {
-            UE_LOG(LogTemp, Warning, TEXT("sampled invalid token id=%d, stopping"), id);
-            break;
+    // Rounds 1..K-1: one token per sequence per draft decode
+    for (int32 Round = 1; Round < K; ++Round)
+    {
+        Batch.n_tokens = 0;
+        for (FSequence& Seq : Slot.Sequences)
+        {
+            if ((int32)Seq.Draft.size() != Round || Round >= Seq.Job.MaxNew - (int32)Seq.OutTokens.size() - 1) continue;
+            if (llama_vocab_is_eog(Vocab, Seq.Draft.back())) continue;
+            AddRow(Seq, Seq.Draft.back(), Seq.NumPast + Round, true);
         }
-        if (llama_vocab_is_eog(Vocab, (llama_token)id)) break;
+        if (Batch.n_tokens == 0 || Decode() != 0) break; // a failed round just leaves shorter drafts
 
-        // Append piece to stream (for JSON stop check)
+        for (FSequence& Seq : Slot.Sequences)
         {
-            char piece[256];
-            int pn = llama_token_to_piece(Vocab, (llama_token)id, piece, sizeof(piece), 0, /*special*/ false);
-            if (pn > 0) stream.append(piece, piece + pn);
-            //UE_LOG(LogGameAI, Display, TEXT("%s"), UTF8_TO_TCHAR(piece));
-            FString LastPiece(piece);
+            if ((int32)Seq.Draft.size() != Round || Seq.DraftPast != Seq.NumPast + Round) continue;
+            const int32 Next = FDirectorSampler::Greedy(llama_get_logits_ith(Slot.DraftCtx, Seq.DraftRow), n_vocab);
+            Seq.DraftPast = Seq.NumPast + Round + 1;
+            if (Next >= 0) Seq.Draft.push_back((llama_token)Next);
         }
+    }
+}
+
+void LLamaRunnerAsync::VerifyDraft(FContextSlot& Slot, FSequence& Seq)
+{
+    // Row j holds the main model's logits after NextToken and the first j draft tokens. Walk the rows with exactly the
+    // pick/commit logic of plain decoding and stop at the first draft token the main model would not have produced.
+    const int32 NumDraft = (int32)Seq.Draft.size();
+    const int32 FirstRow = Seq.BatchIndex;
+    int32 Accepted = 0;
+
+    ++SpeculativeSteps;
+    DraftedTokens += NumDraft;
+    Seq.NumDrafted += NumDraft;
+
+    for (int32 j = 0; j <= NumDraft; ++j)
+    {
+        const int32 Id = PickToken(Slot, Seq, llama_get_logits_ith(Slot.Ctx, FirstRow + j));
+        if (Id < 0) { FinishSequence(Slot, Seq); break; }
+
+        ++Seq.NumPast; // the row's input token is now part of the accepted sequence
+        if (!EmitToken(Slot, Seq, (llama_token)Id)) break;
+        if (j == NumDraft || Id != Seq.Draft[j]) break;
+        ++Accepted;
+    }
+    AcceptedTokens += Accepted;
+    if (!Seq.bActive) return; // finished; FinishSequence already dropped both caches
+
+    Seq.NumAccepted += Accepted;
+    Seq.Draft.clear();
+
+    // Drop the KV cells of rejected draft tokens in both models (and anything a failed draft round left behind)
+    Seq.DraftPast = FMath::Min(Seq.DraftPast, Seq.NumPast);
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, Seq.NumPast, -1);
+        llama_memory_seq_rm(llama_get_memory(Slot.DraftCtx), Seq.SeqId, Seq.DraftPast, -1);
+    }
+    QueueForcedTokens(Slot, Seq);
+}
+
+void LLamaRunnerAsync::SampleNext(FContextSlot& Slot, FSequence& Seq, const float* logits)
+{
+    const int32 id = PickToken(Slot, Seq, logits);
+    if (id < 0) {
+        FinishSequence(Slot, Seq);
+        return;
+    }
+    if (EmitToken(Slot, Seq, (llama_token)id)) QueueForcedTokens(Slot, Seq);
+}
+
+int32 LLamaRunnerAsync::PickToken(FContextSlot& Slot, FSequence& Seq, const float* logits)
+{
+    if (!logits) {
+        UE_LOG(LogTemp, Error, TEXT("null logits pointer from llama_get_logits_ith"));
+        return -1;
+    }
 
+    // Pick token
+    const int n_vocab = llama_vocab_n_tokens(Vocab);
+    int id = Seq.Sampler.Sample(logits, n_vocab, Seq.Rng);
+    if (id < 0 || id >= n_vocab) {
+        UE_LOG(LogTemp, Warning, TEXT("sampled invalid token id=%d, stopping"), id);
+        return -1;
+    }
 
+    // Grammar: check the sampled token first; only mask the whole vocab and resample when it is rejected
+    if (Seq.bConstrained)
+    {
+        if (!GrammarAllows(Seq.Grammar, (llama_token)id, logits[id]))
+        {
+            const float* Masked = ApplyGrammarMask(Seq.Grammar, logits, n_vocab, Slot.GrammarCandidates, Slot.MaskedLogits);
+            id = Seq.Sampler.Sample(Masked, n_vocab, Seq.Rng);
+            if (id < 0 || Masked[id] == -INFINITY) {
+                UE_LOG(LogTemp, Warning, TEXT("grammar allows no token, stopping"));
+                return -1;
+            }
+        }
+    }
+    return id;
+}
 
-        out_tokens.push_back((llama_token)id);
+bool LLamaRunnerAsync::EmitToken(FContextSlot& Slot, FSequence& Seq, llama_token id, bool bForced)
+{
+    const FJob& Job = Seq.Job;
+    if (Seq.bConstrained) llama_sampler_accept(Seq.Grammar, id);
+    if (llama_vocab_is_eog(Vocab, id)) {
+        FinishSequence(Slot, Seq);
+        return false;
+    }
 
-        // --- log every 100 chars ---
-        if ((int)stream.size() - LastLoggedLen >= 100) {
-            FString Partial = UTF8_TO_TCHAR(stream.c_str());
-            UE_LOG(LogGameAI, Display, TEXT("[stream %d chars]: %s"), (int)stream.size(), *Partial);
-            LastLoggedLen = (int)stream.size();
+    // Append piece to stream (for JSON stop check)
+    {
+        char piece[256];
+        int pn = llama_token_to_piece(Vocab, (llama_token)id, piece, sizeof(piece), 0, /*special*/ false);
+        if (pn > 0) {
+            AppendOutput(Seq, piece, pn);
+            if (Seq.bJumpForward) Seq.Cursor.Feed(piece, pn);
         }
+    }
+    Seq.OutTokens.push_back(id);
+    ++TokensGenerated;
+
+    // --- log every 100 chars ---
+    if ((int)Seq.Stream.size() - Seq.LastLoggedLen >= 100) {
+        FString Partial = UTF8_TO_TCHAR(Seq.Stream.c_str());
+        UE_LOG(LogGameAI, Display, TEXT("[seq %d stream %d chars]: %s"), Seq.SeqId, (int)Seq.Stream.size(), *Partial);
+        Seq.LastLoggedLen = (int)Seq.Stream.size();
+    }
+
+    if (Seq.Json.IsClosed() || (int)Seq.OutTokens.size() >= Job.MaxNew) {
+        FinishSequence(Slot, Seq);
+        return false;
+    }
+
+    // Feed back in the next step
+    if (bForced) Seq.Forced.push_back(id);
+    else Seq.NextToken = id;
+    return true;
+}
+
+void LLamaRunnerAsync::AppendOutput(FSequence& Seq, const char* Bytes, int32 Len)
+{
+    const FJob& Job = Seq.Job;
+    Seq.Stream.append(Bytes, Bytes + Len);
+    Seq.Json.Feed(Bytes, Len);
+
+    // Streaming: raw text plus any dialogue line / tool call that closed in this piece
+    if (Job.Stream) {
+        Job.Stream->AppendUtf8(Bytes, Len);
+        TArray<FString> NewLines, NewTools;
+        Seq.Scanner.Feed(Bytes, Len, NewLines, NewTools);
+        for (FString& Line : NewLines) Job.Stream->AddDialogueLine(MoveTemp(Line));
+        for (FString& Tool : NewTools) Job.Stream->AddToolCall(MoveTemp(Tool));
+    }
+}
+
+// ---------- Jump-forward ----------
+void LLamaRunnerAsync::QueueForcedTokens(FContextSlot& Slot, FSequence& Seq)
+{
+    // Literals chain (closing the tool_calls array forces the dialogue key and its first key), so keep going until
+    // the cursor is free or this step's rows are used up
+    std::string Previous;
+    while (Seq.bActive && Seq.bJumpForward && (int32)Seq.Forced.size() < MaxForcedTokens)
+    {
+        const std::string Literal = Seq.Cursor.Forced();
+        if (Literal.empty() || Literal == Previous) return; // nothing forced, or the last run did not advance the cursor
+        Previous = Literal;
 
+        std::vector<llama_token> Tokens;
+        if (!TokenizeUtf8(Vocab, Literal, Tokens, /*bSpecial*/ false)) return;
+        for (llama_token Id : Tokens)
+        {
+            if ((int32)Seq.Forced.size() >= MaxForcedTokens) return;
+            // The grammar reads the literal in different tokens than the tokenizer split it into: sample instead
+            if (Seq.bConstrained && !GrammarAllows(Seq.Grammar, Id, 0.0f)) return;
+            ++ForcedTokens;
+            if (!EmitToken(Slot, Seq, Id, /*bForced*/ true)) return;
+        }
+    }
+}
 
-        if (json_done(stream)) break;
+void LLamaRunnerAsync::BuildAssistantPrefix(FSequence& Seq, const FJob& Job, std::vector<llama_token>& OutTokens, std::string& OutText)
+{
+    OutTokens.clear();
+    OutText.clear();
+
+    // The requested intent is forced only if it can sit in a JSON string as is
+    FTCHARToUTF8 IntentUtf8(*Job.Intent);
+    std::string Intent(IntentUtf8.Get(), IntentUtf8.Length());
+    if (Intent.find_first_of("\"\\") != std::string::npos) Intent.clear();
+    Seq.Cursor.Reset(Intent);
+
+    FTCHARToUTF8 CallerUtf8(*Job.AssistantPrefix);
+    std::string Text(CallerUtf8.Get(), CallerUtf8.Length());
+    const size_t CallerLen = Text.size();
+    if (Seq.bJumpForward)
+    {
+        // From an empty prefix this is {"intent":"<Intent>","reason":" - a couple of rounds cover the root
+        FDirectorSchemaCursor Probe = Seq.Cursor;
+        Probe.Feed(Text.data(), (int32)Text.size());
+        for (int32 Round = 0; Round < 4; ++Round)
+        {
+            const std::string Literal = Probe.Forced();
+            if (Literal.empty()) break;
+            Text += Literal;
+            Probe.Feed(Literal.data(), (int32)Literal.size());
+        }
+    }
+    if (Text.empty()) return;
 
-        // Feed back
-        step.n_tokens = 1;
-        step.token[0] = (llama_token)id;
-        step.pos[0] = cur_pos++;
-        step.n_seq_id[0] = 1;
-        step.seq_id[0][0] = 0;
-        step.logits[0] = 1;
+    std::vector<llama_token> Tokens;
+    if (!TokenizeUtf8(Vocab, Text, Tokens, /*bSpecial*/ false)) return;
 
-        if (llama_decode(Ctx, step) < 0) break;
+    size_t Bytes = 0;
+    for (llama_token Id : Tokens)
+    {
+        char Piece[256];
+        const int32 n = llama_token_to_piece(Vocab, Id, Piece, sizeof(Piece), 0, /*special*/ false);
+        if (n < 0) break;
+        if (Seq.bConstrained && !GrammarAllows(Seq.Grammar, Id, 0.0f))
+        {
+            if (Bytes >= CallerLen) break; // forced part, e.g. an intent the schema does not list: the model picks
+            UE_LOG(LogGameAI, Warning, TEXT("Assistant prefix does not fit the director grammar, seq %d decodes unconstrained"), Seq.SeqId);
+            Seq.bConstrained = false;
+        }
+        if (Seq.bConstrained) llama_sampler_accept(Seq.Grammar, Id);
+        OutTokens.push_back(Id);
+        OutText.append(Piece, (size_t)n);
+        Bytes += (size_t)n;
     }
+    Seq.Cursor.Feed(OutText.data(), (int32)OutText.size());
+}
 
+void LLamaRunnerAsync::FinishSequence(FContextSlot& Slot, FSequence& Seq)
+{
     // 8) Prefer stream (already text)
-    UE_LOG(LogGameAI, Display, TEXT("8) Prefer stream "));
-    std::string out_str = stream;
-    if (out_str.empty() && !out_tokens.empty()) {
-        out_str.assign(out_tokens.size() * 8, '\0');
-        int32_t w = llama_detokenize(Vocab, out_tokens.data(), (int32_t)out_tokens.size(),
+    std::string out_str = Seq.Stream;
+    if (out_str.empty() && !Seq.OutTokens.empty()) {
+        out_str.assign(Seq.OutTokens.size() * 8, '\0');
+        int32_t w = llama_detokenize(Vocab, Seq.OutTokens.data(), (int32_t)Seq.OutTokens.size(),
             out_str.data(), (int32_t)out_str.size(),
             /*remove_special*/ true, /*unparse_special*/ false);
         if (w > 0) out_str.resize((size_t)w); else out_str.clear();
     }
+    const double Elapsed = FPlatformTime::Seconds() - Seq.StartTime;
+    UE_LOG(LogGameAI, Display, TEXT("8) Seq %d done: %d tokens, %.1f tok/s%s"), Seq.SeqId, (int32)Seq.OutTokens.size(),
+        Elapsed > 0.0 ? Seq.OutTokens.size() / Elapsed : 0.0,
+        Seq.NumDrafted > 0 ? *FString::Printf(TEXT(", draft accepted %d/%d (%.0f%%)"), Seq.NumAccepted, Seq.NumDrafted, 100.0 * Seq.NumAccepted / Seq.NumDrafted) : TEXT(""));
+
+    // Admission to answer. The first request after a load pays whatever cold start is left, so it is kept apart
+    const int64 ServiceMicros = (int64)((FPlatformTime::Seconds() - Seq.AdmitTime) * 1e6);
+    if (!bFirstRequestDone.Exchange(true))
+    {
+        FirstRequestMicros = ServiceMicros;
+        UE_LOG(LogGameAI, Display, TEXT("First request after load: %.0f ms"), ServiceMicros / 1000.0);
+    }
+    else
+    {
+        SteadyRequestMicros += ServiceMicros;
+        ++SteadyRequests;
+    }
+
+    // Schema validation runs once, on the closed top-level object; a valid one is returned without surrounding noise
+    FString Output = out_str.empty() ? FString(TEXT("{}")) : FString(UTF8_TO_TCHAR(out_str.c_str()));
+    if (Seq.Json.IsClosed())
+    {
+        const std::string Object = Seq.Stream.substr((size_t)Seq.Json.ObjectStart, (size_t)(Seq.Json.ObjectEnd - Seq.Json.ObjectStart));
+        FString Clean, Err;
+        if (IsValidDirectorJSON(FString(UTF8_TO_TCHAR(Object.c_str())), Clean, Err))
+        {
+            UE_LOG(LogGameAI, Display, TEXT("Exit (valid JSON): %s"), *Clean);
+            if (Seq.Job.CacheKey != 0 && !Seq.Job.IsCancelled())
+            {
+                DecisionCache.Add(Seq.Job.CacheKey, Clean, Seq.Job.CacheTtl);
+                if (Seq.Job.SemanticGroup != 0 && !Seq.Embedding.empty())
+                {
+                    SemanticIndex.Add(Seq.Job.SemanticGroup, Seq.Embedding.data(), Clean, Seq.Job.CacheTtl);
+                }
+            }
+            Output = MoveTemp(Clean);
+        }
+        else
+        {
+            UE_LOG(LogGameAI, Warning, TEXT("Closed JSON failed validation: %s"), *Err);
+        }
+    }
+
+    // 9) Free the sequence for the next job; a conversation's pinned sequence keeps its KV for the next turn
+    if (!Seq.Job.Conversation.IsEmpty())
+    {
+        EndConversationTurn(Slot, Seq, Seq.Job, /*bCompleted*/ !Seq.Job.IsCancelled());
+    }
+    else
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, -1, -1);
+    }
+    DropDraftSequence(Slot, Seq);
+    Seq.bActive = false;
+    Seq.NextToken = -1;
+    Seq.BatchIndex = -1;
+    --Slot.NumActiveSequences;
+
+    FJob Job = MoveTemp(Seq.Job);
+    Seq.Job = FJob();
+    CompleteJob(Slot, Job, MoveTemp(Output));
+}
+
+void LLamaRunnerAsync::CancelSequence(FContextSlot& Slot, FSequence& Seq)
+{
+    UE_LOG(LogGameAI, Display, TEXT("Seq %d cancelled after %d tokens"), Seq.SeqId, (int32)Seq.OutTokens.size());
+    {
+        FScopeLock Lock(&Slot.DecodeMutex);
+        llama_memory_seq_rm(llama_get_memory(Slot.Ctx), Seq.SeqId, -1, -1);
+    }
+    DropDraftSequence(Slot, Seq);
+    if (!Seq.Job.Conversation.IsEmpty()) EndConversationTurn(Slot, Seq, Seq.Job, /*bCompleted*/ false);
+    Seq.bActive = false;
+    Seq.bPrefilling = false;
+    Seq.PromptTokens.clear();
+    Seq.NextToken = -1;
+    Seq.BatchIndex = -1;
+    --Slot.NumActiveSequences;
+
+    FJob Job = MoveTemp(Seq.Job);
+    Seq.Job = FJob();
+    CompleteJob(Slot, Job, TEXT("{}"));
+}
+
+bool LLamaRunnerAsync::AbortDecodeCallback(void* SlotPtr)
+{
+    const FContextSlot* Slot = static_cast<const FContextSlot*>(SlotPtr);
+    return Slot->bAbortDecode.Load() || (Slot->PrefillHandle && Slot->PrefillHandle->IsCancelled());
+}
+
+void LLamaRunnerAsync::CompleteJob(FContextSlot& Slot, FJob& Job, FString Output)
+{
+    --Slot.Load;
+    ForgetInFlight(Job);
+    if (!Job.OnDone) return;
+
+    if (Job.bCompleteOnWorker)
+    {
+        Job.OnDone(MoveTemp(Output));
+        return;
+    }
+
+    AsyncTask(ENamedThreads::GameThread,
+        [OnDone = MoveTemp(Job.OnDone), Output = MoveTemp(Output)]() mutable
+        {
+            OnDone(Output);
+        });
+}
+
+// ---------- Synchronous GenerateJSON ----------
+FString LLamaRunnerAsync::GenerateJSON(const FString& Prompt, int max_new, int top_k, float top_p, float temp,FString Intent)
+{
+    if (bLoading && LoadFuture.IsValid()) LoadFuture.Wait();
+    if (!IsInitialized() || Slots.Num() == 0) {
+        UE_LOG(LogGameAI, Display, TEXT("LlamaRunner not initialized"));
+        return "{}";
+    }
+    check(!IsWorkerThread());
+
+    // Shared with the job so a completion racing a shutdown never writes into a dead stack frame
+    struct FSyncResult
+    {
+        FString Output;
+        FEvent* Done = FPlatformProcess::GetSynchEventFromPool(true);
+        ~FSyncResult() { FPlatformProcess::ReturnSynchEventToPool(Done); }
+    };
+    TSharedRef<FSyncResult, ESPMode::ThreadSafe> Result = MakeShared<FSyncResult, ESPMode::ThreadSafe>();
 
-    // 9) Cleanup
-    llama_batch_free(step);
-    llama_batch_free(prompt_batch);
+    FJob Job;
+    Job.Prompt = Prompt;
+    Job.Intent = Intent;
+    Job.MaxNew = max_new;
+    Job.TopK = top_k;
+    Job.TopP = top_p;
+    Job.Temp = temp;
+    Job.bCompleteOnWorker = true;
+    Job.OnDone = [Result](FString Output)
+        {
+            Result->Output = MoveTemp(Output);
+            Result->Done->Trigger();
+        };
+    Dispatch(MoveTemp(Job));
 
-    if (out_str.empty()) return "{}";
-    return FString(out_str.c_str());
+    while (!Result->Done->Wait(100))
+    {
+        if (!IsInitialized() || Slots.Num() == 0) return "{}";
+    }
+    return Result->Output;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 ﻿#pragma once
 #include "LlamaRunner.h"
 #include "HAL/Platform.h"
+#include "HAL/IConsoleManager.h"
+#include "DirectorTuning.h"
 
 #if PLATFORM_WINDOWS
 #include "Windows/AllowWindowsPlatformTypes.h"
@@ -20,6 +22,12 @@ static bool TryLoad(const TCHAR* DllName, bool bRequired = true)
     FPlatformProcess::FreeDllHandle(Handle);
     return true;
 }
+// Batch settings are shared with LLamaRunnerAsync, which registers the cvars (0 = unset)
+static int32 GetSharedCVarInt(const TCHAR* Name)
+{
+    IConsoleVariable* Var = IConsoleManager::Get().FindConsoleVariable(Name);
+    return Var ? Var->GetInt() : 0;
+}
 static void LlamaLog(ggml_log_level level, const char* msg, void*) {
     UE_LOG(LogTemp, Warning, TEXT("[llama] %hs"), msg);
 }
@@ -112,6 +120,18 @@ bool LlamaRunner::Initiate(const FString& ModelPath, int32 ContextSize)
     cparams.n_ctx = FMath::Max(256, ContextSize);
    
     cparams.n_threads = FPlatformMisc::NumberOfCores(); // optional: CPU threads
+    if (GetSharedCVarInt(TEXT("GameDirector.BatchSize")) > 0) cparams.n_batch = (uint32_t)GetSharedCVarInt(TEXT("GameDirector.BatchSize"));
+    if (GetSharedCVarInt(TEXT("GameDirector.UBatchSize")) > 0) cparams.n_ubatch = (uint32_t)GetSharedCVarInt(TEXT("GameDirector.UBatchSize"));
+
+    // Tuned profile for this machine + model (GameDirector.Autotune); an explicit UBatchSize still wins
+    FDirectorTuneProfile Tuned;
+    if (FDirectorTuning::Resolve(Model, cparams, 1, Tuned))
+    {
+        cparams.n_threads = Tuned.NumThreads;
+        cparams.n_threads_batch = Tuned.NumThreadsBatch;
+        if (GetSharedCVarInt(TEXT("GameDirector.UBatchSize")) <= 0) cparams.n_ubatch = (uint32_t)Tuned.UBatch;
+    }
+    cparams.n_ubatch = FMath::Min(cparams.n_ubatch, cparams.n_batch);
 
     Ctx = llama_new_context_with_model(Model, cparams);
     if (!Ctx)
@@ -121,6 +141,7 @@ bool LlamaRunner::Initiate(const FString& ModelPath, int32 ContextSize)
         llama_backend_free();
         return false;
     }
+    if (Threadpools.Create((int32)cparams.n_threads, (int32)cparams.n_threads_batch)) Threadpools.Attach(Ctx);
 
     Vocab = llama_model_get_vocab(Model);
 
@@ -348,27 +369,30 @@ FString LlamaRunner::GenerateJSON(const FString& Prompt, int maxNew, int top_k,
         return "{}";
     }
 
-    // 5) Decode prompt (logits only on last token)
+    // 5) Decode prompt in chunks of at most n_batch tokens (logits only on last token); the lock is released
+    // between chunks
     UE_LOG(LogTemp, Error, TEXT("5) Decode prompt"));
-    llama_batch prompt_batch = llama_batch_init(tok_count, /*embd*/ 0, /*n_seq_max*/ 1);
-    prompt_batch.n_tokens = tok_count;
-    for (int i = 0; i < tok_count; ++i) {
-        prompt_batch.token[i] = tokens[i];
-        prompt_batch.pos[i] = i;
-        prompt_batch.n_seq_id[i] = 1;
-        prompt_batch.seq_id[i][0] = 0;
-        prompt_batch.logits[i] = (i == tok_count - 1) ? 1 : 0;
-    }
-
+    const int32 ChunkSetting = GetSharedCVarInt(TEXT("GameDirector.PrefillChunk"));
+    const int32 max_chunk = FMath::Max(1, FMath::Min((int32)llama_n_batch(Ctx), ChunkSetting > 0 ? ChunkSetting : tok_count));
+    llama_batch prompt_batch = llama_batch_init(FMath::Min(tok_count, max_chunk), /*embd*/ 0, /*n_seq_max*/ 1);
+
+    int dec = 0;
+    for (int start = 0; start < tok_count && dec == 0; start += max_chunk) {
+        const int n = FMath::Min(max_chunk, tok_count - start);
+        prompt_batch.n_tokens = n;
+        for (int i = 0; i < n; ++i) {
+            prompt_batch.token[i] = tokens[start + i];
+            prompt_batch.pos[i] = start + i;
+            prompt_batch.n_seq_id[i] = 1;
+            prompt_batch.seq_id[i][0] = 0;
+            prompt_batch.logits[i] = (start + i == tok_count - 1) ? 1 : 0;
+        }
 
-    // LlamaRunner.cpp
-    int dec;
-    {
         FScopeLock Lock(&DecodeMutex);
         dec = llama_decode(Ctx, prompt_batch);
     }
 
-    if (dec < 0) {
+    if (dec != 0) {
         UE_LOG(LogTemp, Error, TEXT("llama_decode(prompt) failed (%d)"), dec);
         llama_batch_free(prompt_batch);
         return "{}";
@@ -377,68 +401,10 @@ FString LlamaRunner::GenerateJSON(const FString& Prompt, int maxNew, int top_k,
     // 6) Manual sampling setup
     UE_LOG(LogTemp, Error, TEXT("6) Manual sampling setup"));
     const int n_vocab = llama_vocab_n_tokens(Vocab);
-    std::vector<float> work_logits((size_t)n_vocab);
-    std::vector<int>   idx((size_t)n_vocab);
-    std::iota(idx.begin(), idx.end(), 0);
+    FDirectorSampler Sampler;
+    Sampler.Configure(top_k, top_p, temp);
 
     std::mt19937 rng((uint32_t)(llama_time_us() & 0xFFFFFFFFu));
-    std::uniform_real_distribution<float> uni(0.0f, 1.0f);
-
-    auto greedy_pick = [&](const float* l)->int {
-        int best = 0;
-        float m = l[0];
-        for (int i = 1; i < n_vocab; ++i) if (l[i] > m) { m = l[i]; best = i; }
-        return best;
-        };
-
-    auto sample_topk_topp_temp = [&](const float* logits)->int {
-        // Copy logits
-        std::memcpy(work_logits.data(), logits, sizeof(float) * (size_t)n_vocab);
-
-        // Temperature
-        if (temp > 0.0f) {
-            const float invT = 1.0f / temp;
-            for (int i = 0; i < n_vocab; ++i) work_logits[i] *= invT;
-        }
-
-        // Top-k
-        int K = (top_k > 0) ? std::min(top_k, n_vocab) : n_vocab;
-        std::nth_element(idx.begin(), idx.begin() + K, idx.end(),
-            [&](int a, int b) { return work_logits[a] > work_logits[b]; });
-        idx.resize((size_t)K);
-
-        // Softmax over K (stable)
-        float maxl = -FLT_MAX;
-        for (int id : idx) maxl = std::max(maxl, work_logits[id]);
-        float sum = 0.0f;
-        for (int id : idx) { work_logits[id] = std::exp(work_logits[id] - maxl); sum += work_logits[id]; }
-        if (sum <= 0.0f) return idx[0];
-        for (int id : idx) work_logits[id] /= sum;
-
-        // Sort by prob desc
-        std::sort(idx.begin(), idx.end(), [&](int a, int b) { return work_logits[a] > work_logits[b]; });
-
-        // Top-p
-        if (top_p > 0.0f && top_p < 1.0f) {
-            float cum = 0.0f;
-            size_t cut = idx.size();
-            for (size_t j = 0; j < idx.size(); ++j) {
-                cum += work_logits[idx[j]];
-                if (cum >= top_p) { cut = j + 1; break; }
-            }
-            if (cut < idx.size()) idx.resize(cut);
-        }
-
-        // Sample
-        float r = uni(rng);
-        float acc = 0.0f;
-        int choice = idx.back();
-        for (int id : idx) { acc += work_logits[id]; if (r <= acc) { choice = id; break; } }
-        // restore idx size for next step
-        idx.resize((size_t)n_vocab);
-        std::iota(idx.begin(), idx.end(), 0);
-        return choice;
-        };
 
     // 7) Generate loop
     UE_LOG(LogTemp, Error, TEXT("7) Generate loop"));
@@ -451,29 +417,7 @@ FString LlamaRunner::GenerateJSON(const FString& Prompt, int maxNew, int top_k,
     // Stream buffer + “is JSON closed?” detector
     std::string stream;
     stream.reserve(1024);
-    auto json_done = [&](const std::string& s) -> bool {
-        int depth = 0;
-        bool in_q = false, escp = false, seen_open = false;
-        for (unsigned char ch : s) {
-            if (escp) { escp = false; continue; }
-            if (ch == '\\') { escp = true; continue; }
-            if (ch == '"') { in_q = !in_q; continue; }
-            if (in_q) continue;
-            if (ch == '{') {
-                ++depth;
-                seen_open = true;
-            }
-            else if (ch == '}') {
-                if (depth > 0) --depth;
-                if (seen_open && depth == 0) {
-                    // log before returning
-                    UE_LOG(LogTemp, Display, TEXT("Exit Auto: %s"), *FString(s.c_str()));
-                    return true;
-                }
-            }
-        }
-        return false;
-        };
+    FJsonStreamTracker json;
 
     for (int i = 0; i < maxNew; ++i) {
         // Use last logits
@@ -484,8 +428,7 @@ FString LlamaRunner::GenerateJSON(const FString& Prompt, int maxNew, int top_k,
         }
 
         // Pick token
-        int id = (temp <= 0.0f && top_k <= 1) ? greedy_pick(logits)
-            : sample_topk_topp_temp(logits);
+        int id = Sampler.Sample(logits, n_vocab, rng);
         if (id < 0 || id >= n_vocab) {
             UE_LOG(LogTemp, Warning, TEXT("sampled invalid token id=%d, stopping"), id);
             break;
@@ -496,14 +439,20 @@ FString LlamaRunner::GenerateJSON(const FString& Prompt, int maxNew, int top_k,
         {
             char piece[256];
             int pn = llama_token_to_piece(Vocab, (llama_token)id, piece, sizeof(piece), 0, /*special*/ false);
-            if (pn > 0) stream.append(piece, piece + pn);
+            if (pn > 0) {
+                stream.append(piece, piece + pn);
+                json.Feed(piece, pn);
+            }
             FString LastPiece(piece);
         }
 
 
 
         out_tokens.push_back((llama_token)id);
-        if (json_done(stream)) break;
+        if (json.IsClosed()) {
+            UE_LOG(LogTemp, Display, TEXT("Exit Auto: %s"), UTF8_TO_TCHAR(stream.c_str()));
+            break;
+        }
 
         // Feed back
         step.n_tokens = 1;
@@ -537,6 +486,7 @@ FString LlamaRunner::GenerateJSON(const FString& Prompt, int maxNew, int top_k,
 void LlamaRunner::Shutdown()
 {
     if (Ctx) { llama_free(Ctx);   Ctx = nullptr; }
+    Threadpools.Free();
     if (Model) { llama_free_model(Model); Model = nullptr; }
     Vocab = nullptr;
 
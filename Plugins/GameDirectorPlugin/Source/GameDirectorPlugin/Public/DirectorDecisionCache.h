@@ -0,0 +1,49 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "Containers/LruCache.h"
+
+// Bounded LRU of validated director decisions, keyed by a hash of model, prompt, intent, assistant prefix and
+// sampling parameters. Only objects that passed IsValidDirectorJSON go in. Every entry carries its own expiry, so
+// designers can ask for short-lived entries where they want variety. Thread-safe: looked up on the game thread, filled by the workers.
+// Persisted as a small binary file under Saved/ so it survives restarts.
+class FDirectorDecisionCache
+{
+public:
+    explicit FDirectorDecisionCache(int32 InMaxEntries = 256);
+
+    static uint64 MakeKey(uint64 ModelKey, const FString& Prompt, const FString& Intent, const FString& AssistantPrefix, int32 MaxNew, int32 TopK, float TopP, float Temp);
+
+    // Returns false on a miss or an expired entry (which is dropped)
+    bool Find(uint64 Key, FString& OutJson);
+    void Add(uint64 Key, const FString& Json, double TtlSeconds);
+
+    // Resizes the LRU; entries beyond the new bound are evicted oldest first
+    void SetMaxEntries(int32 InMaxEntries);
+    void Empty();
+
+    bool Load(const FString& Path);
+    bool Save(const FString& Path);
+    bool IsDirty() const { return bDirty; }
+
+    static FString DefaultPath();
+
+    int64 GetHits() const { return Hits.Load(); }
+    int64 GetMisses() const { return Misses.Load(); }
+
+private:
+    struct FEntry
+    {
+        FString Json;
+        int64   ExpiresUnix = 0;    // UTC seconds
+    };
+
+    FCriticalSection Mutex;
+    TLruCache<uint64, FEntry> Entries;
+    int32 MaxEntries = 256;
+    bool  bDirty = false;
+
+    TAtomic<int64> Hits{ 0 };
+    TAtomic<int64> Misses{ 0 };
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+// One quantization of the director model on disk, with what the quantize commandlet measured for it
+struct FDirectorModelVariant
+{
+    FString Quant;                  // "F16" for the source model, else the llama.cpp type name (Q8_0, Q5_K_M, ...)
+    FString Path;
+    int64 SizeBytes = 0;
+
+    // From the report; Validity < 0 = not measured
+    float Validity = -1.f;          // share of dataset prompts that produced a valid director JSON
+    float MeanMs = 0.f;
+    float P95Ms = 0.f;
+};
+
+// Picks which quantization of the director model to load. Variants live next to the source model as
+// <stem>.<Quant>.gguf (see UGameDirectorQuantizeCommandlet) and are tried from highest to lowest precision;
+// the first one that fits in free RAM, and did not fall below GameDirector.ModelMinValidity in the
+// commandlet's report, wins. GameDirector.ModelQuant forces a specific one.
+class FDirectorModelSelector
+{
+public:
+    // Highest precision first; the source model is always listed first as "F16"
+    static const TArray<FString>& QuantNames();
+
+    // Where the commandlet writes the Quant variant of SourcePath
+    static FString VariantPath(const FString& SourcePath, const FString& Quant);
+    static FString ReportPath(const FString& SourcePath);
+
+    // Variants that exist on disk, in QuantNames() order, with report data merged in
+    static TArray<FDirectorModelVariant> FindVariants(const FString& SourcePath);
+
+    // Path to load; SourcePath when no variant fits or none exist
+    static FString Select(const FString& SourcePath);
+
+    static bool SaveReport(const FString& SourcePath, const TArray<FDirectorModelVariant>& Variants);
+    static bool LoadReport(const FString& SourcePath, TArray<FDirectorModelVariant>& OutVariants);
+};
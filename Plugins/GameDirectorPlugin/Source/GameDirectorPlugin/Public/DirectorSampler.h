@@ -0,0 +1,45 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include <random>
+
+// Allocation-free token sampler shared by LlamaRunner and LLamaRunnerAsync.
+// The variant (greedy / top-k / top-k + top-p) is picked once per request in Configure(). Sample() then makes a
+// single vectorized pass over the raw logits to collect the top K, and temperature, softmax and top-p only touch those K.
+class FDirectorSampler
+{
+public:
+    enum class EMode : uint8 { Greedy, TopK, TopKTopP };
+
+    // Upper bound on K. top_k <= 0 ("whole vocab") is clamped to this; at the temperatures the director
+    // runs at, the probability mass below the top 256 logits is negligible.
+    static constexpr int32 MaxTopK = 256;
+
+    void Configure(int32 TopK, float TopP, float Temp);
+    EMode GetMode() const { return Mode; }
+
+    // Returns the sampled token id, or -1 if every logit is -INFINITY (e.g. fully masked by a grammar)
+    int32 Sample(const float* Logits, int32 NumVocab, std::mt19937& Rng);
+
+    // Vectorized argmax, first index wins on ties. -1 if every logit is -INFINITY.
+    static int32 Greedy(const float* Logits, int32 NumVocab);
+
+private:
+    struct FCandidate
+    {
+        float Logit;
+        int32 Id;
+    };
+
+    // Keeps the K largest logits in a min-heap (Top[0] = smallest kept). Returns how many were found.
+    int32 SelectTopK(const float* Logits, int32 NumVocab);
+
+    EMode Mode = EMode::Greedy;
+    int32 K = 1;
+    float TopP = 1.0f;
+    float InvTemp = 1.0f;
+
+    // fixed-size scratch, nothing is allocated per token
+    FCandidate Top[MaxTopK];
+    float      Probs[MaxTopK];
+};
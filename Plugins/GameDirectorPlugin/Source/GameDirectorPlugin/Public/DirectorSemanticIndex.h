@@ -0,0 +1,50 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+
+// Validated director decisions looked up by prompt embedding instead of by exact prompt, so "enters CitySquare at
+// midday" can reuse the answer to "enters CitySquare at noon". Vectors are L2-normalized on the way in, which makes
+// cosine similarity a dot product; they sit in one contiguous array (rows padded to 4 floats) and a lookup is a
+// linear SIMD scan, well under a millisecond for a few hundred entries. Only entries of the same group (weights,
+// persona, intent, assistant prefix and sampling: everything but the prompt) are compared.
+// Bounded: when full the least recently used entry is replaced. Thread-safe; in memory only.
+class FDirectorSemanticIndex
+{
+public:
+    // Drops every entry; vectors added afterwards must have InDims floats
+    void Reset(int32 InDims, int32 InMaxEntries);
+    int32 GetDims() const { return Dims; }
+
+    // Most similar live entry of Group, if its similarity reaches Threshold
+    bool Find(uint64 Group, const float* Embedding, float Threshold, FString& OutJson, float& OutSimilarity);
+    void Add(uint64 Group, const float* Embedding, const FString& Json, double TtlSeconds);
+
+    int32 Num() const;
+    int64 GetHits() const { return Hits.Load(); }
+    int64 GetMisses() const { return Misses.Load(); }
+
+private:
+    struct FEntry
+    {
+        uint64  Group = 0;
+        FString Json;
+        int64   ExpiresUnix = 0;    // UTC seconds
+        uint64  LastUse = 0;
+    };
+
+    // Normalized, zero-padded copy of Embedding into Out (Stride floats)
+    void Normalize(const float* Embedding, float* Out) const;
+    static float Dot(const float* A, const float* B, int32 Stride);
+
+    mutable FCriticalSection Mutex;
+    TArray<FEntry> Entries;
+    TArray<float>  Vectors;         // Entries.Num() rows of Stride floats
+    int32  Dims = 0;
+    int32  Stride = 0;
+    int32  MaxEntries = 0;
+    uint64 UseClock = 0;
+
+    TAtomic<int64> Hits{ 0 };
+    TAtomic<int64> Misses{ 0 };
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GameFramework/SaveGame.h"
+#include "DirectorSessionSave.generated.h"
+
+// The director's part of a save game, written to its own slot next to the game's (see
+// UGameDirectorSubsystem::SaveDirectorSession). RunnerState is LLamaRunnerAsync::ExportSession's blob; it carries
+// its own model key, so a save made with other weights is simply not restored.
+UCLASS()
+class GAMEDIRECTORPLUGIN_API UDirectorSessionSave : public USaveGame
+{
+    GENERATED_BODY()
+
+public:
+    UPROPERTY()
+    TArray<uint8> RunnerState;
+
+    // For the log only
+    UPROPERTY()
+    FString ModelFile;
+
+    UPROPERTY()
+    FDateTime SavedAt;
+};
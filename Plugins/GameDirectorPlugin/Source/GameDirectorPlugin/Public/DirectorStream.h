@@ -0,0 +1,80 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/CriticalSection.h"
+#include "Misc/ScopeLock.h"
+#include <string>
+
+// Output of one streaming job that the game thread has not picked up yet.
+// The runner's worker appends per token; the subsystem drains it once per frame, so there is no game-thread
+// hop per token.
+struct FDirectorStream
+{
+    // Worker side
+    void AppendUtf8(const char* Bytes, int32 Len)
+    {
+        FScopeLock Lock(&Mutex);
+        Pending.append(Bytes, (size_t)Len);
+    }
+
+    void AddDialogueLine(FString Line)
+    {
+        FScopeLock Lock(&Mutex);
+        PendingLines.Add(MoveTemp(Line));
+    }
+
+    void AddToolCall(FString RawJson)
+    {
+        FScopeLock Lock(&Mutex);
+        PendingToolCalls.Add(MoveTemp(RawJson));
+    }
+
+    // Game thread side. Moves out everything ready so far; returns false if there was nothing.
+    // A UTF-8 sequence split across two tokens stays buffered until its last byte arrives.
+    bool Drain(FString& OutDelta, TArray<FString>& OutLines, TArray<FString>& OutToolCalls)
+    {
+        std::string Bytes;
+        {
+            FScopeLock Lock(&Mutex);
+            const size_t Ready = CompleteUtf8Prefix(Pending);
+            Bytes.assign(Pending, 0, Ready);
+            Pending.erase(0, Ready);
+            OutLines = MoveTemp(PendingLines);
+            PendingLines.Reset();
+            OutToolCalls = MoveTemp(PendingToolCalls);
+            PendingToolCalls.Reset();
+        }
+
+        OutDelta.Reset();
+        if (!Bytes.empty())
+        {
+            FUTF8ToTCHAR Conv(Bytes.data(), (int32)Bytes.size());
+            OutDelta = FString(Conv.Length(), Conv.Get());
+        }
+        return !OutDelta.IsEmpty() || OutLines.Num() > 0 || OutToolCalls.Num() > 0;
+    }
+
+    int32 NumLinesDelivered = 0;     // game thread only
+    int32 NumToolCallsDelivered = 0; // game thread only
+
+private:
+    // Length of S without a trailing, not yet complete UTF-8 sequence
+    static size_t CompleteUtf8Prefix(const std::string& S)
+    {
+        const size_t N = S.size();
+        for (size_t Back = 1; Back <= 4 && Back <= N; ++Back)
+        {
+            const unsigned char c = (unsigned char)S[N - Back];
+            if ((c & 0xC0) == 0x80) continue; // continuation byte, keep walking back to the lead byte
+
+            const size_t Need = (c < 0x80) ? 1 : ((c >> 5) == 0x6) ? 2 : ((c >> 4) == 0xE) ? 3 : ((c >> 3) == 0x1E) ? 4 : 1;
+            return (Back >= Need) ? N : N - Back;
+        }
+        return N;
+    }
+
+    FCriticalSection Mutex;
+    std::string      Pending;
+    TArray<FString>  PendingLines;
+    TArray<FString>  PendingToolCalls;
+};
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct ggml_threadpool;
+struct llama_context;
+
+// Dedicated ggml compute threads for one llama_context, so inference does not spawn ad-hoc threads that compete
+// with the game, render and task-graph threads. Decode steps (n_threads) and prompt prefill (n_threads_batch) get
+// separate pools, each restricted to a CPU mask (GameDirector.ThreadAffinity / ThreadAffinityBatch) and run at
+// GameDirector.ThreadPriority. Set the cvars per platform in [SystemSettings] of <Platform>Engine.ini.
+struct FDirectorThreadpools
+{
+    ggml_threadpool* Decode = nullptr;
+    ggml_threadpool* Batch = nullptr;
+
+    FDirectorThreadpools() = default;
+    ~FDirectorThreadpools() { Free(); }
+    UE_NONCOPYABLE(FDirectorThreadpools);
+
+    // Share / NumShares: contexts that decode side by side each take a disjoint slice of the masked CPUs.
+    // False when GameDirector.ThreadPool is 0 or ggml could not start the threads; llama.cpp then uses its own.
+    bool Create(int32 NumThreads, int32 NumThreadsBatch, int32 Share = 0, int32 NumShares = 1);
+
+    // Every context sharing these pools must decode on the same thread (e.g. a slot's main and draft context)
+    void Attach(llama_context* Ctx) const;
+
+    // Call after the contexts using the pools were freed or detached
+    void Free();
+
+    bool IsValid() const { return Decode != nullptr && Batch != nullptr; }
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "CoreMinimal.h"
+
+struct llama_model;
+struct llama_context_params;
+
+// Thread counts and physical batch size that decode fastest on this machine for one model
+struct FDirectorTuneProfile
+{
+    int32 NumThreads = 0;           // n_threads, used by single-token decode steps
+    int32 NumThreadsBatch = 0;      // n_threads_batch, used by prompt prefill
+    int32 UBatch = 0;               // n_ubatch
+
+    bool IsValid() const { return NumThreads > 0 && NumThreadsBatch > 0 && UBatch > 0; }
+};
+
+// Startup autotuner shared by both runners. A short prefill + decode micro-benchmark sweeps n_threads,
+// n_threads_batch and n_ubatch on a scratch context; the winner is stored in Saved/Config/GameDirectorTuning.ini
+// under a section per machine, model and pool size, and reused by later Initiate() calls (GameDirector.Autotune).
+class FDirectorTuning
+{
+public:
+    // Identifies the loaded weights (description, size, parameter count); also keys the decision cache
+    static uint64 ModelKey(const llama_model* Model);
+
+    // Returns the stored profile, or runs the benchmark and stores its result, as GameDirector.Autotune says.
+    // NumContexts = contexts that will decode side by side, each gets an equal share of the cores.
+    // False if there is no profile to apply (autotune off and nothing stored, or the benchmark failed).
+    static bool Resolve(llama_model* Model, const llama_context_params& BaseParams, int32 NumContexts, FDirectorTuneProfile& OutProfile);
+
+    static bool Load(uint64 InModelKey, int32 NumContexts, FDirectorTuneProfile& OutProfile);
+    static bool Save(uint64 InModelKey, int32 NumContexts, const FDirectorTuneProfile& Profile);
+
+    // The sweep itself; blocks for a few seconds on a small model, longer on a big one
+    static FDirectorTuneProfile Run(llama_model* Model, const llama_context_params& BaseParams, int32 NumContexts);
+
+    static FString ConfigPath();
+};
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Commandlets/Commandlet.h"
+#include "GameDirectorQuantizeCommandlet.generated.h"
+
+/**
+ * Writes Q8_0 / Q5_K_M / Q4_K_M variants of the director model with llama_model_quantize, then runs the training
+ * dataset prompts through each one and records how many answers validate and how long they take. The report sits
+ * next to the models and is read by FDirectorModelSelector at startup.
+ *
+ * UnrealEditor-Cmd.exe GameDirectorAI.uproject -run=GameDirectorQuantize
+ *     [-Source=<f16 gguf>] [-Types=Q8_0,Q5_K_M,Q4_K_M] [-Dataset=<jsonl or .md>] [-MaxPrompts=N]
+ *     [-Threads=N] [-Force] [-NoReport] [-ReportSource]
+ */
+UCLASS()
+class GAMEDIRECTORPLUGIN_API UGameDirectorQuantizeCommandlet : public UCommandlet
+{
+    GENERATED_BODY()
+
+public:
+    UGameDirectorQuantizeCommandlet();
+
+    virtual int32 Main(const FString& Params) override;
+};
@@ -9,12 +9,23 @@
 #include "Serialization/JsonSerializer.h"
 #include "Serialization/JsonWriter.h"
 #include "Subsystems/GameInstanceSubsystem.h"
+#include "Containers/Ticker.h"
 #include "GameDirectorSubsystem.generated.h"
 
 // Fires once a JSON result has been parsed successfully
 
 
 
+// Admission order in the runner queue; higher goes first
+UENUM(BlueprintType)
+enum class EDirectorPriority : uint8
+{
+    Flavour,    // ambient chatter, first to be dropped
+    Normal,
+    Important,
+    Critical    // e.g. combat decisions
+};
+
 USTRUCT(BlueprintType)
 struct FToolCall
 {
@@ -76,9 +87,22 @@ struct FDirectorDecision
     FDialogue Dialogue;
     UPROPERTY(BlueprintReadOnly)
     FString Response;
+
+    // Streaming requests only: the first N ToolCalls were already fired through OnDirectorToolCall
+    UPROPERTY(BlueprintReadOnly)
+    int32 NumToolCallsDispatched = 0;
 };
 DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnDirectorDecision, const FDirectorDecision&, Decision);
 
+// Streaming: decoded text since the last frame, and each dialogue line as soon as its string closes
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnDirectorTextDelta, int32, RequestId, const FString&, Delta);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_ThreeParams(FOnDirectorDialogueLine, int32, RequestId, int32, LineIndex, const FString&, Line);
+// Streaming: each tool_calls element as soon as its object closes, while the rest is still generating
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_TwoParams(FOnDirectorToolCall, int32, RequestId, const FToolCall&, ToolCall);
+// Background model load started by InitializeRunner: progress 0..1, then ready (or failed)
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnDirectorLoadProgress, float, Progress);
+DECLARE_DYNAMIC_MULTICAST_DELEGATE_OneParam(FOnDirectorRunnerReady, bool, bSuccess);
+
 /**
  * 
  */
@@ -90,15 +114,95 @@ public:
     UPROPERTY(BlueprintAssignable, Category = "GameDirector")
     FOnDirectorDecision OnDirectorDecision;
 
+    // Fired at most once per frame per streaming request
+    UPROPERTY(BlueprintAssignable, Category = "GameDirector")
+    FOnDirectorTextDelta OnDirectorTextDelta;
+
+    UPROPERTY(BlueprintAssignable, Category = "GameDirector")
+    FOnDirectorDialogueLine OnDirectorDialogueLine;
+
+    // Early dispatch: the final OnDirectorDecision still lists these calls, see NumToolCallsDispatched
+    UPROPERTY(BlueprintAssignable, Category = "GameDirector")
+    FOnDirectorToolCall OnDirectorToolCall;
 
+    // At most once per percent while the model loads
+    UPROPERTY(BlueprintAssignable, Category = "GameDirector")
+    FOnDirectorLoadProgress OnDirectorLoadProgress;
+
+    UPROPERTY(BlueprintAssignable, Category = "GameDirector")
+    FOnDirectorRunnerReady OnDirectorRunnerReady;
 
+    virtual void Initialize(FSubsystemCollectionBase& Collection) override;
+    virtual void Deinitialize() override;
 
+
+
+
+	// Starts loading the model on a background thread and returns right away; OnDirectorRunnerReady fires when done.
+	// Requests made meanwhile are queued. Returns false if the runner was already initialized or is loading.
 	UFUNCTION(BlueprintCallable, Category = "GameDirector")	
 	bool InitializeRunner();
 
+    UFUNCTION(BlueprintPure, Category = "GameDirector")
+    bool IsRunnerLoading() const;
+
+    // 0..1 while loading, 1 once ready
+    UFUNCTION(BlueprintPure, Category = "GameDirector")
+    float GetRunnerLoadProgress() const;
+
     UFUNCTION(BlueprintCallable, Category = "GameDirector")
     bool Generate2(FString Prompt,FString Intent);
 
+    // Like Generate2, but also streams text deltas and dialogue lines. Returns the request id used by the
+    // streaming delegates, or 0 if the runner is not initialized.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    int32 GenerateStreaming(FString Prompt, FString Intent);
+
+    // Generate2 / GenerateStreaming with scheduling hints. DeadlineSeconds (0 = none) counts from now: a request
+    // still queued past it is skipped instead of generated. MergeKey lets a full queue fold requests for the same
+    // thing together (GameDirector.QueueOverflowPolicy 2). bForceFresh bypasses the decision cache for this call;
+    // CacheTtlSeconds overrides how long its result stays cached (-1 = default, 0 = not cached).
+    // AssistantPrefix is prefilled as the start of the answer instead of generated, e.g. {"intent":"warn","reason":"
+    // Persona picks a LoRA adapter from GameDirector.Personas (e.g. "grim"); empty = the base model.
+    // Returns the request id, or 0 if the runner is not initialized.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    int32 GenerateWithPriority(FString Prompt, FString Intent, EDirectorPriority Priority = EDirectorPriority::Normal,
+        float DeadlineSeconds = 0.f, FString MergeKey = TEXT(""), bool bStream = false,
+        bool bForceFresh = false, float CacheTtlSeconds = -1.f, FString AssistantPrefix = TEXT(""), FString Persona = TEXT(""));
+
+    // One turn of a multi-turn dialogue with Speaker (e.g. an NPC name). Earlier turns are kept as chat history and,
+    // while the context has room, in a KV sequence of their own, so a turn only prefills what is new since the last one.
+    // Turns of one Speaker run one after another. Returns the request id, or 0 if the runner is not initialized.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    int32 GenerateDialogueTurn(FString Speaker, FString Prompt, FString Intent, bool bStream = false);
+
+    // Forgets Speaker's history and frees its sequence, e.g. when the NPC leaves or the dialogue ends.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    void EndDialogue(FString Speaker);
+
+    // Stops a request started by GenerateStreaming before its next decode step; no decision is broadcast for it.
+    // Returns false if the id is unknown or already finished.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    bool CancelRequest(int32 RequestId);
+
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    void CancelAllRequests();
+
+    // GameDirector.BenchPrefill: logs prefill throughput per n_ubatch x chunk size and suggests the fastest setting
+    // whose longest chunk stays within MaxChunkMs. Blocks the game thread while it runs.
+    void RunPrefillBenchmark(int32 NumTokens, float MaxChunkMs);
+
+    // Writes the runner's cached KV state (system-prompt prefixes with their tokens) and every GenerateDialogueTurn
+    // history to the slot "<SlotName>_Director", so loading that save resumes the NPCs' dialogues without prefilling
+    // any of it again. Call it next to the game's own SaveGameToSlot.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    bool SaveDirectorSession(const FString& SlotName, int32 UserIndex = 0);
+
+    // Restores what SaveDirectorSession wrote. While the model is still loading it is applied once loading finishes.
+    // Returns false if there is no such save, or it was made with other weights or another context size.
+    UFUNCTION(BlueprintCallable, Category = "GameDirector")
+    bool LoadDirectorSession(const FString& SlotName, int32 UserIndex = 0);
+
 
     UFUNCTION(BlueprintCallable, Category = "GameDirector")
     bool GenerateAsync(FString Prompt);
@@ -119,4 +223,20 @@ private:
 	TUniquePtr<LlamaRunner> Runner;
     TUniquePtr<LLamaRunnerAsync> RunnerAsync;
     TAtomic<bool> bIsGenerating{ false };
+
+    // LoadDirectorSession called before the runner finished loading
+    TArray<uint8> PendingSessionState;
+    FString ModelFile;
+
+    // ---- streaming / cancellation ----
+    TMap<int32, TSharedPtr<FDirectorStream, ESPMode::ThreadSafe>> ActiveStreams;
+    TMap<int32, TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>> ActiveJobs;
+    int32 NextRequestId = 1;
+    FTSTicker::FDelegateHandle StreamTickerHandle;
+
+    bool TickStreams(float DeltaTime);
+    void DrainStream(int32 RequestId, FDirectorStream& Stream);
+    void StartRequest(const FString& Prompt, const FString& Intent, int32 RequestId,
+        TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream, const FDirectorJobOptions& Options = FDirectorJobOptions());
+    void OnRequestDone(int32 RequestId, FString Output);
 };
@@ -0,0 +1,349 @@
+#pragma once
+
+#include "CoreMinimal.h"
+#include <string>
+#include <vector>
+
+// Streaming "is the first top-level JSON object closed?" detector for the generation loops.
+// Keeps the lexer state (depth, in-string, escape) between calls so each token only costs its own bytes.
+struct FJsonStreamTracker
+{
+    int32 Depth = 0;
+    bool  bInString = false;
+    bool  bEscape = false;
+    bool  bSeenOpen = false;
+    int32 ObjectStart = -1;   // byte offset of the top-level '{'
+    int32 ObjectEnd = -1;     // byte offset one past its matching '}', once closed
+    int32 Consumed = 0;       // bytes fed so far
+
+    void Reset() { *this = FJsonStreamTracker(); }
+    bool IsClosed() const { return ObjectEnd >= 0; }
+
+    // Advances over the Len new bytes appended to the stream. Returns true once the first top-level object
+    // has closed; bytes after that are not looked at.
+    bool Feed(const char* Bytes, int32 Len)
+    {
+        for (int32 i = 0; i < Len && !IsClosed(); ++i)
+        {
+            const unsigned char ch = (unsigned char)Bytes[i];
+            const int32 Offset = Consumed + i;
+
+            if (bEscape) { bEscape = false; continue; }
+            if (ch == '\\') { bEscape = true; continue; }
+            if (ch == '"') { bInString = !bInString; continue; }
+            if (bInString) continue;
+
+            if (ch == '{')
+            {
+                if (Depth == 0 && !bSeenOpen) ObjectStart = Offset;
+                ++Depth;
+                bSeenOpen = true;
+            }
+            else if (ch == '}')
+            {
+                if (Depth > 0) --Depth;
+                if (bSeenOpen && Depth == 0) ObjectEnd = Offset + 1;
+            }
+        }
+        Consumed += Len;
+        return IsClosed();
+    }
+};
+
+// Watches the same bytes as FJsonStreamTracker and hands out structural pieces of the director object as soon
+// as they are complete, while the rest is still being generated:
+//  - each dialogue.lines[] entry (unescaped) when its closing quote arrives
+//  - each tool_calls[] element (raw JSON text) when its closing brace arrives
+struct FDirectorOutputScanner
+{
+    void Reset() { *this = FDirectorOutputScanner(); }
+
+    // Advances over the Len new bytes, appending whatever completed in them
+    void Feed(const char* Bytes, int32 Len, TArray<FString>& OutLines, TArray<FString>& OutToolCalls)
+    {
+        for (int32 i = 0; i < Len && !bDone; ++i)
+        {
+            const char ch = Bytes[i];
+            if (bCapturingTool) ToolRaw.push_back(ch);
+            if (bInString) { StringChar(ch, OutLines); continue; }
+
+            switch (ch)
+            {
+            case '"': bInString = true; Str.clear(); break;
+            case '{':
+                // root -> "tool_calls" array -> this element
+                if (Stack.size() == 2 && !Stack[1].bObject && Stack[1].Key == "tool_calls" && Stack[0].bObject)
+                {
+                    bCapturingTool = true;
+                    ToolRaw.assign(1, ch);
+                }
+                Open(/*bObject*/ true);
+                bExpectKey = true;
+                break;
+            case '[': Open(/*bObject*/ false); break;
+            case '}':
+            case ']':
+                if (!Stack.empty()) Stack.pop_back();
+                if (Stack.empty() && bSeenOpen) bDone = true;
+                if (bCapturingTool && Stack.size() == 2)
+                {
+                    bCapturingTool = false;
+                    FUTF8ToTCHAR Conv(ToolRaw.data(), (int32)ToolRaw.size());
+                    OutToolCalls.Add(FString(Conv.Length(), Conv.Get()));
+                    ToolRaw.clear();
+                }
+                break;
+            case ',': bExpectKey = !Stack.empty() && Stack.back().bObject; break;
+            case ':': bExpectKey = false; break;
+            default: break;
+            }
+        }
+    }
+
+private:
+    struct FFrame
+    {
+        bool bObject = false;
+        std::string Key;    // key this container is the value of ("" inside arrays)
+    };
+
+    void Open(bool bObject)
+    {
+        FFrame Frame;
+        Frame.bObject = bObject;
+        if (!Stack.empty() && Stack.back().bObject) Frame.Key = LastKey;
+        Stack.push_back(std::move(Frame));
+        bSeenOpen = true;
+    }
+
+    void StringChar(char ch, TArray<FString>& OutLines)
+    {
+        if (UnicodeLeft > 0)
+        {
+            const int32 Digit = (ch >= '0' && ch <= '9') ? ch - '0'
+                : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+                : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : 0;
+            UnicodeCp = (UnicodeCp << 4) | (uint32)Digit;
+            if (--UnicodeLeft == 0) AppendCodepoint(UnicodeCp);
+            return;
+        }
+        if (bEscape)
+        {
+            bEscape = false;
+            switch (ch)
+            {
+            case 'n': Str.push_back('\n'); break;
+            case 't': Str.push_back('\t'); break;
+            case 'r': Str.push_back('\r'); break;
+            case 'b': Str.push_back('\b'); break;
+            case 'f': Str.push_back('\f'); break;
+            case 'u': UnicodeLeft = 4; UnicodeCp = 0; break;
+            default:  Str.push_back(ch); break;
+            }
+            return;
+        }
+        if (ch == '\\') { bEscape = true; return; }
+        if (ch != '"') { Str.push_back(ch); return; }
+
+        // closing quote
+        bInString = false;
+        if (!Stack.empty() && Stack.back().bObject && bExpectKey)
+        {
+            LastKey = Str;
+        }
+        else if (Stack.size() == 3 && !Stack[2].bObject && Stack[2].Key == "lines"
+            && Stack[1].bObject && Stack[1].Key == "dialogue" && Stack[0].bObject)
+        {
+            FUTF8ToTCHAR Conv(Str.data(), (int32)Str.size());
+            OutLines.Add(FString(Conv.Length(), Conv.Get()));
+        }
+    }
+
+    void AppendCodepoint(uint32 Cp)
+    {
+        if (Cp >= 0xD800 && Cp <= 0xDFFF) Cp = '?'; // lone surrogate halves are not worth pairing up for dialogue text
+        if (Cp < 0x80) { Str.push_back((char)Cp); }
+        else if (Cp < 0x800) { Str.push_back((char)(0xC0 | (Cp >> 6))); Str.push_back((char)(0x80 | (Cp & 0x3F))); }
+        else
+        {
+            Str.push_back((char)(0xE0 | (Cp >> 12)));
+            Str.push_back((char)(0x80 | ((Cp >> 6) & 0x3F)));
+            Str.push_back((char)(0x80 | (Cp & 0x3F)));
+        }
+    }
+
+    std::vector<FFrame> Stack;  // std::vector, not TArray: FFrame holds a std::string, which is not bitwise-relocatable
+    std::string Str;        // current string, unescaped
+    std::string LastKey;    // last key read in the innermost object
+    std::string ToolRaw;    // raw bytes of the tool_calls element being captured
+    bool   bCapturingTool = false;
+    bool   bInString = false;
+    bool   bEscape = false;
+    bool   bExpectKey = false;
+    bool   bSeenOpen = false;
+    bool   bDone = false;
+    int32  UnicodeLeft = 0;
+    uint32 UnicodeCp = 0;
+};
+
+// Follows the director schema's fixed key order (kDirectorGrammar in LLamaRunnerAsync.cpp) over the same bytes and
+// knows, after each piece, which literal must come next no matter what would be sampled: keys, separators and
+// closing brackets. Literals are in compact form (no optional spaces); when the output's own bytes diverge from one,
+// nothing is forced until the next structural point. Keep the rules in sync with the grammar.
+struct FDirectorSchemaCursor
+{
+    // IntentUtf8 = intent value to force right after "intent", empty to leave it to the model
+    void Reset(const std::string& IntentUtf8)
+    {
+        *this = FDirectorSchemaCursor();
+        Intent = IntentUtf8;
+        Expect("{");
+    }
+
+    // Literal the output has to continue with right now, empty if nothing is forced
+    std::string Forced() const { return Pending.substr(Matched); }
+
+    void Feed(const char* Bytes, int32 Len)
+    {
+        for (int32 i = 0; i < Len; ++i)
+        {
+            const char ch = Bytes[i];
+            if (Matched < Pending.size())
+            {
+                if (Pending[Matched] == ch) ++Matched;
+                else { Pending.clear(); Matched = 0; }
+            }
+            Step(ch);
+        }
+    }
+
+private:
+    struct FFrame
+    {
+        bool bObject = false;
+        std::string Key;        // key this container is the value of ("" inside arrays and for the root)
+    };
+
+    void Expect(const char* Literal) { Pending = Literal; Matched = 0; }
+
+    // Key the root member we are inside was stored under ("tool_calls", "dialogue", "quest_patch"), "" at the root
+    const std::string& Branch() const
+    {
+        static const std::string None;
+        return Stack.size() >= 2 ? Stack[1].Key : None;
+    }
+
+    void Step(char ch)
+    {
+        if (bInString)
+        {
+            if (bEscape) { bEscape = false; Str.push_back(ch); return; }
+            if (ch == '\\') { bEscape = true; return; }
+            if (ch != '"') { Str.push_back(ch); return; }
+
+            bInString = false;
+            if (!Stack.empty() && Stack.back().bObject && bExpectKey) { LastKey = Str; return; }
+            if (!Stack.empty() && Stack.back().bObject) ValueClosed();
+            return;
+        }
+
+        switch (ch)
+        {
+        case '"': bInString = true; Str.clear(); break;
+        case '{':
+        case '[':
+        {
+            FFrame Frame;
+            Frame.bObject = (ch == '{');
+            if (!Stack.empty() && Stack.back().bObject) Frame.Key = LastKey;
+            Stack.push_back(std::move(Frame));
+            bExpectKey = (ch == '{');
+            Opened();
+            break;
+        }
+        case '}':
+        case ']':
+        {
+            if (Stack.empty()) break;
+            const FFrame Closing = Stack.back();
+            Stack.pop_back();
+            bExpectKey = false;
+            Closed(Closing);
+            break;
+        }
+        case ',': bExpectKey = !Stack.empty() && Stack.back().bObject; break;
+        case ':': bExpectKey = false; break;
+        default: break;
+        }
+    }
+
+    // Depths are fixed by the schema, which keeps free-form args objects from matching the rules below
+    void Opened()
+    {
+        const FFrame& Top = Stack.back();
+        const size_t Depth = Stack.size();
+        if (Depth == 1)
+        {
+            // root: the intent key, and its value when the caller already knows it
+            Pending = "\"intent\":\"";
+            if (!Intent.empty()) Pending += Intent + "\",\"reason\":\"";
+            Matched = 0;
+        }
+        else if (Depth == 3 && Top.bObject && Branch() == "tool_calls") Expect("\"name\":\"");
+        else if (Depth == 2 && Top.bObject && Top.Key == "dialogue") Expect("\"speaker\":\"");
+        else if (Depth == 3 && !Top.bObject && Branch() == "dialogue" && Top.Key == "lines") Expect("\"");
+        else if (Depth == 4 && Top.bObject && Branch() == "quest_patch") Expect("\"id\":\"");
+    }
+
+    void ValueClosed()
+    {
+        const std::string& Key = LastKey;
+        const size_t Depth = Stack.size();
+        if (Depth == 1)
+        {
+            if (Key == "intent") Expect(",\"reason\":\"");
+            else if (Key == "reason") Expect(",\"tool_calls\":[");
+        }
+        else if (Depth == 3 && Branch() == "tool_calls")
+        {
+            if (Key == "name") Expect(",\"args\":{");
+        }
+        else if (Depth == 2 && Branch() == "dialogue")
+        {
+            if (Key == "speaker") Expect(",\"emote\":\"");
+            else if (Key == "emote") Expect(",\"lines\":[\"");
+        }
+        else if (Depth == 2 && Branch() == "quest_patch")
+        {
+            if (Key == "questId") Expect(",\"addObjectives\":[");
+        }
+        else if (Depth == 4 && Branch() == "quest_patch")
+        {
+            if (Key == "id") Expect(",\"desc\":\"");
+            else if (Key == "desc") Expect("}");
+        }
+    }
+
+    // Stack has already been popped, so the closed container was at depth Stack.size() + 1
+    void Closed(const FFrame& Closing)
+    {
+        const size_t Depth = Stack.size() + 1;
+        if (Depth == 1) Expect("");
+        else if (Depth == 2 && Closing.Key == "tool_calls") Expect(",\"dialogue\":{\"speaker\":\"");
+        else if (Depth == 2 && Closing.Key == "dialogue") Expect(",\"quest_patch\":");
+        else if (Depth == 2 && Closing.Key == "quest_patch") Expect("}");
+        else if (Depth == 3 && Branch() == "dialogue") Expect("}");                 // lines
+        else if (Depth == 3 && Branch() == "quest_patch") Expect("}");              // addObjectives
+        else if (Depth == 4 && Branch() == "tool_calls" && Closing.Key == "args") Expect("}");
+    }
+
+    std::vector<FFrame> Stack;  // std::vector: FFrame holds a std::string (see FDirectorOutputScanner)
+    std::string Intent;
+    std::string Pending;        // literal expected from the last structural point on
+    size_t      Matched = 0;    // bytes of Pending already in the output
+    std::string Str;
+    std::string LastKey;
+    bool bInString = false;
+    bool bEscape = false;
+    bool bExpectKey = false;
+};
@@ -17,11 +17,81 @@
 #include <cfloat>
 #include <cmath>
 #include "llama.h"  
+#include "DirectorSampler.h"
+#include "JsonStreamTracker.h"
+#include "DirectorStream.h"
+#include "DirectorDecisionCache.h"
+#include "DirectorSemanticIndex.h"
+#include "DirectorThreadpool.h"
 // Forward-declare llama types (avoid including llama.h in public headers if you want)
 struct llama_model;
 struct llama_context;
 struct llama_vocab;
 
+// Returned by GenerateJSONAsync. Cancel() may be called from any thread: a queued job is dropped when it is
+// dequeued, a running one stops before its next decode step (a long prefill is aborted from inside llama_decode).
+// OnDone still runs, with "{}".
+class FDirectorJobHandle
+{
+public:
+    void Cancel()
+    {
+        if (bCancelled.Exchange(true)) return;
+        if (Shared) Shared->ReleaseCaller();
+    }
+    bool IsCancelled() const { return bCancelled.Load(); }
+
+private:
+    friend class LLamaRunnerAsync;
+
+    // Coalesced and merged requests: each caller gets its own handle on one shared job handle, and the job is only
+    // cancelled once every caller has cancelled. Shared handles chain, so a merged job counts coalesced callers too.
+    bool TryAddCaller()
+    {
+        int32 N = NumCallers.Load();
+        while (N > 0)
+        {
+            if (NumCallers.CompareExchange(N, N + 1)) return true;
+        }
+        return false;
+    }
+    void ReleaseCaller()
+    {
+        if (--NumCallers == 0 && !bCancelled.Exchange(true) && Shared) Shared->ReleaseCaller();
+    }
+
+    TAtomic<bool>  bCancelled{ false };
+    TAtomic<int32> NumCallers{ 0 };
+    TSharedPtr<FDirectorJobHandle, ESPMode::ThreadSafe> Shared;
+};
+
+// Scheduling hints for GenerateJSONAsync
+struct FDirectorJobOptions
+{
+    int32   Priority = 0;           // higher is admitted first
+    double  DeadlineSeconds = 0.0;  // relative to enqueue, 0 = none; a job still queued past it is skipped before prefill
+    FString MergeKey;               // under the Merge overflow policy, a job with the same key already queued absorbs this one
+
+    // Decision cache: -1 = GameDirector.DecisionCacheTTL, 0 = do not cache this result
+    double  CacheTtlSeconds = -1.0;
+    bool    bForceFresh = false;    // skip the cache lookup; the fresh result still replaces the cached one
+
+    // Argmax decoding (TopK 1, Temp 0). Only greedy jobs use the draft model (GameDirector.DraftModel).
+    bool    bGreedy = false;
+
+    // Start of the assistant's answer, e.g. {"intent":"warn","reason":" - prefilled with the prompt instead of
+    // generated, and part of the returned JSON. With GameDirector.JumpForward the schema's own keys are added to it.
+    FString AssistantPrefix;
+
+    // LoRA persona from GameDirector.Personas (e.g. "grim"); empty or unknown = the base weights
+    FString Persona;
+
+    // Multi-turn dialogue, e.g. the speaking NPC's name. Requests with the same Conversation see the earlier turns as chat
+    // history and keep their KV sequence between turns, so each turn only prefills its new tokens. They are never served
+    // from the decision cache or coalesced. Empty = a stateless request.
+    FString Conversation;
+};
+
 class LLamaRunnerAsync
 {
 public:
@@ -29,30 +99,214 @@ public:
     LLamaRunnerAsync();
     ~LLamaRunnerAsync();
 
-    bool Initiate(const FString& ModelPath, int32 ContextSize = 4096);
+    // MaxSequences = how many jobs can be in flight at once per context (cparams.n_seq_max); each gets its own ContextSize window.
+    // PoolSize = number of llama_contexts (each with its own worker thread) sharing the one loaded model.
+    // ThreadsPerContext = decode threads per context; 0 splits the physical cores evenly across the pool.
+    bool Initiate(const FString& ModelPath, int32 ContextSize = 4096, int32 MaxSequences = 4, int32 PoolSize = 1, int32 ThreadsPerContext = 0);
     void Shutdown();
 
-    // Synchronous generation (IMPLEMENTATION LIVES IN .CPP)
+    // Initiate on a background thread so the caller never blocks on the GGUF load. OnProgress (0..1, driven by llama's
+    // load progress callback) and OnLoaded run on the game thread. Requests made meanwhile are held and submitted once
+    // the model is ready, or completed with "{}" if loading fails. Shutdown() aborts a load in progress.
+    void InitiateAsync(const FString& ModelPath, int32 ContextSize, int32 MaxSequences, int32 PoolSize, int32 ThreadsPerContext,
+        TFunction<void(float)> OnProgress, TFunction<void(bool)> OnLoaded);
+    bool IsLoading() const { return bLoading; }
+    float GetLoadProgress() const { return LoadPermille.Load() / 1000.f; }
+
+    // Synchronous generation: enqueues on the worker and blocks until the job completes (and until a background
+    // load finishes). Must not be called from the worker thread itself.
     FString GenerateJSON(const FString& Prompt, int max_new, int top_k, float top_p, float temp,FString Intent);
 
-    // Asynchronous enqueue (callback runs on Game Thread)
-    void GenerateJSONAsync(const FString& Prompt, TFunction<void(FString)> OnDone,FString Intent);
+    // Asynchronous enqueue (callback runs on Game Thread).
+    // If Stream is set, decoded text and each finished dialogue line are appended to it as they are generated.
+    // A validated decision for the same model, prompt, intent, prefix and sampling still in the decision cache is returned
+    // straight away (next game-thread tick) without touching a worker.
+    // An identical request (prompt, intent, prefix, sampling) already in flight is not decoded again: this call attaches to
+    // its completion instead (non-streaming requests only, see GameDirector.CoalesceRequests).
+    // A job dropped by the bounded queue (see GameDirector.QueueOverflowPolicy) or past its deadline completes with "{}".
+    TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> GenerateJSONAsync(const FString& Prompt, TFunction<void(FString)> OnDone,FString Intent,
+        TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream = nullptr, const FDirectorJobOptions& Options = FDirectorJobOptions());
 
     void ResetContext();
 
     bool IsInitialized() const { return bInitialized; }
     bool IsValidDirectorJSON(const FString& RawText, FString& OutCleanedJSON, FString& OutError) const;
 
+    // System-prompt prefix cache counters (hits = requests that skipped the system prefill)
+    struct FPrefixCacheStats
+    {
+        int64 Hits = 0;
+        int64 Misses = 0;
+        int64 PrefillTokensSaved = 0;
+        int64 ConversationTokensReused = 0;     // prompt tokens of conversation turns already in their sequence
+    };
+    FPrefixCacheStats GetPrefixCacheStats() const;
+
+    // Save-game persistence of the prefix cache and the conversations: every context's system-prefix snapshots
+    // (llama_state_seq_get_data plus the tokens they cover), then each conversation's turns and, for an idle pinned one,
+    // its sequence's state and tokens, behind a header with the model key and KV layout. ImportSession refuses a blob
+    // taken from other weights or another context size; the snapshots it accepts are restored with
+    // llama_state_seq_set_data on first use, the conversations by their context's worker, so a resumed game neither
+    // loses the NPCs' dialogue history nor prefills it again. ExportSession waits for the workers between two steps.
+    // Any thread but a worker; false if the runner is not initialized.
+    bool ExportSession(TArray<uint8>& OutBlob);
+    bool ImportSession(const TArray<uint8>& Blob);
+
+    // Requests that attached to an identical in-flight job instead of decoding their own
+    int64 GetNumCoalescedRequests() const { return CoalescedRequests.Load(); }
+
+    FDirectorDecisionCache& GetDecisionCache() { return DecisionCache; }
+    FDirectorSemanticIndex& GetSemanticIndex() { return SemanticIndex; }
+
+    // Forgets a conversation's turns and frees its KV sequence (call when the NPC leaves relevance). Any thread;
+    // a turn still in flight finishes first.
+    void EndConversation(const FString& Conversation);
+
+    // Decode throughput over all contexts, and how well the draft model's proposals are accepted
+    struct FDecodeStats
+    {
+        int64  TokensGenerated = 0;
+        double DecodeSeconds = 0.0;     // time spent in step decodes (draft + target + verification)
+        int64  DraftedTokens = 0;
+        int64  AcceptedTokens = 0;
+        int64  SpeculativeSteps = 0;
+        int64  ForcedTokens = 0;        // emitted without sampling because the schema fixed them (jump-forward)
+
+        // Request latency from admission to answer: the first request after Initiate, then the mean of the rest
+        double WarmupMs = 0.0;
+        double FirstRequestMs = 0.0;
+        int64  SteadyRequests = 0;
+        double SteadyRequestMs = 0.0;
+
+        double TokensPerSecond() const { return DecodeSeconds > 0.0 ? TokensGenerated / DecodeSeconds : 0.0; }
+        double AcceptRate() const { return DraftedTokens > 0 ? (double)AcceptedTokens / DraftedTokens : 0.0; }
+    };
+    FDecodeStats GetDecodeStats() const;
+    bool HasDraftModel() const { return DraftModel != nullptr; }
+
+    // Prefill throughput of the loaded model for each n_ubatch x chunk size, on a scratch context with a synthetic
+    // NumTokens prompt. Blocks the calling thread; the pool keeps running meanwhile.
+    struct FPrefillBenchResult
+    {
+        int32  UBatch = 0;
+        int32  Chunk = 0;
+        double TokensPerSecond = 0.0;
+        double MaxChunkMs = 0.0;        // longest single llama_decode, i.e. the worst wait for a cancel or a step
+    };
+    TArray<FPrefillBenchResult> BenchmarkPrefill(int32 NumTokens, const TArray<int32>& UBatchSizes, const TArray<int32>& ChunkSizes);
+
     llama_context_params cparams;
 private:
-    // ---- llama state ----
-    bool                 bInitialized = false;
+    // ---- llama state (shared by every context in the pool) ----
+    TAtomic<bool>        bInitialized{ false };   // set by the loader thread under InitiateAsync
     llama_model* Model = nullptr;
-    llama_context* Ctx = nullptr;
     const llama_vocab* Vocab = nullptr;
 
-    // serialize llama_decode just in case; worker is single-threaded anyway
-    mutable FCriticalSection DecodeMutex;
+    // Director JSON schema grammar, compiled once in Initiate. Sequences use clones of it (a grammar sampler
+    // carries parse state), reset per job. Null if the grammar failed to compile: decoding is unconstrained then.
+    llama_sampler* DirectorGrammar = nullptr;
+
+    // System-prompt prefix cache counters, summed over the pool
+    TAtomic<int64> PrefixHits{ 0 };
+    TAtomic<int64> PrefixMisses{ 0 };
+    TAtomic<int64> PrefixTokensSaved{ 0 };
+    TAtomic<int64> ConversationTokensReused{ 0 };
+
+    // ---- conversations ----
+    // Context each conversation lives on, so every turn lands where its KV sequence is; set by Dispatch
+    FCriticalSection ConversationMutex;
+    TMap<FString, int32> ConversationSlots;
+
+    // ---- LoRA personas ----
+    // Adapters listed in GameDirector.Personas, loaded once against Model (and freed with it). An adapter applies to
+    // every sequence of a context, so a context only switches persona while it has nothing in flight.
+    struct FPersona
+    {
+        FString Name;
+        llama_adapter_lora* Adapter = nullptr;
+        float  Scale = 1.0f;
+        uint32 Crc = 0;             // seeds prefix cache keys: a KV snapshot is only valid under the adapter it was taken with
+    };
+    TArray<FPersona> Personas;
+
+    // ---- in-flight request coalescing ----
+    struct FCoalescedCaller
+    {
+        TFunction<void(FString)> OnDone;
+        TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> Handle;
+    };
+    // One decoded job and every caller waiting on it. Callers are only added while it is in InFlight.
+    struct FInFlightRequest
+    {
+        uint32  Key = 0;
+        FString Prompt;
+        FString Intent;
+        FString AssistantPrefix;
+        int32   Persona = INDEX_NONE;
+        TSharedPtr<FDirectorJobHandle, ESPMode::ThreadSafe> JobHandle;
+        TArray<FCoalescedCaller> Callers;
+    };
+    FCriticalSection InFlightMutex;
+    TMap<uint32, TSharedRef<FInFlightRequest, ESPMode::ThreadSafe>> InFlight;
+    TAtomic<int64> CoalescedRequests{ 0 };
+
+    // ---- speculative decoding ----
+    // Optional small model with the same vocab; proposes up to MaxDraftTokens tokens per step for greedy sequences,
+    // which the main model verifies in the shared step batch
+    static constexpr int32 MaxDraftTokens = 16;
+    llama_model* DraftModel = nullptr;
+
+    TAtomic<int64> TokensGenerated{ 0 };
+    TAtomic<int64> DecodeMicros{ 0 };
+    TAtomic<int64> DraftedTokens{ 0 };
+    TAtomic<int64> AcceptedTokens{ 0 };
+    TAtomic<int64> SpeculativeSteps{ 0 };
+
+    // ---- jump-forward decoding ----
+    // Literal runs the schema forces (keys, separators, brackets) are appended to the next step batch as extra rows
+    // instead of being sampled one per step; at most this many per sequence and step
+    static constexpr int32 MaxForcedTokens = 16;
+    TAtomic<int64> ForcedTokens{ 0 };
+
+    // ---- cold start ----
+    double WarmupMs = 0.0;
+    TAtomic<bool>  bFirstRequestDone{ false };
+    TAtomic<int64> FirstRequestMicros{ 0 };
+    TAtomic<int64> SteadyRequestMicros{ 0 };
+    TAtomic<int64> SteadyRequests{ 0 };
+
+    // ---- background loading ----
+    // A request made while InitiateAsync is still loading
+    struct FPendingRequest
+    {
+        FString Prompt;
+        TFunction<void(FString)> OnDone;
+        FString Intent;
+        TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream;
+        FDirectorJobOptions Options;
+        TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe> Handle;
+        double QueuedAt = 0.0;
+    };
+    TAtomic<bool>  bLoading{ false };
+    TAtomic<bool>  bAbortLoad{ false };     // makes the progress callback stop llama's weight load
+    TAtomic<int32> LoadPermille{ 0 };
+    TFuture<bool>  LoadFuture;
+    // Set by Shutdown, so game-thread callbacks posted by a load it abandoned do nothing
+    TSharedPtr<FThreadSafeBool, ESPMode::ThreadSafe> LoadCancelled;
+    TFunction<void(float)> LoadProgressFn;
+    FCriticalSection PendingMutex;
+    TArray<FPendingRequest> PendingRequests;
+    int32 MaxPendingRequests = 0;           // MaxQueuedJobs x PoolSize, 0 = unbounded
+
+    // ---- decision cache ----
+    uint64 ModelKey = 0;            // identifies the loaded weights in cache keys
+    FDirectorDecisionCache DecisionCache;
+
+    // Semantic decision cache (GameDirector.SemanticCache): prompts are embedded with the director model's mean-pooled
+    // hidden state on a small context of their own, shared by the workers under EmbedMutex
+    llama_context* EmbedCtx = nullptr;
+    FCriticalSection EmbedMutex;
+    FDirectorSemanticIndex SemanticIndex;
 
     // ---- worker ----
     struct FJob
@@ -60,30 +314,307 @@ private:
         FString Prompt;
         TFunction<void(FString)> OnDone; // called on Game Thread
         FString Intent;
+        FString AssistantPrefix;
+        int32   Persona = INDEX_NONE;   // index into Personas, INDEX_NONE = base weights
+        FString Conversation;
+
+        int   MaxNew = 800;
+        int   TopK = 20;
+        float TopP = 0.8f;
+        float Temp = 0.20f;
+        bool  bCompleteOnWorker = false; // OnDone runs on the worker thread instead (used by the blocking GenerateJSON)
+
+        TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream; // optional per-token output
+        TSharedPtr<FDirectorJobHandle, ESPMode::ThreadSafe> Handle; // null for the blocking GenerateJSON
+
+        // scheduling
+        int32   Priority = 0;
+        double  Deadline = 0.0;         // absolute FPlatformTime::Seconds(), 0 = none
+        FString MergeKey;
+        uint64  Serial = 0;             // enqueue order, FIFO among equals
+
+        TSharedPtr<FInFlightRequest, ESPMode::ThreadSafe> Coalesced; // set if other callers may attach to this job
+
+        uint64 CacheKey = 0;            // 0 = result is not cached
+        double CacheTtl = 0.0;
+        uint64 SemanticGroup = 0;       // CacheKey without the prompt; 0 = no semantic cache for this job
+        bool   bSemanticLookup = false; // false for bForceFresh: the result is still stored
+
+        bool IsCancelled() const { return Handle && Handle->IsCancelled(); }
+        bool IsExpired(double Now) const { return Deadline > 0.0 && Now > Deadline; }
+    };
+
+    // One in-flight job bound to its own llama_seq_id. Only touched by the worker thread.
+    struct FSequence
+    {
+        llama_seq_id SeqId = 0;
+        bool  bActive = false;
+        FJob  Job;
+
+        int32 NumPast = 0;              // tokens of this sequence already in the KV cache
+        llama_token NextToken = -1;     // sampled, fed to the next step batch
+        int32 BatchIndex = -1;          // row of NextToken in the step batch (where its logits come back)
+
+        std::vector<llama_token> OutTokens;
+        std::string Stream;
+        FJsonStreamTracker Json;            // advanced by each new piece; closes the job when the object closes
+        FDirectorOutputScanner Scanner;     // only fed for jobs with a Stream
+        FDirectorSchemaCursor Cursor;       // what the schema forces next, when jump-forward is on
+        bool bJumpForward = false;
+        std::vector<llama_token> Forced;    // emitted after NextToken without sampling, decoded with it in the next step
+        int32 LastLoggedLen = 0;
+        std::mt19937 Rng;
+        FDirectorSampler Sampler;           // variant configured from the job's TopK/TopP/Temp
+
+        llama_sampler* Grammar = nullptr;   // clone of DirectorGrammar, owned by this sequence slot
+        bool bConstrained = false;          // Grammar is applied for the current job
+
+        // speculative decoding (greedy jobs on a slot with a draft context)
+        bool  bSpeculative = false;
+        int32 PromptLen = 0;                // OutTokens[i] sits at position PromptLen + i
+        int32 DraftPast = 0;                // tokens of this sequence in the draft KV cache
+        int32 DraftRow = -1;                // row of this sequence's last token in the draft batch
+        std::vector<llama_token> Draft;     // this step's proposals, verified after the step decode
+        int32 NumDrafted = 0;
+        int32 NumAccepted = 0;
+        double StartTime = 0.0;
+        double AdmitTime = 0.0;             // BeginSequence, for request latency
+        std::vector<float> Embedding;       // prompt embedding, stored with the result in the semantic cache
+
+        // Conversation this sequence is pinned to, also between its turns; its KV cells are left in place then
+        FString Conversation;
+
+        // chunked prefill: the prompt is decoded one chunk per scheduler step (NumPast = tokens done) before
+        // the first token is sampled
+        bool  bPrefilling = false;
+        std::vector<llama_token> PromptTokens;
+        int32 NumPrefillChunks = 0;
+        double PrefillSeconds = 0.0;
+    };
+
+    // A multi-turn dialogue living on one context. The turns are kept as text; while SeqId is pinned, Tokens is what that
+    // sequence holds in the KV cache, and the next turn only prefills where its prompt differs from it. Losing the
+    // sequence (eviction, persona switch, context reset) costs one full prefill, never the history.
+    struct FConversation
+    {
+        TArray<TPair<std::string, std::string>> Turns;  // user prompt, assistant answer (UTF-8)
+        llama_seq_id SeqId = -1;                        // pinned sequence, -1 = none
+        std::vector<llama_token> Tokens;
+        int64  ResetEpoch = 0;                          // FContextSlot::ResetCount when Tokens was captured
+        double LastUsed = 0.0;
+        bool   bBusy = false;                           // a turn is in flight; the next one waits in the queue
+        bool   bEnded = false;                          // EndConversation while busy: dropped when the turn finishes
     };
 
+    // A conversation read back from a session blob, restored by its context's worker
+    struct FSavedConversation
+    {
+        FString Key;
+        int32   Persona = INDEX_NONE;                   // adapter the state was computed under
+        TArray<TPair<std::string, std::string>> Turns;
+        std::vector<llama_token> Tokens;                // empty = history only, the next turn prefills it
+        std::vector<uint8_t>     State;
+    };
+
+    struct FPrefixSnapshot
+    {
+        std::vector<llama_token> Tokens;
+        std::vector<uint8_t>     State;
+    };
+
+    struct FContextSlot;
+
     class FWorker : public FRunnable
     {
     public:
-        explicit FWorker(LLamaRunnerAsync* InOwner);
+        FWorker(LLamaRunnerAsync* InOwner, FContextSlot* InSlot);
         virtual ~FWorker();
 
         virtual bool   Init() override;
         virtual uint32 Run() override;
         virtual void   Stop() override;
 
+        // Applies the bounded-queue overflow policy; jobs that lose out complete with "{}"
         void Enqueue(FJob&& Job);
         void Shutdown();
 
+        // Jobs that never started, for the runner to complete once the thread has exited
+        TArray<FJob> TakeQueue();
+
+        // Queues EndConversation for this worker's context
+        void EndConversation(const FString& Conversation);
+
+        // Runs Task on the worker thread before its next step (session export/import)
+        void RunBetweenSteps(TUniqueFunction<void()>&& Task);
+
     private:
+        // Highest priority, then earliest deadline, then oldest. While sequences are in flight only jobs for the
+        // context's current persona can join.
+        bool PopNextJob(FJob& OutJob);
+
         LLamaRunnerAsync* Owner = nullptr;
-        TQueue<FJob, EQueueMode::Mpsc> Queue;
+        FContextSlot* Slot = nullptr;
+        FCriticalSection QueueMutex;
+        TArray<FJob> Queue;             // small and bounded, scanned linearly
+        TArray<FString> EndedConversations;
+        TArray<TUniqueFunction<void()>> Tasks;
+        uint64 NextSerial = 0;
         FEvent* WakeEvent = nullptr;
         FThreadSafeBool  bStop = false;
     };
 
-    TUniquePtr<FWorker>         Worker;
-    TUniquePtr<FRunnableThread> WorkerThread;
+    // One llama_context of the pool with its own worker thread. Everything in here is only touched by
+    // that worker, except Load (dispatch) and the context itself during ResetContext.
+    struct FContextSlot
+    {
+        int32 Index = 0;
+        llama_context* Ctx = nullptr;
+
+        // pinned decode / prefill threads for Ctx and DraftCtx; empty when GameDirector.ThreadPool is 0
+        FDirectorThreadpools Threadpools;
+
+        // LoRA persona set on Ctx (INDEX_NONE = none); read by Dispatch to keep a persona on the context that has it
+        TAtomic<int32> ActivePersona{ INDEX_NONE };
+
+        // serialize llama_decode just in case; worker is single-threaded anyway
+        FCriticalSection DecodeMutex;
+
+        // jobs queued on or running in this slot; the dispatcher picks the lowest
+        TAtomic<int32> Load{ 0 };
+
+        // Polled by llama_decode through the abort callback: set on Shutdown, or points at the handle of the
+        // job being prefilled (a step batch is shared by every sequence, so only prefills abort per job)
+        TAtomic<bool> bAbortDecode{ false };
+        const FDirectorJobHandle* PrefillHandle = nullptr;
+
+        // per-request setup cost (ResetContext), logged so in-place clear vs. recreate can be compared
+        double ResetMsTotal = 0.0;
+        int64  ResetCount = 0;
+
+        // ---- system-prompt prefix cache ----
+        // KV state of a sequence right after the templated system block was decoded, keyed by a CRC of the
+        // rendered system text (it varies with Intent). Restored per request so only the user suffix is prefilled.
+        TMap<uint32, FPrefixSnapshot> PrefixCache;
+        FCriticalSection PrefixMutex;       // Export/ImportSession read and fill PrefixCache from other threads
+
+        TMap<FString, FConversation> Conversations;
+
+        TArray<FSequence> Sequences;
+        int32 NumActiveSequences = 0;
+        llama_batch StepBatch{};            // one token per active sequence, plus its draft or forced tokens
+
+        // draft model context, same sequence layout as Ctx; null when speculative decoding is off
+        llama_context* DraftCtx = nullptr;
+        llama_batch DraftBatch{};
+
+        // scratch for the full-vocab grammar mask, only used when the sampled token is rejected
+        std::vector<llama_token_data> GrammarCandidates;
+        std::vector<float>            MaskedLogits;
+
+        TUniquePtr<FWorker>         Worker;
+        TUniquePtr<FRunnableThread> WorkerThread;
+
+        bool HasActiveSequences() const { return NumActiveSequences > 0; }
+        bool HasFreeSequence() const { return NumActiveSequences < Sequences.Num(); }
+    };
+    TArray<TUniquePtr<FContextSlot>> Slots;
+
+    // Creates one pool context; returns null if llama_init_from_model fails
+    TUniquePtr<FContextSlot> CreateSlot(int32 Index, int32 NumSlots, int32 NumSeq, int32 n_vocab);
+    void FreeSlot(FContextSlot& Slot);
+
+    // Hands the job to the least-loaded context
+    void Dispatch(FJob&& Job);
+
+    // Initiate without the Shutdown; runs on the loader thread under InitiateAsync
+    bool Load(const FString& ModelPath, int32 ContextSize, int32 MaxSequences, int32 PoolSize, int32 ThreadsPerContext);
+    // Game thread, after Load: submits the held requests (or fails them with "{}")
+    void FinishLoad(bool bLoaded);
+    static bool LoadProgressCallback(float Progress, void* RunnerPtr);
+
+    // Loads the GameDirector.Personas adapters; ones that fail to load are left out
+    void LoadPersonas();
+    int32 FindPersona(const FString& Name) const;
+    // Sets the persona's adapter on the slot's context; only called while nothing is in flight there
+    void ApplyPersona(FContextSlot& Slot, int32 Persona);
+
+    // GenerateJSONAsync once the model is ready: decision cache, coalescing, then Dispatch
+    void SubmitRequest(const FString& Prompt, TFunction<void(FString)> OnDone, const FString& Intent,
+        TSharedPtr<FDirectorStream, ESPMode::ThreadSafe> Stream, const FDirectorJobOptions& Options,
+        const TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>& Handle);
+
+    // Scheduler steps (worker thread): admit a job into a free sequence (system prefix + prompt queued for prefill),
+    // then per step one prefill chunk and a single llama_decode advancing every generating sequence by one token.
+    void BeginSequence(FContextSlot& Slot, FJob&& Job);
+    void StepSequences(FContextSlot& Slot);
+    // Decodes the next chunk of the most urgent prefilling sequence; the last chunk samples its first token
+    void PrefillNextChunk(FContextSlot& Slot);
+    void SampleNext(FContextSlot& Slot, FSequence& Seq, const float* Logits);
+    // SampleNext in two halves: pick from one logits row (sampler + grammar, -1 if nothing is allowed), then commit the
+    // token (grammar state, text, stop checks). EmitToken returns false once the sequence has finished.
+    // bForced tokens are queued behind NextToken instead of replacing it.
+    int32 PickToken(FContextSlot& Slot, FSequence& Seq, const float* Logits);
+    bool EmitToken(FContextSlot& Slot, FSequence& Seq, llama_token Id, bool bForced = false);
+
+    // Stream text, JSON tracker and the job's FDirectorStream; shared by generated tokens and the assistant prefix
+    void AppendOutput(FSequence& Seq, const char* Bytes, int32 Len);
+
+    // Jump-forward: emits the literal the schema cursor says must come next as forced tokens
+    void QueueForcedTokens(FContextSlot& Slot, FSequence& Seq);
+    // Tokenizes the caller's assistant prefix plus, with jump-forward, the literal the schema forces after it.
+    // The grammar is advanced over the tokens; forced ones it rejects (e.g. an unknown intent) are left out.
+    void BuildAssistantPrefix(FSequence& Seq, const FJob& Job, std::vector<llama_token>& OutTokens, std::string& OutText);
+
+    // Speculative decoding: K greedy draft tokens per speculating sequence, then target verification of the step rows
+    void DraftProposals(FContextSlot& Slot, int32 K);
+    void VerifyDraft(FContextSlot& Slot, FSequence& Seq);
+    void DropDraftSequence(FContextSlot& Slot, FSequence& Seq);
+    void FinishSequence(FContextSlot& Slot, FSequence& Seq);
+    void CancelSequence(FContextSlot& Slot, FSequence& Seq);
+    void CompleteJob(FContextSlot& Slot, FJob& Job, FString Output);
+
+    // Attaches the job to an identical one in flight (returns true, nothing to dispatch), or registers it so
+    // later identical requests can attach to it
+    bool CoalesceOrRegister(FJob& Job, const TSharedRef<FDirectorJobHandle, ESPMode::ThreadSafe>& CallerHandle);
+    // Closes the job's in-flight entry: no caller can attach after this
+    void ForgetInFlight(const FJob& Job);
+
+    void ResetSlotContext(FContextSlot& Slot);
+
+    // Drops one sequence's KV cells. With nothing else in flight the whole context is reset instead.
+    void ClearSequence(FContextSlot& Slot, llama_seq_id SeqId);
+
+    // Mean-pooled embedding of the prompt text on EmbedCtx (Out has llama_model_n_embd floats); any worker thread
+    bool EmbedPrompt(const FString& Prompt, std::vector<float>& Out);
+
+    // Renders the system text for Intent and tokenizes the full chat prompt, after the conversation's turns if any
+    bool BuildPromptTokens(const FJob& Job, const FConversation* Conv, std::string& OutSystemUtf8, std::vector<llama_token>& OutTokens) const;
+
+    // Conversations (worker thread). AcquireSequence picks the job's sequence: the conversation's pinned one, else a free
+    // one (pinned to the conversation if fewer than all but one are pinned), evicting the least recently used idle
+    // conversation's KV when needed. ReuseConversation trims the pinned sequence to what the new prompt shares with it
+    // and returns how many tokens are kept, 0 if none.
+    FSequence* AcquireSequence(FContextSlot& Slot, FConversation* Conv, const FString& Key);
+    void UnpinSequence(FContextSlot& Slot, FSequence& Seq);
+    int32 ReuseConversation(FContextSlot& Slot, FSequence& Seq, FConversation& Conv, const std::vector<llama_token>& Tokens);
+    // Records the finished (or failed) turn and keeps or drops the sequence's KV accordingly
+    void EndConversationTurn(FContextSlot& Slot, FSequence& Seq, const FJob& Job, bool bCompleted);
+    void DropConversation(FContextSlot& Slot, const FString& Key);
+    // Session blob side of the conversations (worker thread)
+    void WriteConversations(FContextSlot& Slot, FArchive& Ar, int32& OutNum);
+    void RestoreConversation(FContextSlot& Slot, FSavedConversation&& Saved);
+
+    // Decodes Tokens[Begin..End) into SeqId starting at position Begin, in llama_decode calls of at most n_batch tokens.
+    // Logits only for the last token if requested. Ctx defaults to the slot's main context.
+    int32 DecodeTokens(FContextSlot& Slot, llama_seq_id SeqId, const std::vector<llama_token>& Tokens, int32 Begin, int32 End, bool bLogitsLast,
+        llama_context* Ctx = nullptr);
+
+    // Restores (or decodes and captures) the system prefix snapshot. Returns the number of prompt tokens now in the
+    // sequence, where chunked prefill picks up, or -1 on decode failure.
+    int32 PrefillSystemPrefix(FContextSlot& Slot, llama_seq_id SeqId, const std::string& SystemUtf8, const std::vector<llama_token>& Tokens);
+
+    static bool AbortDecodeCallback(void* SlotPtr);
 
-    void StartWorkerIfNeeded();
+    bool IsWorkerThread() const;
+    void StartWorkers();
 };
\ No newline at end of file
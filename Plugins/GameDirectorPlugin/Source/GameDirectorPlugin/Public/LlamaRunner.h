@@ -17,6 +17,9 @@
 #include <cfloat>
 #include <cmath>
 #include "HAL/PlatformProcess.h"
+#include "DirectorSampler.h"
+#include "JsonStreamTracker.h"
+#include "DirectorThreadpool.h"
 // If Unreal hasn't generated the module API macro yet, make it a no-op so this header still parses.
 #ifndef GAMEDIRECTORPLUGIN_API
 #define GAMEDIRECTORPLUGIN_API
@@ -65,6 +68,7 @@ private:
     llama_model* Model = nullptr;
     llama_context* Ctx = nullptr;
     const llama_vocab* Vocab = nullptr;
+    FDirectorThreadpools Threadpools;
 
     // Non-copyable
     LlamaRunner(const LlamaRunner&) = delete;